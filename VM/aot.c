@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "aot.h"
+#include "memory.h"
+#include "object.h"
+
+//Rebuilds a function and, through its constants, every function nested in
+//it. The function is left on the stack so the collector can see it while
+//the caller finishes with it.
+static ObjFunction* loadFunction(VM* vm, const AotProgram* program, int index) {
+	const AotFunction* source = &program -> functions[index];
+	ObjFunction* function = newFunction(vm);
+	push(vm, OBJ_VAL(function));
+	function -> arity = source -> arity;
+	function -> upvalueCount = source -> upvalueCount;
+	function -> maxSlots = source -> maxSlots;
+	function -> sharesClosure = source -> sharesClosure;
+	function -> flatUpvalues = ALLOCATE(vm, bool, source -> upvalueCount);
+	for (int i = 0; i < source -> upvalueCount; i++) {
+		function -> flatUpvalues[i] = source -> flatUpvalues[i];
+	}
+	if (source -> name != NULL)
+		function -> name = copyString(vm, source -> name, (int)strlen(source -> name));
+	for (int i = 0; i < source -> count; i++) {
+		writeChunk(vm, &function -> chunk, source -> code[i], source -> lines[i]);
+	}
+	for (int i = 0; i < source -> constantCount; i++) {
+		const AotConstant* constant = &source -> constants[i];
+		switch (constant -> type) {
+			case AOT_NUMBER:
+				addConstant(vm, &function -> chunk, NUMBER_VAL(constant -> number));
+				break;
+			case AOT_STRING:
+				addConstant(vm, &function -> chunk, OBJ_VAL(copyString(vm, constant -> chars, constant -> length)));
+				break;
+			case AOT_SHORT_STRING:
+				addConstant(vm, &function -> chunk, copyStringValue(vm, constant -> chars, constant -> length));
+				break;
+			case AOT_FUNCTION:
+				addConstant(vm, &function -> chunk, OBJ_VAL(loadFunction(vm, program, constant -> length)));
+				pop(vm);
+				break;
+		}
+	}
+	function -> aotCode = (void*)source -> native;
+	return function;
+}
+
+//Runs a program written by von --emit-c and returns the exit code von
+//would have for the same script.
+int runProgram(const AotProgram* program) {
+	VM vm;
+	initVM(&vm);
+	for (int i = 0; i < program -> globalCount; i++) {
+		const char* name = program -> globals[i];
+		if (globalSlot(&vm, copyString(&vm, name, (int)strlen(name))) != i) {
+			fprintf(stderr, "Program expects different natives than this runtime has.\n");
+			freeVM(&vm);
+			return 70;
+		}
+	}
+	ObjFunction* script = loadFunction(&vm, program, 0);
+	pop(&vm);
+	InterpretResult result = interpretFunction(&vm, script);
+	freeVM(&vm);
+	return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
@@ -0,0 +1,290 @@
+#ifndef Von_aot_h
+#define Von_aot_h
+
+#include <math.h>
+
+#include "common.h"
+#include "jit.h"
+#include "vm.h"
+
+//What von --emit-c writes for a script: the bytecode of every function,
+//which the runtime rebuilds the functions from, and a C function for each
+//that does what run() would. The C functions are JitFns and are entered
+//the same way as the JIT's code.
+
+typedef enum {
+	AOT_NUMBER,
+	AOT_STRING,
+	AOT_SHORT_STRING,
+	AOT_FUNCTION
+} AotConstantType;
+
+//A constant of a function. Strings use chars and length, and a function
+//constant is the index of that function in the program.
+typedef struct {
+	AotConstantType type;
+	double number;
+	const char* chars;
+	int length;
+} AotConstant;
+
+typedef struct {
+	const char* name;
+	int arity;
+	int upvalueCount;
+	int maxSlots;
+	bool sharesClosure;
+	const bool* flatUpvalues;
+	const uint8_t* code;
+	const int* lines;
+	int count;
+	const AotConstant* constants;
+	int constantCount;
+	JitFn native;
+} AotFunction;
+
+//functions[0] is the top-level script. globals names every global slot
+//in order, starting with the natives initVM() defines.
+typedef struct {
+	const AotFunction* functions;
+	int functionCount;
+	const char* const* globals;
+	int globalCount;
+} AotProgram;
+
+int runProgram(const AotProgram* program);
+
+//The generated code indexes the decoded instructions, so it has to be
+//built with the same superinstructions as the compiler that wrote it.
+#ifdef DEBUG_PROFILE_OPCODES
+#define AOT_FUSED 0
+#else
+#define AOT_FUSED 1
+#endif
+
+//What the generated functions are made of. They keep the stack top in sp
+//and publish it, with the ip, before anything that calls back into the VM.
+
+#define AOT_ENTER() \
+	Instr* code = vm -> frames[frameIndex].closure -> function -> code; \
+	Value* slots = vm -> frames[frameIndex].slots; \
+	Value* sp = vm -> stackTop; \
+	(void)code; \
+	(void)slots
+
+#define AOT_SYNC(i) (vm -> stackTop = sp, vm -> frames[frameIndex].ip = &code[(i) + 1])
+
+#define AOT_RELOAD() (slots = vm -> frames[frameIndex].slots, sp = vm -> stackTop)
+
+#define AOT_CHECK(call) \
+	do { \
+		if (!(call)) \
+			return JIT_ERROR; \
+		AOT_RELOAD(); \
+	} while (false)
+
+#define AOT_ERROR(i, message) \
+	do { \
+		AOT_SYNC(i); \
+		jitError(vm, message); \
+		return JIT_ERROR; \
+	} while (false)
+
+#define AOT_FALSEY(value) (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+
+#define AOT_UPVALUE(index) (*vm -> frames[frameIndex].closure -> upvalues[index].boxed -> location)
+
+#define AOT_FLAT_UPVALUE(index) (vm -> frames[frameIndex].closure -> upvalues[index].flat)
+
+#define AOT_PUSH(value) (*sp++ = (value))
+
+#define AOT_POP(count) (sp -= (count))
+
+#define AOT_SET_LOCAL(slot) (slots[slot] = sp[-1])
+
+#define AOT_SET_LOCAL_POP(slot) (slots[slot] = *--sp)
+
+#define AOT_DEFINE_GLOBAL(slot) (vm -> globalValues.values[slot] = *--sp)
+
+#define AOT_GET_GLOBAL(i, slot) \
+	do { \
+		Value value = vm -> globalValues.values[slot]; \
+		if (IS_UNDEFINED(value)) { \
+			AOT_SYNC(i); \
+			jitUndefinedGlobal(vm, slot); \
+			return JIT_ERROR; \
+		} \
+		AOT_PUSH(value); \
+	} while (false)
+
+#define AOT_SET_GLOBAL(i, slot) \
+	do { \
+		if (IS_UNDEFINED(vm -> globalValues.values[slot])) { \
+			AOT_SYNC(i); \
+			jitUndefinedGlobal(vm, slot); \
+			return JIT_ERROR; \
+		} \
+		vm -> globalValues.values[slot] = sp[-1]; \
+	} while (false)
+
+//Everything past the two-double fast paths, including the integer
+//operators, is left to the VM.
+#define AOT_ARITHMETIC(i, opcode) \
+	do { \
+		AOT_SYNC(i); \
+		AOT_CHECK(jitArithmetic(vm, opcode)); \
+	} while (false)
+
+#define AOT_BINARY(i, opcode, valueType, op) \
+	do { \
+		if (IS_NUMBERS(sp[-2], sp[-1])) { \
+			sp[-2] = valueType(AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1])); \
+			sp--; \
+		} \
+		else \
+			AOT_ARITHMETIC(i, opcode); \
+	} while (false)
+
+#define AOT_ADD(i) AOT_BINARY(i, OP_ADD, NUMBER_VAL, +)
+
+#define AOT_NEGATE(i) \
+	do { \
+		if (IS_NUMBER(sp[-1])) \
+			sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1])); \
+		else \
+			AOT_ARITHMETIC(i, OP_NEGATE); \
+	} while (false)
+
+#define AOT_NOT() (sp[-1] = BOOL_VAL(AOT_FALSEY(sp[-1])))
+
+#define AOT_EQUAL() (sp[-2] = BOOL_VAL(valuesEqual(sp[-2], sp[-1])), sp--)
+
+#define AOT_COMPARE_JUMP(i, op, label) \
+	do { \
+		bool holds; \
+		if (IS_NUMBERS(sp[-2], sp[-1])) \
+			holds = AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1]); \
+		else { \
+			AOT_SYNC(i); \
+			uint8_t result = jitCompare(vm, 1 op 0); \
+			if (result == 2) \
+				return JIT_ERROR; \
+			holds = result; \
+		} \
+		sp -= 2; \
+		if (!holds) \
+			goto label; \
+	} while (false)
+
+#define AOT_EQUAL_JUMP(label) \
+	do { \
+		sp -= 2; \
+		if (!valuesEqual(sp[0], sp[1])) \
+			goto label; \
+	} while (false)
+
+#define AOT_JUMP_IF_FALSE(label) \
+	do { \
+		if (AOT_FALSEY(sp[-1])) \
+			goto label; \
+	} while (false)
+
+#define AOT_PRINT(i) \
+	do { \
+		sp--; \
+		AOT_SYNC(i); \
+		jitPrint(vm, *sp); \
+	} while (false)
+
+#define AOT_CALL(i, argCount) \
+	do { \
+		AOT_SYNC(i); \
+		AOT_CHECK(jitCall(vm, argCount)); \
+	} while (false)
+
+#define AOT_TAIL_CALL(i, argCount) \
+	do { \
+		AOT_SYNC(i); \
+		JitStatus status = jitTailCall(vm, argCount); \
+		if (status != JIT_OK) \
+			return status; \
+		AOT_RELOAD(); \
+	} while (false)
+
+#define AOT_INVOKE(i, argCount) \
+	do { \
+		AOT_SYNC(i); \
+		AOT_CHECK(jitInvoke(vm, code[i].as.cache, argCount)); \
+	} while (false)
+
+#define AOT_SUPER_INVOKE(i, argCount) \
+	do { \
+		AOT_SYNC(i); \
+		AOT_CHECK(jitSuperInvoke(vm, code[i].as.cache, argCount)); \
+	} while (false)
+
+#define AOT_GET_PROPERTY(i) \
+	do { \
+		AOT_SYNC(i); \
+		AOT_CHECK(jitGetProperty(vm, code[i].as.cache)); \
+	} while (false)
+
+#define AOT_SET_PROPERTY(i) \
+	do { \
+		AOT_SYNC(i); \
+		AOT_CHECK(jitSetProperty(vm, code[i].as.cache)); \
+	} while (false)
+
+#define AOT_GET_SUPER(i) \
+	do { \
+		AOT_SYNC(i); \
+		AOT_CHECK(jitGetSuper(vm, code[i].as.name)); \
+	} while (false)
+
+#define AOT_INHERIT(i) \
+	do { \
+		AOT_SYNC(i); \
+		AOT_CHECK(jitInherit(vm)); \
+	} while (false)
+
+#define AOT_CLASS(i) \
+	do { \
+		AOT_SYNC(i); \
+		jitClass(vm, code[i].as.name); \
+		AOT_RELOAD(); \
+	} while (false)
+
+#define AOT_METHOD(i) \
+	do { \
+		AOT_SYNC(i); \
+		jitMethod(vm, code[i].as.name); \
+		AOT_RELOAD(); \
+	} while (false)
+
+#define AOT_CLOSURE(i) \
+	do { \
+		AOT_SYNC(i); \
+		jitClosure(vm, code[i].as.upvalues); \
+		AOT_RELOAD(); \
+	} while (false)
+
+#define AOT_CLOSE_UPVALUE(i) \
+	do { \
+		AOT_SYNC(i); \
+		jitCloseUpvalues(vm, sp - 1); \
+		sp--; \
+	} while (false)
+
+#define AOT_RETURN(i) \
+	do { \
+		if (vm -> openUpvalues != NULL) { \
+			AOT_SYNC(i); \
+			jitCloseUpvalues(vm, slots); \
+		} \
+		vm -> frameCount--; \
+		slots[0] = sp[-1]; \
+		vm -> stackTop = slots + 1; \
+		return JIT_OK; \
+	} while (false)
+
+#endif
@@ -0,0 +1,243 @@
+//mmap() and MAP_ANON are not part of C99.
+#define _DEFAULT_SOURCE
+
+#include "assembler.h"
+
+#ifdef JIT
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+void initAssembler(Assembler* as) {
+	as -> bytes = NULL;
+	as -> count = 0;
+	as -> capacity = 0;
+	as -> jumps = NULL;
+	as -> jumpLabels = NULL;
+	as -> jumpCount = 0;
+	as -> jumpCapacity = 0;
+	as -> exitLabel = 0;
+	as -> failed = false;
+}
+
+void freeAssembler(Assembler* as) {
+	free(as -> bytes);
+	free(as -> jumps);
+	free(as -> jumpLabels);
+	initAssembler(as);
+}
+
+//Copies the code into memory of its own and makes it executable. Returns
+//NULL if anything went wrong along the way.
+void* finishAssembler(Assembler* as, size_t* size) {
+	if (as -> failed || as -> count == 0) {
+		freeAssembler(as);
+		return NULL;
+	}
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	*size = ((size_t)as -> count + pageSize - 1) / pageSize * pageSize;
+	void* memory = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (memory == MAP_FAILED) {
+		freeAssembler(as);
+		return NULL;
+	}
+	memcpy(memory, as -> bytes, as -> count);
+	freeAssembler(as);
+	if (mprotect(memory, *size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(memory, *size);
+		return NULL;
+	}
+	return memory;
+}
+
+void freeCode(void* code, size_t size) {
+	if (code != NULL)
+		munmap(code, size);
+}
+
+void emitByte(Assembler* as, uint8_t byte) {
+	if (as -> count == as -> capacity) {
+		int capacity = as -> capacity < 256 ? 256 : as -> capacity * 2;
+		uint8_t* bytes = (uint8_t*)realloc(as -> bytes, capacity);
+		if (bytes == NULL) {
+			as -> failed = true;
+			as -> count = 0;
+			return;
+		}
+		as -> bytes = bytes;
+		as -> capacity = capacity;
+	}
+	as -> bytes[as -> count++] = byte;
+}
+
+void emit32(Assembler* as, uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		emitByte(as, (uint8_t)(value >> (8 * i)));
+	}
+}
+
+void emit64(Assembler* as, uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		emitByte(as, (uint8_t)(value >> (8 * i)));
+	}
+}
+
+void emitRex(Assembler* as, bool wide, int reg, int base) {
+	uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((base & 8) ? 0x01 : 0);
+	if (rex != 0x40)
+		emitByte(as, rex);
+}
+
+//A [base + disp32] operand.
+void emitMemory(Assembler* as, int reg, int base, int32_t disp) {
+	emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP)
+		emitByte(as, 0x24);
+	emit32(as, (uint32_t)disp);
+}
+
+void emitRegisters(Assembler* as, int reg, int rm) {
+	emitByte(as, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void emitLoad(Assembler* as, int dst, int base, int32_t disp) {
+	emitRex(as, true, dst, base);
+	emitByte(as, 0x8B);
+	emitMemory(as, dst, base, disp);
+}
+
+void emitStore(Assembler* as, int base, int32_t disp, int src) {
+	emitRex(as, true, src, base);
+	emitByte(as, 0x89);
+	emitMemory(as, src, base, disp);
+}
+
+void emitLea(Assembler* as, int dst, int base, int32_t disp) {
+	emitRex(as, true, dst, base);
+	emitByte(as, 0x8D);
+	emitMemory(as, dst, base, disp);
+}
+
+void emitLoadImmediate(Assembler* as, int dst, uint64_t value) {
+	emitRex(as, true, 0, dst);
+	emitByte(as, 0xB8 + (dst & 7));
+	emit64(as, value);
+}
+
+void emitArith(Assembler* as, uint8_t opcode, int dst, int src) {
+	emitRex(as, true, src, dst);
+	emitByte(as, opcode);
+	emitRegisters(as, src, dst);
+}
+
+//Sets the low byte of reg, which must be one of rax, rcx, rdx or rbx.
+void emitSetcc(Assembler* as, int condition, int reg) {
+	emitByte(as, 0x0F);
+	emitByte(as, 0x90 + condition);
+	emitRegisters(as, 0, reg);
+}
+
+void emitPush(Assembler* as, int reg) {
+	emitRex(as, false, 0, reg);
+	emitByte(as, 0x50 + (reg & 7));
+}
+
+void emitPop(Assembler* as, int reg) {
+	emitRex(as, false, 0, reg);
+	emitByte(as, 0x58 + (reg & 7));
+}
+
+void emitCall(Assembler* as, void* function) {
+	emitLoadImmediate(as, RAX, (uint64_t)(uintptr_t)function);
+	emitByte(as, 0xFF);
+	emitByte(as, 0xD0);
+}
+
+void emitSse(Assembler* as, uint8_t prefix, uint8_t opcode, int xmm, int base, int32_t disp) {
+	emitByte(as, prefix);
+	emitRex(as, false, xmm, base);
+	emitByte(as, 0x0F);
+	emitByte(as, opcode);
+	emitMemory(as, xmm, base, disp);
+}
+
+void emitSseRegisters(Assembler* as, uint8_t prefix, uint8_t opcode, int dst, int src) {
+	emitByte(as, prefix);
+	emitRex(as, false, dst, src);
+	emitByte(as, 0x0F);
+	emitByte(as, opcode);
+	emitRegisters(as, dst, src);
+}
+
+void emitMovqToXmm(Assembler* as, int xmm, int reg) {
+	emitByte(as, 0x66);
+	emitRex(as, true, xmm, reg);
+	emitByte(as, 0x0F);
+	emitByte(as, 0x6E);
+	emitRegisters(as, xmm, reg);
+}
+
+void emitMovqFromXmm(Assembler* as, int reg, int xmm) {
+	emitByte(as, 0x66);
+	emitRex(as, true, xmm, reg);
+	emitByte(as, 0x0F);
+	emitByte(as, 0x7E);
+	emitRegisters(as, xmm, reg);
+}
+
+//Emits a jump with a zero displacement and returns where the
+//displacement goes.
+int emitJump(Assembler* as, int condition) {
+	if (condition == CC_ALWAYS) {
+		emitByte(as, 0xE9);
+	}
+	else {
+		emitByte(as, 0x0F);
+		emitByte(as, 0x80 + condition);
+	}
+	emit32(as, 0);
+	return as -> count - 4;
+}
+
+void patchJump(Assembler* as, int at, int target) {
+	if (as -> failed)
+		return;
+	int32_t displacement = target - (at + 4);
+	memcpy(&as -> bytes[at], &displacement, sizeof(int32_t));
+}
+
+void emitJumpTo(Assembler* as, int condition, int target) {
+	patchJump(as, emitJump(as, condition), target);
+}
+
+void emitJumpToLabel(Assembler* as, int condition, int label) {
+	int at = emitJump(as, condition);
+	if (as -> jumpCount == as -> jumpCapacity) {
+		int capacity = as -> jumpCapacity < 16 ? 16 : as -> jumpCapacity * 2;
+		int* jumps = (int*)realloc(as -> jumps, sizeof(int) * capacity);
+		if (jumps != NULL)
+			as -> jumps = jumps;
+		int* labels = (int*)realloc(as -> jumpLabels, sizeof(int) * capacity);
+		if (labels != NULL)
+			as -> jumpLabels = labels;
+		if (jumps == NULL || labels == NULL) {
+			as -> failed = true;
+			return;
+		}
+		as -> jumpCapacity = capacity;
+	}
+	as -> jumps[as -> jumpCount] = at;
+	as -> jumpLabels[as -> jumpCount] = label;
+	as -> jumpCount++;
+}
+
+//Points every emitJumpToLabel() jump at the code offset of its label.
+void resolveLabels(Assembler* as, int* labels) {
+	for (int i = 0; i < as -> jumpCount; i++) {
+		patchJump(as, as -> jumps[i], labels[as -> jumpLabels[i]]);
+	}
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef Von_assembler_h
+#define Von_assembler_h
+
+#include "common.h"
+
+#ifdef JIT
+
+//Just enough of an x86-64 assembler for the JITs. Memory operands are
+//always [base + disp32].
+
+enum {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+//Condition codes as used by jcc and setcc.
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A 0x7
+#define CC_P 0xA
+#define CC_NP 0xB
+#define CC_ALWAYS -1
+
+//Opcodes for emitArith(), all in their op r/m64, r64 form.
+#define MOV 0x89
+#define ADD 0x01
+#define AND 0x21
+#define OR 0x09
+#define XOR 0x31
+#define CMP 0x39
+#define TEST 0x85
+
+//Scalar double opcodes for emitSse() and emitSseRegisters(). UCOMISD,
+//MOVAPD and XORPD take the 0x66 prefix, the rest 0xF2.
+#define MOVSD_LOAD 0x10
+#define MOVSD_STORE 0x11
+#define MOVAPD 0x28
+#define UCOMISD 0x2E
+#define XORPD 0x57
+#define ADDSD 0x58
+#define MULSD 0x59
+#define SUBSD 0x5C
+#define DIVSD 0x5E
+
+typedef struct {
+	uint8_t* bytes;
+	int count;
+	int capacity;
+	//Jumps to labels the caller numbers itself, patched by resolveLabels().
+	int* jumps;
+	int* jumpLabels;
+	int jumpCount;
+	int jumpCapacity;
+	//A shared exit generated code can jump to, for JITs that have one.
+	int exitLabel;
+	bool failed;
+} Assembler;
+
+void initAssembler(Assembler* as);
+void freeAssembler(Assembler* as);
+void* finishAssembler(Assembler* as, size_t* size);
+void freeCode(void* code, size_t size);
+
+void emitByte(Assembler* as, uint8_t byte);
+void emit32(Assembler* as, uint32_t value);
+void emit64(Assembler* as, uint64_t value);
+void emitRex(Assembler* as, bool wide, int reg, int base);
+void emitMemory(Assembler* as, int reg, int base, int32_t disp);
+void emitRegisters(Assembler* as, int reg, int rm);
+
+void emitLoad(Assembler* as, int dst, int base, int32_t disp);
+void emitStore(Assembler* as, int base, int32_t disp, int src);
+void emitLea(Assembler* as, int dst, int base, int32_t disp);
+void emitLoadImmediate(Assembler* as, int dst, uint64_t value);
+void emitArith(Assembler* as, uint8_t opcode, int dst, int src);
+void emitSetcc(Assembler* as, int condition, int reg);
+void emitPush(Assembler* as, int reg);
+void emitPop(Assembler* as, int reg);
+void emitCall(Assembler* as, void* function);
+
+void emitSse(Assembler* as, uint8_t prefix, uint8_t opcode, int xmm, int base, int32_t disp);
+void emitSseRegisters(Assembler* as, uint8_t prefix, uint8_t opcode, int dst, int src);
+void emitMovqToXmm(Assembler* as, int xmm, int reg);
+void emitMovqFromXmm(Assembler* as, int reg, int xmm);
+
+int emitJump(Assembler* as, int condition);
+void patchJump(Assembler* as, int at, int target);
+void emitJumpTo(Assembler* as, int condition, int target);
+void emitJumpToLabel(Assembler* as, int condition, int label);
+void resolveLabels(Assembler* as, int* labels);
+
+#endif
+
+#endif
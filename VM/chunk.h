@@ -42,6 +42,90 @@ typedef enum {
 	OP_SET_PROPERTY,
 	OP_GET_SUPER,
 	OP_METHOD,
+	OP_TAIL_CALL,
+	OP_MODULO,
+	OP_BIT_AND,
+	OP_BIT_OR,
+	OP_BIT_XOR,
+	OP_SHIFT_LEFT,
+	OP_SHIFT_RIGHT,
+	//Superinstructions. The compiler never emits these; decodeFunction()
+	//fuses the sequences they stand for. The set was picked from the
+	//n-gram counts DEBUG_PROFILE_OPCODES reports on the benchmarks.
+	OP_ADD_LOCALS,
+	OP_ADD_LOCAL_CONSTANT,
+	OP_SUBTRACT_LOCAL_CONSTANT,
+	OP_SET_LOCAL_POP,
+	OP_POPN,
+	OP_LESS_JUMP,
+	OP_GREATER_JUMP,
+	OP_EQUAL_JUMP,
+	OP_GET_LOCAL_PROPERTY,
+	//Quickened forms. run() rewrites a generic instruction into one of
+	//these once it has seen its operand types, and back again on a miss.
+	OP_ADD_NUM,
+	OP_ADD_STR,
+	OP_SUBTRACT_NUM,
+	OP_MULTIPLY_NUM,
+	OP_DIVIDE_NUM,
+	OP_LESS_NUM,
+	OP_GREATER_NUM,
+	//A loop whose back edge runs a compiled trace. Only ever set by run().
+	OP_LOOP_TRACE,
+	//An upvalue the closure holds by value. decodeFunction() reads the
+	//upvalues the compiler made flat with this instead of OP_GET_UPVALUE.
+	OP_GET_FLAT_UPVALUE,
+	//Register instructions. translateRegisters() rewrites a function into
+	//these when the VM runs in register mode. The registers are the frame's
+	//slots and an instruction names them in arg (A), arg2 (B) and arg3 (C).
+	OP_MOVE,
+	OP_LOAD_CONSTANT,
+	OP_LOAD_NIL,
+	OP_LOAD_BOOL,
+	OP_GET_GLOBAL_R,
+	OP_SET_GLOBAL_R,
+	OP_DEFINE_GLOBAL_R,
+	OP_GET_UPVALUE_R,
+	OP_SET_UPVALUE_R,
+	OP_GET_FLAT_UPVALUE_R,
+	OP_ADD_R,
+	OP_SUBTRACT_R,
+	OP_MULTIPLY_R,
+	OP_DIVIDE_R,
+	OP_MODULO_R,
+	OP_BIT_AND_R,
+	OP_BIT_OR_R,
+	OP_BIT_XOR_R,
+	OP_SHIFT_LEFT_R,
+	OP_SHIFT_RIGHT_R,
+	OP_GREATER_R,
+	OP_LESS_R,
+	OP_EQUAL_R,
+	OP_ADD_RK,
+	OP_SUBTRACT_RK,
+	OP_NEGATE_R,
+	OP_NOT_R,
+	OP_PRINT_R,
+	OP_TEST_JUMP,
+	OP_LESS_JUMP_R,
+	OP_GREATER_JUMP_R,
+	OP_EQUAL_JUMP_R,
+	//Stack instructions run from register code. Their operands have been
+	//moved to the top of the stack as the stack form expects, and arg3 is
+	//where the top is.
+	OP_CALL_R,
+	OP_TAIL_CALL_R,
+	OP_INVOKE_R,
+	OP_SUPER_INVOKE_R,
+	OP_CLOSURE_R,
+	OP_CLOSE_UPVALUE_R,
+	OP_CLASS_R,
+	OP_INHERIT_R,
+	OP_GET_PROPERTY_R,
+	OP_SET_PROPERTY_R,
+	OP_GET_SUPER_R,
+	OP_METHOD_R,
+	OP_RETURN_R,
 } OpCode;
 
 typedef struct {
@@ -53,8 +137,8 @@ typedef struct {
 } Chunk;
 
 void initChunk(Chunk* chunk);
-void freeChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t btye, int line);
-int addConstant(Chunk* chunk, Value value);
+void freeChunk(VM* vm, Chunk* chunk);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t btye, int line);
+int addConstant(VM* vm, Chunk* chunk, Value value);
 
 #endif
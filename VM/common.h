@@ -5,11 +5,30 @@
 #include <stddef.h>
 #include <stdint.h>
 
+typedef struct VM VM;
+
 #define NAN_BOXING
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 #define UINT8_COUNT (UINT8_MAX + 1)
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
+//Count opcode n-grams while running and report the most frequent ones
+//on exit. Used to pick which sequences get a superinstruction.
+//#define DEBUG_PROFILE_OPCODES
+
+//Threaded dispatch needs the GCC/Clang labels-as-values extension.
+//Build with -DNO_COMPUTED_GOTO to force the portable switch loop.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+//The baseline JIT emits x86-64 code for the System V ABI and relies on the
+//NaN-boxed value layout. Elsewhere, or built with -DNO_JIT, everything runs
+//in the interpreter.
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__)) && \
+	defined(NAN_BOXING) && !defined(NO_JIT)
+#define JIT
+#endif
 
 #endif
@@ -2,11 +2,12 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
 
-void disassembleChunk(Chunk* chunk, const char* name) {
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name) {
 	printf("== %s ==\n", name);
 	for (int offset = 0; offset < chunk -> count;) {
-		offset = disassembleInstruction(chunk, offset);
+		offset = disassembleInstruction(vm, chunk, offset);
 	}
 }
 
@@ -36,6 +37,13 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
 	return offset + 2;
 }
 
+static int globalInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+	int slot = (chunk -> code[offset + 1] << 8) | chunk -> code[offset + 2];
+	ObjString* global = globalName(vm, slot);
+	printf("%-16s %4d '%s'\n", name, slot, global == NULL ? "?" : global -> chars);
+	return offset + 3;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
 	uint8_t constant = chunk -> code[offset + 1];
 	uint8_t argCount = chunk -> code[offset + 2];
@@ -45,7 +53,7 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
 	return offset + 3;
 }
 
-int disassembleInstruction(Chunk* chunk, int offset) {
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
 	printf("%04d ", offset);
 
 	if (offset > 0 && chunk -> lines[offset] == chunk -> lines[offset - 1]) {
@@ -70,6 +78,18 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 			return simpleInstruction("OP_MULTIPLY", offset);
 		case OP_DIVIDE:
 			return simpleInstruction("OP_DIVIDE", offset);
+		case OP_MODULO:
+			return simpleInstruction("OP_MODULO", offset);
+		case OP_BIT_AND:
+			return simpleInstruction("OP_BIT_AND", offset);
+		case OP_BIT_OR:
+			return simpleInstruction("OP_BIT_OR", offset);
+		case OP_BIT_XOR:
+			return simpleInstruction("OP_BIT_XOR", offset);
+		case OP_SHIFT_LEFT:
+			return simpleInstruction("OP_SHIFT_LEFT", offset);
+		case OP_SHIFT_RIGHT:
+			return simpleInstruction("OP_SHIFT_RIGHT", offset);
 		case OP_NIL:
 			return simpleInstruction("OP_NIL", offset);
 		case OP_TRUE:
@@ -89,11 +109,11 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 		case OP_POP:
 			return simpleInstruction("OP_POP", offset);
 		case OP_DEFINE_GLOBAL:
-			return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+			return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
 		case OP_GET_GLOBAL:
-			return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+			return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
 		case OP_SET_GLOBAL:
-			return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+			return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
 		case OP_GET_LOCAL:
 			return byteInstruction("OP_GET_LOCAL", chunk, offset);
 		case OP_SET_LOCAL:
@@ -106,6 +126,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 			return jumpInstruction("OP_LOOP", -1, chunk, offset);
 		case OP_CALL:
 			return byteInstruction("OP_CALL", chunk, offset);
+		case OP_TAIL_CALL:
+			return byteInstruction("OP_TAIL_CALL", chunk, offset);
 		case OP_CLOSURE: {
 			offset++;
 			uint8_t constant = chunk -> code[offset++];
@@ -115,7 +137,7 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 
 			ObjFunction* function = AS_FUNCTION (chunk -> constants.values[constant]);
 			for (int j = 0; j < function -> upvalueCount; j++) {
-				int isLocal = chunk -> code[offset + 1];
+				int isLocal = chunk -> code[offset++];
 				int index = chunk -> code[offset++];
 				printf("%04d	|		%s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
 			}
@@ -150,3 +172,204 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 	}
 }
 
+
+static const char* opcodeNames[] = {
+	[OP_ADD] = "OP_ADD",
+	[OP_SUBTRACT] = "OP_SUBTRACT",
+	[OP_MULTIPLY] = "OP_MULTIPLY",
+	[OP_DIVIDE] = "OP_DIVIDE",
+	[OP_NEGATE] = "OP_NEGATE",
+	[OP_CONSTANT] = "OP_CONSTANT",
+	[OP_RETURN] = "OP_RETURN",
+	[OP_NIL] = "OP_NIL",
+	[OP_TRUE] = "OP_TRUE",
+	[OP_FALSE] = "OP_FALSE",
+	[OP_NOT] = "OP_NOT",
+	[OP_EQUAL] = "OP_EQUAL",
+	[OP_GREATER] = "OP_GREATER",
+	[OP_LESS] = "OP_LESS",
+	[OP_PRINT] = "OP_PRINT",
+	[OP_POP] = "OP_POP",
+	[OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+	[OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+	[OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+	[OP_GET_LOCAL] = "OP_GET_LOCAL",
+	[OP_SET_LOCAL] = "OP_SET_LOCAL",
+	[OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+	[OP_JUMP] = "OP_JUMP",
+	[OP_LOOP] = "OP_LOOP",
+	[OP_CALL] = "OP_CALL",
+	[OP_TAIL_CALL] = "OP_TAIL_CALL",
+	[OP_INVOKE] = "OP_INVOKE",
+	[OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+	[OP_CLOSURE] = "OP_CLOSURE",
+	[OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+	[OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+	[OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+	[OP_CLASS] = "OP_CLASS",
+	[OP_INHERIT] = "OP_INHERIT",
+	[OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+	[OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+	[OP_GET_SUPER] = "OP_GET_SUPER",
+	[OP_METHOD] = "OP_METHOD",
+	[OP_MODULO] = "OP_MODULO",
+	[OP_BIT_AND] = "OP_BIT_AND",
+	[OP_BIT_OR] = "OP_BIT_OR",
+	[OP_BIT_XOR] = "OP_BIT_XOR",
+	[OP_SHIFT_LEFT] = "OP_SHIFT_LEFT",
+	[OP_SHIFT_RIGHT] = "OP_SHIFT_RIGHT",
+	[OP_ADD_LOCALS] = "OP_ADD_LOCALS",
+	[OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+	[OP_SUBTRACT_LOCAL_CONSTANT] = "OP_SUBTRACT_LOCAL_CONSTANT",
+	[OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+	[OP_POPN] = "OP_POPN",
+	[OP_LESS_JUMP] = "OP_LESS_JUMP",
+	[OP_GREATER_JUMP] = "OP_GREATER_JUMP",
+	[OP_EQUAL_JUMP] = "OP_EQUAL_JUMP",
+	[OP_GET_LOCAL_PROPERTY] = "OP_GET_LOCAL_PROPERTY",
+	[OP_ADD_NUM] = "OP_ADD_NUM",
+	[OP_ADD_STR] = "OP_ADD_STR",
+	[OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+	[OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+	[OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+	[OP_LESS_NUM] = "OP_LESS_NUM",
+	[OP_GREATER_NUM] = "OP_GREATER_NUM",
+	[OP_LOOP_TRACE] = "OP_LOOP_TRACE",
+	[OP_GET_FLAT_UPVALUE] = "OP_GET_FLAT_UPVALUE",
+	[OP_MOVE] = "OP_MOVE",
+	[OP_LOAD_CONSTANT] = "OP_LOAD_CONSTANT",
+	[OP_LOAD_NIL] = "OP_LOAD_NIL",
+	[OP_LOAD_BOOL] = "OP_LOAD_BOOL",
+	[OP_GET_GLOBAL_R] = "OP_GET_GLOBAL_R",
+	[OP_SET_GLOBAL_R] = "OP_SET_GLOBAL_R",
+	[OP_DEFINE_GLOBAL_R] = "OP_DEFINE_GLOBAL_R",
+	[OP_GET_UPVALUE_R] = "OP_GET_UPVALUE_R",
+	[OP_SET_UPVALUE_R] = "OP_SET_UPVALUE_R",
+	[OP_GET_FLAT_UPVALUE_R] = "OP_GET_FLAT_UPVALUE_R",
+	[OP_ADD_R] = "OP_ADD_R",
+	[OP_SUBTRACT_R] = "OP_SUBTRACT_R",
+	[OP_MULTIPLY_R] = "OP_MULTIPLY_R",
+	[OP_DIVIDE_R] = "OP_DIVIDE_R",
+	[OP_MODULO_R] = "OP_MODULO_R",
+	[OP_BIT_AND_R] = "OP_BIT_AND_R",
+	[OP_BIT_OR_R] = "OP_BIT_OR_R",
+	[OP_BIT_XOR_R] = "OP_BIT_XOR_R",
+	[OP_SHIFT_LEFT_R] = "OP_SHIFT_LEFT_R",
+	[OP_SHIFT_RIGHT_R] = "OP_SHIFT_RIGHT_R",
+	[OP_GREATER_R] = "OP_GREATER_R",
+	[OP_LESS_R] = "OP_LESS_R",
+	[OP_EQUAL_R] = "OP_EQUAL_R",
+	[OP_ADD_RK] = "OP_ADD_RK",
+	[OP_SUBTRACT_RK] = "OP_SUBTRACT_RK",
+	[OP_NEGATE_R] = "OP_NEGATE_R",
+	[OP_NOT_R] = "OP_NOT_R",
+	[OP_PRINT_R] = "OP_PRINT_R",
+	[OP_TEST_JUMP] = "OP_TEST_JUMP",
+	[OP_LESS_JUMP_R] = "OP_LESS_JUMP_R",
+	[OP_GREATER_JUMP_R] = "OP_GREATER_JUMP_R",
+	[OP_EQUAL_JUMP_R] = "OP_EQUAL_JUMP_R",
+	[OP_CALL_R] = "OP_CALL_R",
+	[OP_TAIL_CALL_R] = "OP_TAIL_CALL_R",
+	[OP_INVOKE_R] = "OP_INVOKE_R",
+	[OP_SUPER_INVOKE_R] = "OP_SUPER_INVOKE_R",
+	[OP_CLOSURE_R] = "OP_CLOSURE_R",
+	[OP_CLOSE_UPVALUE_R] = "OP_CLOSE_UPVALUE_R",
+	[OP_CLASS_R] = "OP_CLASS_R",
+	[OP_INHERIT_R] = "OP_INHERIT_R",
+	[OP_GET_PROPERTY_R] = "OP_GET_PROPERTY_R",
+	[OP_SET_PROPERTY_R] = "OP_SET_PROPERTY_R",
+	[OP_GET_SUPER_R] = "OP_GET_SUPER_R",
+	[OP_METHOD_R] = "OP_METHOD_R",
+	[OP_RETURN_R] = "OP_RETURN_R",
+};
+
+const char* opcodeName(uint8_t opcode) {
+	if (opcode >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) || opcodeNames[opcode] == NULL) {
+		return "OP_UNKNOWN";
+	}
+	return opcodeNames[opcode];
+}
+
+#ifdef DEBUG_PROFILE_OPCODES
+
+#include <stdlib.h>
+
+#define PROFILE_TOP 20
+
+void initOpcodeProfile(OpcodeProfile* profile) {
+	int limit = PROFILE_OPCODE_LIMIT;
+	profile -> history[0] = -1;
+	profile -> history[1] = -1;
+	profile -> unigrams = calloc(limit, sizeof(uint64_t));
+	profile -> bigrams = calloc(limit * limit, sizeof(uint64_t));
+	profile -> trigrams = calloc(limit * limit * limit, sizeof(uint64_t));
+	if (profile -> unigrams == NULL || profile -> bigrams == NULL || profile -> trigrams == NULL)
+		exit(1);
+}
+
+void freeOpcodeProfile(OpcodeProfile* profile) {
+	free(profile -> unigrams);
+	free(profile -> bigrams);
+	free(profile -> trigrams);
+	profile -> unigrams = NULL;
+	profile -> bigrams = NULL;
+	profile -> trigrams = NULL;
+}
+
+void recordOpcode(OpcodeProfile* profile, uint8_t opcode) {
+	int limit = PROFILE_OPCODE_LIMIT;
+	int a = profile -> history[0];
+	int b = profile -> history[1];
+	profile -> unigrams[opcode]++;
+	if (b != -1) {
+		profile -> bigrams[b * limit + opcode]++;
+		if (a != -1) {
+			profile -> trigrams[(a * limit + b) * limit + opcode]++;
+		}
+	}
+	profile -> history[0] = b;
+	profile -> history[1] = opcode;
+}
+
+//Prints the n largest counts of an n-gram table, most frequent first.
+static void printTop(const char* title, uint64_t* counts, int size, int n, uint64_t total) {
+	bool* printed = calloc(size, sizeof(bool));
+	if (printed == NULL)
+		exit(1);
+	fprintf(stderr, "== %s ==\n", title);
+	for (int rank = 0; rank < PROFILE_TOP; rank++) {
+		int best = -1;
+		for (int i = 0; i < size; i++) {
+			if (!printed[i] && counts[i] > 0 && (best == -1 || counts[i] > counts[best]))
+				best = i;
+		}
+		if (best == -1)
+			break;
+		printed[best] = true;
+		fprintf(stderr, "%12llu %5.1f%% ", (unsigned long long)counts[best], 100.0 * counts[best] / total);
+		int divisor = 1;
+		for (int i = 1; i < n; i++)
+			divisor *= PROFILE_OPCODE_LIMIT;
+		for (int i = 0; i < n; i++) {
+			fprintf(stderr, " %s", opcodeName((uint8_t)(best / divisor % PROFILE_OPCODE_LIMIT)));
+			divisor /= PROFILE_OPCODE_LIMIT;
+		}
+		fprintf(stderr, "\n");
+	}
+	free(printed);
+}
+
+void printOpcodeProfile(OpcodeProfile* profile) {
+	int limit = PROFILE_OPCODE_LIMIT;
+	uint64_t total = 0;
+	for (int i = 0; i < limit; i++)
+		total += profile -> unigrams[i];
+	if (total == 0)
+		return;
+	fprintf(stderr, "%llu instructions\n", (unsigned long long)total);
+	printTop("opcodes", profile -> unigrams, limit, 1, total);
+	printTop("bigrams", profile -> bigrams, limit * limit, 2, total);
+	printTop("trigrams", profile -> trigrams, limit * limit * limit, 3, total);
+}
+
+#endif
@@ -3,8 +3,27 @@
 
 #include "chunk.h"
 
-void disassembleChunk(Chunk* chunk, const char* name);
-int disassembleInstruction(Chunk* chunk, int offset);
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name);
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset);
+const char* opcodeName(uint8_t opcode);
+
+#ifdef DEBUG_PROFILE_OPCODES
+
+#define PROFILE_OPCODE_LIMIT 128
+
+typedef struct {
+	int history[2];
+	uint64_t* unigrams;
+	uint64_t* bigrams;
+	uint64_t* trigrams;
+} OpcodeProfile;
+
+void initOpcodeProfile(OpcodeProfile* profile);
+void freeOpcodeProfile(OpcodeProfile* profile);
+void recordOpcode(OpcodeProfile* profile, uint8_t opcode);
+void printOpcodeProfile(OpcodeProfile* profile);
+
+#endif
 
 #endif
 
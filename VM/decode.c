@@ -0,0 +1,357 @@
+#include <stdlib.h>
+
+#include "decode.h"
+#include "memory.h"
+#include "registers.h"
+#include "vm.h"
+
+int instructionLength(Chunk* chunk, int offset) {
+	switch (chunk -> code[offset]) {
+		case OP_CONSTANT:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_CALL:
+		case OP_TAIL_CALL:
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+		case OP_CLASS:
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+		case OP_GET_SUPER:
+		case OP_METHOD:
+			return 2;
+		case OP_DEFINE_GLOBAL:
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP:
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+			return 3;
+		case OP_CLOSURE: {
+			ObjFunction* function = AS_FUNCTION(chunk -> constants.values[chunk -> code[offset + 1]]);
+			return 2 + 2 * function -> upvalueCount;
+		}
+		default:
+			return 1;
+	}
+}
+
+//Net change in stack height for an instruction. argCount is the argument
+//count of a call and is ignored for everything else.
+int stackEffect(uint8_t op, int argCount) {
+	switch (op) {
+		case OP_CONSTANT:
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_GET_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_GET_UPVALUE:
+		case OP_GET_FLAT_UPVALUE:
+		case OP_CLOSURE:
+		case OP_CLASS:
+			return 1;
+		case OP_POP:
+		case OP_DEFINE_GLOBAL:
+		case OP_SET_PROPERTY:
+		case OP_GET_SUPER:
+		case OP_EQUAL:
+		case OP_GREATER:
+		case OP_LESS:
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+		case OP_MODULO:
+		case OP_BIT_AND:
+		case OP_BIT_OR:
+		case OP_BIT_XOR:
+		case OP_SHIFT_LEFT:
+		case OP_SHIFT_RIGHT:
+		case OP_PRINT:
+		case OP_CLOSE_UPVALUE:
+		case OP_RETURN:
+		case OP_INHERIT:
+		case OP_METHOD:
+			return -1;
+		case OP_CALL:
+		case OP_TAIL_CALL:
+		case OP_INVOKE:
+			return -argCount;
+		case OP_SUPER_INVOKE:
+			return -argCount - 1;
+		default:
+			return 0;
+	}
+}
+
+static bool usesCache(uint8_t op) {
+	return op == OP_GET_PROPERTY || op == OP_SET_PROPERTY ||
+		op == OP_INVOKE || op == OP_SUPER_INVOKE;
+}
+
+static int jumpTarget(Chunk* chunk, int offset, int sign) {
+	uint16_t jump = (uint16_t)((chunk -> code[offset + 1] << 8) | chunk -> code[offset + 2]);
+	return offset + 3 + sign * jump;
+}
+
+//True when none of the n - 1 instructions after start is a jump target.
+static bool isFree(bool* isTarget, int start, int n, int count) {
+	for (int i = start + 1; i < start + n; i++) {
+		if (i >= count || isTarget[i])
+			return false;
+	}
+	return true;
+}
+
+static bool isOp(Instr* code, int count, int index, uint8_t op) {
+	return index < count && code[index].op == op;
+}
+
+//Folds the sequences that have a superinstruction into one Instr,
+//compacting code, offsets and targets in place. A sequence is only fused
+//when none of its instructions but the first is a jump target. Returns the
+//new instruction count.
+static int fuseSuperinstructions(VM* vm, Instr* code, int* offsets, int* targets, int count) {
+	bool* isTarget = ALLOCATE(vm, bool, count + 1);
+	int* newIndex = ALLOCATE(vm, int, count + 1);
+	for (int i = 0; i <= count; i++)
+		isTarget[i] = false;
+	for (int i = 0; i < count; i++) {
+		if (targets[i] == -1)
+			continue;
+		isTarget[targets[i]] = true;
+		//A fused compare-and-branch may skip the POP at its target.
+		if (code[i].op == OP_JUMP_IF_FALSE && isOp(code, count, targets[i], OP_POP))
+			isTarget[targets[i] + 1] = true;
+	}
+
+	int out = 0;
+	for (int i = 0; i < count;) {
+		Instr fused = code[i];
+		int target = targets[i];
+		int length = 1;
+
+		#define FREE_RUN(n) (isFree(isTarget, i, (n), count))
+		switch (code[i].op) {
+			case OP_GET_LOCAL:
+				if (isOp(code, count, i + 1, OP_GET_LOCAL) && isOp(code, count, i + 2, OP_ADD) && FREE_RUN(3)) {
+					fused.op = OP_ADD_LOCALS;
+					fused.arg2 = code[i + 1].arg;
+					length = 3;
+				}
+				else if (isOp(code, count, i + 1, OP_CONSTANT) && isOp(code, count, i + 2, OP_ADD) && FREE_RUN(3)) {
+					fused.op = OP_ADD_LOCAL_CONSTANT;
+					fused.as.constant = code[i + 1].as.constant;
+					length = 3;
+				}
+				else if (isOp(code, count, i + 1, OP_CONSTANT) && isOp(code, count, i + 2, OP_SUBTRACT) && FREE_RUN(3)) {
+					fused.op = OP_SUBTRACT_LOCAL_CONSTANT;
+					fused.as.constant = code[i + 1].as.constant;
+					length = 3;
+				}
+				else if (isOp(code, count, i + 1, OP_GET_PROPERTY) && FREE_RUN(2)) {
+					fused.op = OP_GET_LOCAL_PROPERTY;
+					fused.as.cache = code[i + 1].as.cache;
+					length = 2;
+				}
+				break;
+			case OP_SET_LOCAL:
+				if (isOp(code, count, i + 1, OP_POP) && FREE_RUN(2)) {
+					fused.op = OP_SET_LOCAL_POP;
+					length = 2;
+				}
+				break;
+			case OP_POP:
+				while (length < UINT8_MAX && isOp(code, count, i + length, OP_POP) && FREE_RUN(length + 1)) {
+					length++;
+				}
+				if (length > 1) {
+					fused.op = OP_POPN;
+					fused.arg = (uint8_t)length;
+				}
+				break;
+			case OP_LESS:
+			case OP_GREATER:
+			case OP_EQUAL: {
+				//Compare, branch and pop the condition in one go. The false
+				//branch lands on the POP that discards the condition there,
+				//so it is skipped as well.
+				int jump = i + 1;
+				if (isOp(code, count, jump, OP_JUMP_IF_FALSE) && isOp(code, count, i + 2, OP_POP) &&
+						isOp(code, count, targets[jump], OP_POP) && FREE_RUN(3)) {
+					fused.op = code[i].op == OP_LESS ? OP_LESS_JUMP :
+						code[i].op == OP_GREATER ? OP_GREATER_JUMP : OP_EQUAL_JUMP;
+					target = targets[jump] + 1;
+					length = 3;
+				}
+				break;
+			}
+			default:
+				break;
+		}
+		#undef FREE_RUN
+
+		for (int j = 0; j < length; j++)
+			newIndex[i + j] = out;
+		code[out] = fused;
+		offsets[out] = offsets[i];
+		targets[out] = target;
+		out++;
+		i += length;
+	}
+	newIndex[count] = out;
+
+	for (int i = 0; i < out; i++) {
+		if (targets[i] != -1)
+			targets[i] = newIndex[targets[i]];
+	}
+	FREE_ARRAY(vm, bool, isTarget, count + 1);
+	FREE_ARRAY(vm, int, newIndex, count + 1);
+	return out;
+}
+
+Instr* decodeFunction(VM* vm, ObjFunction* function, void* const* handlers) {
+	Chunk* chunk = &function -> chunk;
+
+	//First pass: number the instructions so jump offsets can be turned
+	//into pointers.
+	int* indexOf = ALLOCATE(vm, int, chunk -> count + 1);
+	int count = 0;
+	for (int offset = 0; offset < chunk -> count; offset += instructionLength(chunk, offset)) {
+		indexOf[offset] = count++;
+	}
+	indexOf[chunk -> count] = count;
+
+	int cacheCount = 0;
+	for (int offset = 0; offset < chunk -> count; offset += instructionLength(chunk, offset)) {
+		if (usesCache(chunk -> code[offset]))
+			cacheCount++;
+	}
+	InlineCache* caches = ALLOCATE(vm, InlineCache, cacheCount);
+	for (int i = 0; i < cacheCount; i++) {
+		caches[i].name = NULL;
+		caches[i].count = 0;
+		caches[i].megamorphic = false;
+	}
+	function -> caches = caches;
+	function -> cacheCount = cacheCount;
+
+	Instr* code = ALLOCATE(vm, Instr, count);
+	int* offsets = ALLOCATE(vm, int, count);
+	int* targets = ALLOCATE(vm, int, count);
+	Value* constants = chunk -> constants.values;
+	InlineCache* nextCache = caches;
+
+	int i = 0;
+	for (int offset = 0; offset < chunk -> count; offset += instructionLength(chunk, offset), i++) {
+		Instr* instr = &code[i];
+		uint8_t op = chunk -> code[offset];
+		instr -> op = op;
+		instr -> arg = 0;
+		instr -> arg2 = 0;
+		instr -> arg3 = 0;
+		instr -> as.constant = NULL;
+		offsets[i] = offset;
+		targets[i] = -1;
+
+		switch (op) {
+			case OP_CONSTANT:
+				instr -> as.constant = &constants[chunk -> code[offset + 1]];
+				break;
+			case OP_DEFINE_GLOBAL:
+			case OP_GET_GLOBAL:
+			case OP_SET_GLOBAL:
+				instr -> as.slot = (chunk -> code[offset + 1] << 8) | chunk -> code[offset + 2];
+				break;
+			case OP_CLASS:
+			case OP_GET_SUPER:
+			case OP_METHOD:
+				instr -> as.name = AS_STRING(constants[chunk -> code[offset + 1]]);
+				break;
+			case OP_GET_PROPERTY:
+			case OP_SET_PROPERTY:
+				instr -> as.cache = nextCache++;
+				instr -> as.cache -> name = AS_STRING(constants[chunk -> code[offset + 1]]);
+				break;
+			case OP_GET_LOCAL:
+			case OP_SET_LOCAL:
+			case OP_CALL:
+			case OP_TAIL_CALL:
+			case OP_SET_UPVALUE:
+				instr -> arg = chunk -> code[offset + 1];
+				break;
+			//Not an optimization that can be left out: a flat upvalue has
+			//no ObjUpvalue to read through.
+			case OP_GET_UPVALUE:
+				instr -> arg = chunk -> code[offset + 1];
+				if (function -> flatUpvalues[instr -> arg])
+					instr -> op = OP_GET_FLAT_UPVALUE;
+				break;
+			case OP_JUMP:
+			case OP_JUMP_IF_FALSE:
+				targets[i] = indexOf[jumpTarget(chunk, offset, 1)];
+				break;
+			case OP_LOOP:
+				targets[i] = indexOf[jumpTarget(chunk, offset, -1)];
+				break;
+			case OP_INVOKE:
+			case OP_SUPER_INVOKE:
+				instr -> as.cache = nextCache++;
+				instr -> as.cache -> name = AS_STRING(constants[chunk -> code[offset + 1]]);
+				instr -> arg = chunk -> code[offset + 2];
+				break;
+			case OP_CLOSURE:
+				//The function constant is the byte just before the trailer.
+				instr -> as.upvalues = &chunk -> code[offset + 2];
+				break;
+			default:
+				break;
+		}
+	}
+	FREE_ARRAY(vm, int, indexOf, chunk -> count + 1);
+
+	//Register mode replaces the stack code outright. The profiler wants to
+	//see the instructions the compiler emitted otherwise.
+	int fusedCount = vm -> registerMode ? translateRegisters(vm, function, &code, &offsets, &targets, count) : -1;
+	int targetCount = fusedCount;
+	if (fusedCount == -1) {
+		targetCount = count;
+#ifndef DEBUG_PROFILE_OPCODES
+		fusedCount = fuseSuperinstructions(vm, code, offsets, targets, count);
+		code = GROW_ARRAY(vm, Instr, code, count, fusedCount);
+		offsets = GROW_ARRAY(vm, int, offsets, count, fusedCount);
+#else
+		fusedCount = count;
+#endif
+	}
+
+	//Jump targets become pointers only once the array has its final place.
+	for (int j = 0; j < fusedCount; j++) {
+#ifdef COMPUTED_GOTO
+		code[j].handler = handlers != NULL ? handlers[code[j].op] : NULL;
+#endif
+		if (targets[j] != -1)
+			code[j].as.target = &code[targets[j]];
+	}
+	FREE_ARRAY(vm, int, targets, targetCount);
+	count = fusedCount;
+
+	function -> code = code;
+	function -> codeOffsets = offsets;
+	function -> codeCount = count;
+	return code;
+}
+
+void freeDecodedCode(VM* vm, ObjFunction* function) {
+	FREE_ARRAY(vm, Instr, function -> code, function -> codeCount);
+	FREE_ARRAY(vm, int, function -> codeOffsets, function -> codeCount);
+	FREE_ARRAY(vm, InlineCache, function -> caches, function -> cacheCount);
+	function -> code = NULL;
+	function -> caches = NULL;
+	function -> cacheCount = 0;
+	function -> codeOffsets = NULL;
+	function -> codeCount = 0;
+}
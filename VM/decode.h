@@ -0,0 +1,65 @@
+#ifndef Von_decode_h
+#define Von_decode_h
+
+#include "common.h"
+#include "object.h"
+
+#define CACHE_ENTRIES 4
+
+typedef enum {
+	CACHE_FIELD,
+	CACHE_ADD_FIELD,
+	CACHE_METHOD
+} CacheKind;
+
+//What one receiver shape resolved to at a call site: a field at a known
+//slot, the transition taken when a store adds that field, or a method of
+//the class.
+typedef struct {
+	ObjClass* klass;
+	Shape* shape;
+	Shape* transition;
+	CacheKind kind;
+	int index;
+	Value method;
+} CacheEntry;
+
+//Per-site inline cache for property access and method invocation. It
+//holds up to CACHE_ENTRIES receivers and goes megamorphic after that.
+typedef struct InlineCache {
+	ObjString* name;
+	int count;
+	bool megamorphic;
+	CacheEntry entries[CACHE_ENTRIES];
+} InlineCache;
+
+//One pre-decoded instruction. Operands are resolved once when a function
+//is first called so run() never has to parse the bytecode again.
+typedef struct Instr {
+#ifdef COMPUTED_GOTO
+	void* handler;
+#endif
+	union {
+		Value* constant;
+		ObjString* name;
+		struct Instr* target;
+		const uint8_t* upvalues;
+		InlineCache* cache;
+		int slot;
+#ifdef JIT
+		struct Trace* trace;
+#endif
+	} as;
+	uint8_t op;
+	uint8_t arg;
+	uint8_t arg2;
+	//Only register instructions use a third operand.
+	uint8_t arg3;
+} Instr;
+
+int instructionLength(Chunk* chunk, int offset);
+int stackEffect(uint8_t op, int argCount);
+Instr* decodeFunction(VM* vm, ObjFunction* function, void* const* handlers);
+void freeDecodedCode(VM* vm, ObjFunction* function);
+
+#endif
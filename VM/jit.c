@@ -0,0 +1,574 @@
+#include "jit.h"
+
+#ifdef JIT
+
+#include <stdlib.h>
+
+#include "assembler.h"
+#include "trace.h"
+#include "vm.h"
+
+//A template JIT. Every decoded instruction of a function becomes a fixed
+//sequence of x86-64 code: loads, stores, number arithmetic, comparisons
+//and jumps are inlined, and anything that allocates, calls or fails goes
+//through the jit*() entry points in vm.c. Compiled code keeps the
+//interpreter's frames and value stack, so the collector and the two kinds
+//of frames never need to know about each other.
+//
+//Register use inside compiled code, all callee-saved:
+//  rbx  the value stack top, written back to vm -> stackTop before any call
+//  r12  the VM
+//  r13  the frame's slots, reloaded after anything that can grow the stack
+//  r14  the frame's byte offset into vm -> frames, which can move too
+
+#define STACK_TOP RBX
+#define VM_REGISTER R12
+#define SLOTS R13
+#define FRAME_OFFSET R14
+
+static void emitEpilogue(Assembler* as) {
+	emitPop(as, R15);
+	emitPop(as, R14);
+	emitPop(as, R13);
+	emitPop(as, R12);
+	emitPop(as, RBX);
+	emitByte(as, 0xC3);
+}
+
+static void pushValue(Assembler* as, int reg) {
+	emitStore(as, STACK_TOP, 0, reg);
+	emitLea(as, STACK_TOP, STACK_TOP, 8);
+}
+
+static void popValues(Assembler* as, int count) {
+	emitLea(as, STACK_TOP, STACK_TOP, -8 * count);
+}
+
+static void loadFrame(Assembler* as, int dst) {
+	emitLoad(as, dst, VM_REGISTER, offsetof(VM, frames));
+	emitArith(as, ADD, dst, FRAME_OFFSET);
+}
+
+//Picks the stack and slots back up after a call into the VM.
+static void reload(Assembler* as) {
+	loadFrame(as, RAX);
+	emitLoad(as, SLOTS, RAX, offsetof(CallFrame, slots));
+	emitLoad(as, STACK_TOP, VM_REGISTER, offsetof(VM, stackTop));
+}
+
+//Publishes the stack top and the ip run() would have at this point, so the
+//VM sees a consistent frame and error reports get the right line.
+static void beforeCall(Assembler* as, Instr* next) {
+	emitStore(as, VM_REGISTER, offsetof(VM, stackTop), STACK_TOP);
+	loadFrame(as, RAX);
+	emitLoadImmediate(as, RCX, (uint64_t)(uintptr_t)next);
+	emitStore(as, RAX, offsetof(CallFrame, ip), RCX);
+	emitArith(as, MOV, RDI, VM_REGISTER);
+}
+
+static void checkResult(Assembler* as) {
+	emitByte(as, 0x84);
+	emitByte(as, 0xC0);
+	emitJumpTo(as, CC_E, as -> exitLabel);
+}
+
+//Jumps to the returned positions unless rax and rcx are both numbers.
+static void checkNumbers(Assembler* as, int* notNumbers) {
+	emitLoadImmediate(as, RDX, QNAN);
+	emitArith(as, MOV, RSI, RAX);
+	emitArith(as, AND, RSI, RDX);
+	emitArith(as, CMP, RSI, RDX);
+	notNumbers[0] = emitJump(as, CC_E);
+	emitArith(as, MOV, RSI, RCX);
+	emitArith(as, AND, RSI, RDX);
+	emitArith(as, CMP, RSI, RDX);
+	notNumbers[1] = emitJump(as, CC_E);
+}
+
+static void loadOperands(Assembler* as) {
+	emitLoad(as, RAX, STACK_TOP, -16);
+	emitLoad(as, RCX, STACK_TOP, -8);
+}
+
+//Hands the operator to the VM, for operands that are not both doubles.
+static void emitArithmetic(Assembler* as, uint8_t op, Instr* next) {
+	beforeCall(as, next);
+	emitLoadImmediate(as, RSI, op);
+	emitCall(as, (void*)jitArithmetic);
+	checkResult(as);
+	reload(as);
+}
+
+//Arithmetic on the top two values, inline when they are both doubles.
+static void emitBinary(Assembler* as, uint8_t sseOp, uint8_t op, Instr* next) {
+	int notNumbers[2];
+	loadOperands(as);
+	checkNumbers(as, notNumbers);
+	emitSse(as, 0xF2, MOVSD_LOAD, 0, STACK_TOP, -16);
+	emitSse(as, 0xF2, sseOp, 0, STACK_TOP, -8);
+	emitSse(as, 0xF2, MOVSD_STORE, 0, STACK_TOP, -16);
+	popValues(as, 1);
+	int done = emitJump(as, CC_ALWAYS);
+
+	patchJump(as, notNumbers[0], as -> count);
+	patchJump(as, notNumbers[1], as -> count);
+	emitArithmetic(as, op, next);
+	patchJump(as, done, as -> count);
+}
+
+//Compares the top two numbers, leaving the flags set so that CC_A means
+//the comparison holds.
+static void emitCompare(Assembler* as, bool greater, Instr* next) {
+	int notNumbers[2];
+	loadOperands(as);
+	checkNumbers(as, notNumbers);
+	//ucomisd sets "above" only for an ordered result, so NaN compares false
+	//like it does in C.
+	if (greater) {
+		emitSse(as, 0xF2, MOVSD_LOAD, 0, STACK_TOP, -16);
+		emitSse(as, 0x66, UCOMISD, 0, STACK_TOP, -8);
+	}
+	else {
+		emitSse(as, 0xF2, MOVSD_LOAD, 0, STACK_TOP, -8);
+		emitSse(as, 0x66, UCOMISD, 0, STACK_TOP, -16);
+	}
+	int done = emitJump(as, CC_ALWAYS);
+
+	//Anything else is compared by the VM, and its answer turned back into
+	//flags: movzx eax, al, then above zero when it holds.
+	patchJump(as, notNumbers[0], as -> count);
+	patchJump(as, notNumbers[1], as -> count);
+	beforeCall(as, next);
+	emitLoadImmediate(as, RSI, greater);
+	emitCall(as, (void*)jitCompare);
+	emitByte(as, 0x0F);
+	emitByte(as, 0xB6);
+	emitByte(as, 0xC0);
+	emitLoadImmediate(as, RCX, 2);
+	emitArith(as, CMP, RAX, RCX);
+	emitJumpTo(as, CC_E, as -> exitLabel);
+	emitLoadImmediate(as, RCX, 0);
+	emitArith(as, CMP, RAX, RCX);
+	patchJump(as, done, as -> count);
+}
+
+//Turns the low byte of rax into a Von bool at the new top of the stack.
+static void storeBool(Assembler* as) {
+	emitByte(as, 0x0F);
+	emitByte(as, 0xB6);
+	emitByte(as, 0xC0);
+	emitLoadImmediate(as, RCX, FALSE_VAL);
+	emitArith(as, OR, RAX, RCX);
+	emitStore(as, STACK_TOP, -8, RAX);
+}
+
+static void emitValuesEqual(Assembler* as) {
+	emitLoad(as, RDI, STACK_TOP, -16);
+	emitLoad(as, RSI, STACK_TOP, -8);
+	emitCall(as, (void*)valuesEqual);
+}
+
+//Jumps to the given instruction when rax holds nil or false.
+static void jumpIfFalsey(Assembler* as, int index) {
+	emitLoadImmediate(as, RCX, NIL_VAL);
+	emitArith(as, CMP, RAX, RCX);
+	emitJumpToLabel(as, CC_E, index);
+	emitLoadImmediate(as, RCX, FALSE_VAL);
+	emitArith(as, CMP, RAX, RCX);
+	emitJumpToLabel(as, CC_E, index);
+}
+
+static void loadUpvalue(Assembler* as, int slot) {
+	loadFrame(as, RAX);
+	emitLoad(as, RAX, RAX, offsetof(CallFrame, closure));
+	emitLoad(as, RAX, RAX, offsetof(ObjClosure, upvalues) + 8 * slot);
+	emitLoad(as, RCX, RAX, offsetof(ObjUpvalue, location));
+}
+
+static void checkGlobal(Assembler* as, int slot, Instr* next) {
+	emitLoad(as, RCX, VM_REGISTER, offsetof(VM, globalValues) + offsetof(ValueArray, values));
+	emitLoad(as, RAX, RCX, 8 * slot);
+	emitLoadImmediate(as, RDX, UNDEFINED_VAL);
+	emitArith(as, CMP, RAX, RDX);
+	int defined = emitJump(as, CC_NE);
+	beforeCall(as, next);
+	emitLoadImmediate(as, RSI, (uint64_t)slot);
+	emitCall(as, (void*)jitUndefinedGlobal);
+	emitJumpTo(as, CC_ALWAYS, as -> exitLabel);
+	patchJump(as, defined, as -> count);
+}
+
+static void emitGetProperty(Assembler* as, InlineCache* cache, Instr* next) {
+	beforeCall(as, next);
+	emitLoadImmediate(as, RSI, (uint64_t)(uintptr_t)cache);
+	emitCall(as, (void*)jitGetProperty);
+	checkResult(as);
+	reload(as);
+}
+
+static bool isSupported(uint8_t op) {
+	switch (op) {
+		case OP_CLASS:
+		case OP_INHERIT:
+		case OP_METHOD:
+		case OP_GET_SUPER:
+		case OP_SUPER_INVOKE:
+			return false;
+		default:
+			return true;
+	}
+}
+
+static void emitInstruction(Assembler* as, Instr* code, int index) {
+	Instr* instr = &code[index];
+	Instr* next = instr + 1;
+	switch (instr -> op) {
+		case OP_CONSTANT:
+			emitLoadImmediate(as, RAX, *instr -> as.constant);
+			pushValue(as, RAX);
+			break;
+		case OP_NIL:
+			emitLoadImmediate(as, RAX, NIL_VAL);
+			pushValue(as, RAX);
+			break;
+		case OP_TRUE:
+			emitLoadImmediate(as, RAX, TRUE_VAL);
+			pushValue(as, RAX);
+			break;
+		case OP_FALSE:
+			emitLoadImmediate(as, RAX, FALSE_VAL);
+			pushValue(as, RAX);
+			break;
+		case OP_POP:
+			popValues(as, 1);
+			break;
+		case OP_POPN:
+			popValues(as, instr -> arg);
+			break;
+		case OP_GET_LOCAL:
+			emitLoad(as, RAX, SLOTS, 8 * instr -> arg);
+			pushValue(as, RAX);
+			break;
+		case OP_SET_LOCAL:
+			emitLoad(as, RAX, STACK_TOP, -8);
+			emitStore(as, SLOTS, 8 * instr -> arg, RAX);
+			break;
+		case OP_SET_LOCAL_POP:
+			popValues(as, 1);
+			emitLoad(as, RAX, STACK_TOP, 0);
+			emitStore(as, SLOTS, 8 * instr -> arg, RAX);
+			break;
+		case OP_DEFINE_GLOBAL:
+			popValues(as, 1);
+			emitLoad(as, RAX, STACK_TOP, 0);
+			emitLoad(as, RCX, VM_REGISTER, offsetof(VM, globalValues) + offsetof(ValueArray, values));
+			emitStore(as, RCX, 8 * instr -> as.slot, RAX);
+			break;
+		case OP_GET_GLOBAL:
+			checkGlobal(as, instr -> as.slot, next);
+			pushValue(as, RAX);
+			break;
+		case OP_SET_GLOBAL:
+			checkGlobal(as, instr -> as.slot, next);
+			emitLoad(as, RAX, STACK_TOP, -8);
+			emitStore(as, RCX, 8 * instr -> as.slot, RAX);
+			break;
+		case OP_GET_UPVALUE:
+			loadUpvalue(as, instr -> arg);
+			emitLoad(as, RAX, RCX, 0);
+			pushValue(as, RAX);
+			break;
+		case OP_GET_FLAT_UPVALUE:
+			loadFrame(as, RAX);
+			emitLoad(as, RAX, RAX, offsetof(CallFrame, closure));
+			emitLoad(as, RAX, RAX, offsetof(ObjClosure, upvalues) + 8 * instr -> arg);
+			pushValue(as, RAX);
+			break;
+		case OP_SET_UPVALUE:
+			loadUpvalue(as, instr -> arg);
+			emitLoad(as, RAX, STACK_TOP, -8);
+			emitStore(as, RCX, 0, RAX);
+			break;
+		case OP_ADD:
+		case OP_ADD_NUM:
+		case OP_ADD_STR:
+			emitBinary(as, ADDSD, OP_ADD, next);
+			break;
+		case OP_SUBTRACT:
+		case OP_SUBTRACT_NUM:
+			emitBinary(as, SUBSD, OP_SUBTRACT, next);
+			break;
+		case OP_MULTIPLY:
+		case OP_MULTIPLY_NUM:
+			emitBinary(as, MULSD, OP_MULTIPLY, next);
+			break;
+		case OP_DIVIDE:
+		case OP_DIVIDE_NUM:
+			emitBinary(as, DIVSD, OP_DIVIDE, next);
+			break;
+		case OP_MODULO:
+		case OP_BIT_AND:
+		case OP_BIT_OR:
+		case OP_BIT_XOR:
+		case OP_SHIFT_LEFT:
+		case OP_SHIFT_RIGHT:
+			emitArithmetic(as, instr -> op, next);
+			break;
+		case OP_ADD_LOCALS:
+			emitLoad(as, RAX, SLOTS, 8 * instr -> arg);
+			pushValue(as, RAX);
+			emitLoad(as, RAX, SLOTS, 8 * instr -> arg2);
+			pushValue(as, RAX);
+			emitBinary(as, ADDSD, OP_ADD, next);
+			break;
+		case OP_ADD_LOCAL_CONSTANT:
+		case OP_SUBTRACT_LOCAL_CONSTANT:
+			emitLoad(as, RAX, SLOTS, 8 * instr -> arg);
+			pushValue(as, RAX);
+			emitLoadImmediate(as, RAX, *instr -> as.constant);
+			pushValue(as, RAX);
+			if (instr -> op == OP_ADD_LOCAL_CONSTANT)
+				emitBinary(as, ADDSD, OP_ADD, next);
+			else
+				emitBinary(as, SUBSD, OP_SUBTRACT, next);
+			break;
+		case OP_NEGATE: {
+			emitLoad(as, RAX, STACK_TOP, -8);
+			emitLoadImmediate(as, RDX, QNAN);
+			emitArith(as, MOV, RCX, RAX);
+			emitArith(as, AND, RCX, RDX);
+			emitArith(as, CMP, RCX, RDX);
+			int number = emitJump(as, CC_NE);
+			emitArithmetic(as, OP_NEGATE, next);
+			int done = emitJump(as, CC_ALWAYS);
+			patchJump(as, number, as -> count);
+			emitLoadImmediate(as, RCX, SIGN_BIT);
+			emitArith(as, XOR, RAX, RCX);
+			emitStore(as, STACK_TOP, -8, RAX);
+			patchJump(as, done, as -> count);
+			break;
+		}
+		case OP_NOT:
+			//cl = value == false, dl = value == nil.
+			emitLoad(as, RAX, STACK_TOP, -8);
+			emitLoadImmediate(as, RSI, NIL_VAL);
+			emitArith(as, CMP, RAX, RSI);
+			emitSetcc(as, CC_E, RDX);
+			emitLoadImmediate(as, RSI, FALSE_VAL);
+			emitArith(as, CMP, RAX, RSI);
+			emitSetcc(as, CC_E, RCX);
+			emitByte(as, 0x08);
+			emitByte(as, 0xD1);
+			emitByte(as, 0x0F);
+			emitByte(as, 0xB6);
+			emitByte(as, 0xC9);
+			emitArith(as, OR, RCX, RSI);
+			emitStore(as, STACK_TOP, -8, RCX);
+			break;
+		case OP_EQUAL:
+			emitValuesEqual(as);
+			popValues(as, 1);
+			storeBool(as);
+			break;
+		case OP_GREATER:
+		case OP_GREATER_NUM:
+		case OP_LESS:
+		case OP_LESS_NUM:
+			emitCompare(as, instr -> op == OP_GREATER || instr -> op == OP_GREATER_NUM, next);
+			emitSetcc(as, CC_A, RAX);
+			popValues(as, 1);
+			storeBool(as);
+			break;
+		case OP_LESS_JUMP:
+		case OP_GREATER_JUMP:
+			emitCompare(as, instr -> op == OP_GREATER_JUMP, next);
+			popValues(as, 2);
+			emitJumpToLabel(as, CC_BE, (int)(instr -> as.target - code));
+			break;
+		case OP_EQUAL_JUMP:
+			emitValuesEqual(as);
+			popValues(as, 2);
+			emitByte(as, 0x84);
+			emitByte(as, 0xC0);
+			emitJumpToLabel(as, CC_E, (int)(instr -> as.target - code));
+			break;
+		case OP_JUMP:
+		case OP_LOOP:
+			emitJumpToLabel(as, CC_ALWAYS, (int)(instr -> as.target - code));
+			break;
+		case OP_LOOP_TRACE: {
+			//Run the trace and carry on from whichever instruction it
+			//returns, which is always one of its exits.
+			Trace* trace = instr -> as.trace;
+			beforeCall(as, next);
+			emitArith(as, MOV, RSI, SLOTS);
+			emitCall(as, trace -> code);
+			emitLoad(as, STACK_TOP, VM_REGISTER, offsetof(VM, stackTop));
+			for (int i = 0; i < trace -> exitCount; i++) {
+				emitLoadImmediate(as, RCX, (uint64_t)(uintptr_t)trace -> exits[i]);
+				emitArith(as, CMP, RAX, RCX);
+				emitJumpToLabel(as, CC_E, (int)(trace -> exits[i] - code));
+			}
+			emitJumpToLabel(as, CC_ALWAYS, (int)(trace -> header - code));
+			break;
+		}
+		case OP_JUMP_IF_FALSE:
+			emitLoad(as, RAX, STACK_TOP, -8);
+			jumpIfFalsey(as, (int)(instr -> as.target - code));
+			break;
+		case OP_PRINT:
+			popValues(as, 1);
+			beforeCall(as, next);
+			emitLoad(as, RSI, STACK_TOP, 0);
+			emitCall(as, (void*)jitPrint);
+			break;
+		case OP_CALL:
+			beforeCall(as, next);
+			emitLoadImmediate(as, RSI, instr -> arg);
+			emitCall(as, (void*)jitCall);
+			checkResult(as);
+			reload(as);
+			break;
+		case OP_TAIL_CALL: {
+			beforeCall(as, next);
+			emitLoadImmediate(as, RSI, instr -> arg);
+			emitCall(as, (void*)jitTailCall);
+			//A reused frame goes back to runFrame(), which starts the callee.
+			emitByte(as, 0x83);
+			emitByte(as, 0xF8);
+			emitByte(as, JIT_TAIL_CALL);
+			int called = emitJump(as, CC_NE);
+			emitEpilogue(as);
+			patchJump(as, called, as -> count);
+			emitByte(as, 0x85);
+			emitByte(as, 0xC0);
+			emitJumpTo(as, CC_E, as -> exitLabel);
+			reload(as);
+			break;
+		}
+		case OP_INVOKE:
+			beforeCall(as, next);
+			emitLoadImmediate(as, RSI, (uint64_t)(uintptr_t)instr -> as.cache);
+			emitLoadImmediate(as, RDX, instr -> arg);
+			emitCall(as, (void*)jitInvoke);
+			checkResult(as);
+			reload(as);
+			break;
+		case OP_GET_PROPERTY:
+			emitGetProperty(as, instr -> as.cache, next);
+			break;
+		case OP_GET_LOCAL_PROPERTY:
+			emitLoad(as, RAX, SLOTS, 8 * instr -> arg);
+			pushValue(as, RAX);
+			emitGetProperty(as, instr -> as.cache, next);
+			break;
+		case OP_SET_PROPERTY:
+			beforeCall(as, next);
+			emitLoadImmediate(as, RSI, (uint64_t)(uintptr_t)instr -> as.cache);
+			emitCall(as, (void*)jitSetProperty);
+			checkResult(as);
+			reload(as);
+			break;
+		case OP_CLOSURE:
+			beforeCall(as, next);
+			emitLoadImmediate(as, RSI, (uint64_t)(uintptr_t)instr -> as.upvalues);
+			emitCall(as, (void*)jitClosure);
+			reload(as);
+			break;
+		case OP_CLOSE_UPVALUE:
+			beforeCall(as, next);
+			emitLea(as, RSI, STACK_TOP, -8);
+			emitCall(as, (void*)jitCloseUpvalues);
+			popValues(as, 1);
+			break;
+		case OP_RETURN: {
+			emitLoad(as, RAX, VM_REGISTER, offsetof(VM, openUpvalues));
+			emitArith(as, TEST, RAX, RAX);
+			int closed = emitJump(as, CC_E);
+			beforeCall(as, next);
+			emitArith(as, MOV, RSI, SLOTS);
+			emitCall(as, (void*)jitCloseUpvalues);
+			patchJump(as, closed, as -> count);
+			//vm -> frameCount--
+			emitRex(as, false, 1, VM_REGISTER);
+			emitByte(as, 0xFF);
+			emitMemory(as, 1, VM_REGISTER, offsetof(VM, frameCount));
+			emitLoad(as, RAX, STACK_TOP, -8);
+			emitStore(as, SLOTS, 0, RAX);
+			emitLea(as, STACK_TOP, SLOTS, 8);
+			emitStore(as, VM_REGISTER, offsetof(VM, stackTop), STACK_TOP);
+			emitLoadImmediate(as, RAX, JIT_OK);
+			emitEpilogue(as);
+			break;
+		}
+		default:
+			//isSupported() keeps everything else out.
+			break;
+	}
+}
+
+bool jitCompile(ObjFunction* function) {
+	Instr* code = function -> code;
+	int count = function -> codeCount;
+	//The top-level script runs once and is never worth compiling.
+	if (code == NULL || function -> name == NULL)
+		return false;
+	for (int i = 0; i < count; i++) {
+		if (!isSupported(code[i].op))
+			return false;
+	}
+
+	Assembler as;
+	initAssembler(&as);
+	int* labels = (int*)malloc(sizeof(int) * (count + 1));
+	if (labels == NULL)
+		return false;
+
+	//Five pushes after the return address leave rsp 16-byte aligned for the
+	//calls made from the body. r15 is only saved for that.
+	emitPush(&as, RBX);
+	emitPush(&as, R12);
+	emitPush(&as, R13);
+	emitPush(&as, R14);
+	emitPush(&as, R15);
+	int body = emitJump(&as, CC_ALWAYS);
+	as.exitLabel = as.count;
+	emitByte(&as, 0x31);
+	emitByte(&as, 0xC0);
+	emitEpilogue(&as);
+
+	patchJump(&as, body, as.count);
+	emitArith(&as, MOV, VM_REGISTER, RDI);
+	//Zero-extend frameIndex and scale it: imul r14, rsi, sizeof(CallFrame).
+	emitByte(&as, 0x89);
+	emitByte(&as, 0xF6);
+	emitRex(&as, true, FRAME_OFFSET, RSI);
+	emitByte(&as, 0x69);
+	emitRegisters(&as, FRAME_OFFSET, RSI);
+	emit32(&as, sizeof(CallFrame));
+	reload(&as);
+
+	for (int i = 0; i < count; i++) {
+		labels[i] = as.count;
+		emitInstruction(&as, code, i);
+	}
+	labels[count] = as.count;
+	resolveLabels(&as, labels);
+	free(labels);
+
+	size_t size;
+	void* native = finishAssembler(&as, &size);
+	if (native == NULL)
+		return false;
+	function -> jitCode = native;
+	function -> jitSize = size;
+	return true;
+}
+
+void freeJitCode(ObjFunction* function) {
+	freeCode(function -> jitCode, function -> jitSize);
+	function -> jitCode = NULL;
+	function -> jitSize = 0;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef Von_jit_h
+#define Von_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "decode.h"
+
+//Native frames nest on the C stack. Calls deeper than this many of them
+//stay in the interpreter, which does not.
+#define JIT_MAX_DEPTH 4096
+
+typedef enum {
+	JIT_ERROR,
+	JIT_OK,
+	//The frame was reused for a tail call and has not finished yet.
+	JIT_TAIL_CALL,
+} JitStatus;
+
+//Compiled code, whether from the JIT or from a --emit-c build, runs the
+//frame at vm -> frames[frameIndex] until it returns and leaves the result
+//on the stack like OP_RETURN does.
+typedef JitStatus (*JitFn)(VM* vm, int frameIndex);
+
+//The parts of run() compiled code calls back into. They expect vm ->
+//stackTop and the frame's ip to be up to date and report errors through
+//runtimeError().
+//Arithmetic on the top of the stack past the number fast paths. Pops the
+//operands and pushes the result, or replaces the top for OP_NEGATE.
+bool jitArithmetic(VM* vm, uint8_t op);
+//Compares the top two values without popping them. Returns whether the
+//comparison holds, or 2 after an error.
+uint8_t jitCompare(VM* vm, bool greater);
+void jitError(VM* vm, const char* message);
+void jitUndefinedGlobal(VM* vm, int slot);
+bool jitCall(VM* vm, int argCount);
+JitStatus jitTailCall(VM* vm, int argCount);
+bool jitInvoke(VM* vm, InlineCache* cache, int argCount);
+bool jitGetProperty(VM* vm, InlineCache* cache);
+bool jitSetProperty(VM* vm, InlineCache* cache);
+void jitClosure(VM* vm, const uint8_t* upvalues);
+void jitCloseUpvalues(VM* vm, Value* last);
+void jitPrint(VM* vm, Value value);
+void jitClass(VM* vm, ObjString* name);
+bool jitInherit(VM* vm);
+void jitMethod(VM* vm, ObjString* name);
+bool jitGetSuper(VM* vm, ObjString* name);
+bool jitSuperInvoke(VM* vm, InlineCache* cache, int argCount);
+
+#ifdef JIT
+
+//How many calls a function gets in the interpreter before it is compiled.
+#define JIT_THRESHOLD 100
+
+bool jitCompile(ObjFunction* function);
+void freeJitCode(ObjFunction* function);
+
+#endif
+
+#endif
@@ -1,5 +1,8 @@
 #include <stdlib.h>
 #include "memory.h"
+#include "decode.h"
+#include "jit.h"
+#include "trace.h"
 #include "vm.h"
 #include "../compiler/compiler.h"
 
@@ -8,15 +11,15 @@
 #include "debug.h"
 #endif
 //Function to move new array to the new doubled array.
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-	vm.bytesAllocated += newSize - oldSize;
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
+	vm -> bytesAllocated += newSize - oldSize;
 	if (newSize > oldSize) {
 		#ifdef DEBUG_STRESS_GC
-		collectGarbage();
+		collectGarbage(vm);
 		#endif
 
-		if (vm.bytesAllocated > vm.nextGC) {
-			collectGarbage();
+		if (vm -> bytesAllocated > vm -> nextGC) {
+			collectGarbage(vm);
 		}
 	}
 	if (newSize == 0) {
@@ -29,10 +32,10 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 	return result;
 }
 
-void markObject(Obj* object) {
+void markObject(VM* vm, Obj* object) {
 	if (object == NULL)
 		return;
-	if (object -> isMarked)
+	if (isObjMarked(object))
 		return;
 
 	#ifdef DEBUG_LOG_GC
@@ -41,186 +44,246 @@ void markObject(Obj* object) {
 	printf("\n");
 	#endif
 	
-	object -> isMarked = true;
+	setObjMarked(object, true);
 
-	if (vm.grayCapacity < vm.grayCount + 1) {
-		vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-		vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
-		vm.grayStack[vm.grayCount++] = object;
-		if (vm.grayStack == NULL)
+	if (vm -> grayCapacity < vm -> grayCount + 1) {
+		vm -> grayCapacity = GROW_CAPACITY(vm -> grayCapacity);
+		vm -> grayStack = (Obj**)realloc(vm -> grayStack, sizeof(Obj*) * vm -> grayCapacity);
+		if (vm -> grayStack == NULL)
 			exit(1);
 	}
+	vm -> grayStack[vm -> grayCount++] = object;
 }
 
-void markValue(Value value) {
+void markValue(VM* vm, Value value) {
 	if (IS_OBJ(value)) 
-		markObject(AS_OBJ(value));
+		markObject(vm, AS_OBJ(value));
 }
 
-static void markArray(ValueArray* array) {
+static void markArray(VM* vm, ValueArray* array) {
 	for (int i = 0; i < array -> count; i++) {
-		markValue(array -> values[i]);
+		markValue(vm, array -> values[i]);
 	}
 }
 
-static void blackenObject(Obj* object) {
+static void blackenObject(VM* vm, Obj* object) {
 	#ifdef DEBUG_LOG_GC
 	printf("%p blacken ", (void*)object);
 	printValue(OBJ_VAL(object));
 	printf("\n");
 	#endif	
 	
-	switch(object -> type) {
-		case OBJ_NATIVE:
-			markValue(((ObjUpvalue*)object) -> closed);
+	switch(objType(object)) {
+		case OBJ_UPVALUE:
+			markValue(vm, ((ObjUpvalue*)object) -> closed);
+			break;
 		case OBJ_FUNCTION: {
 			ObjFunction* function = (ObjFunction*)object;
-			markObject((Obj*)function -> name);
-			markArray(&function -> chunk.constants);
+			markObject(vm, (Obj*)function -> name);
+			markObject(vm, function -> closure);
+			markArray(vm, &function -> chunk.constants);
+			for (int i = 0; i < function -> cacheCount; i++) {
+				InlineCache* cache = &function -> caches[i];
+				for (int j = 0; j < cache -> count; j++) {
+					markObject(vm, (Obj*)cache -> entries[j].klass);
+					markValue(vm, cache -> entries[j].method);
+				}
+			}
 			break;
 		}
 		case OBJ_CLOSURE: {
 			ObjClosure* closure = (ObjClosure*)object;
-			markObject((Obj*)closure -> function);
+			markObject(vm, (Obj*)closure -> function);
 			for (int i = 0; i < closure -> upvalueCount; i++) {
-				markObject((Obj*)closure -> upvalues[i]);
+				if (closure -> function -> flatUpvalues[i])
+					markValue(vm, closure -> upvalues[i].flat);
+				else
+					markObject(vm, (Obj*)closure -> upvalues[i].boxed);
 			}
 			break;
 		}
+		case OBJ_NATIVE:
 		case OBJ_STRING:
+		case OBJ_BUFFER:
+			break;
+		case OBJ_SLICE:
+			markObject(vm, (Obj*)((ObjSlice*)object) -> buffer);
 			break;
 		case OBJ_CLASS: {
 			ObjClass* klass = (ObjClass*)object;
-			markObject((Obj*)klass -> name);
-			markTable(&klass -> methods);
+			markObject(vm, (Obj*)klass -> name);
+			markTable(vm, &klass -> methods);
+			markShape(vm, klass -> shape);
 			break;
 		}
 		case OBJ_INSTANCE: {
 			ObjInstance* instance = (ObjInstance*)object;
-			markObject((Obj*)instance -> klass);
-			markTable(&instance -> fields);
+			markObject(vm, (Obj*)instance -> klass);
+			if (instance -> shape == NULL) {
+				markTable(vm, instance -> dictionary);
+				break;
+			}
+			for (int i = 0; i < instance -> shape -> slotCount; i++) {
+				markValue(vm, instance -> fields[i]);
+			}
 			break;
 		}
 		case OBJ_BOUND_METHOD: {
 			ObjBoundMethod* bound = (ObjBoundMethod*)object;
-			markValue(bound -> receiver);
-			markObject((Obj*)bound -> method);
+			markValue(vm, bound -> receiver);
+			markObject(vm, (Obj*)bound -> method);
 			break;
 		}
 	}
 }
 
-static void freeObject(Obj* object) {
-	switch (object -> type) {
+static void freeObject(VM* vm, Obj* object) {
+	switch (objType(object)) {
 		case OBJ_STRING: {
 			ObjString* string = (ObjString*)object;
-			FREE_ARRAY(char, string -> chars, string -> length + 1);
-			FREE(ObjString, object);
+			reallocate(vm, object, sizeof(ObjString) + string -> length + 1, 0);
 			break;
 		}
 		case OBJ_FUNCTION: {
 			ObjFunction* function = (ObjFunction*)object;
-			freeChunk(&function -> chunk);
-			FREE(ObjFunction, object);
+			freeDecodedCode(vm, function);
+#ifdef JIT
+			freeJitCode(function);
+			freeTraces(function);
+#endif
+			FREE_ARRAY(vm, bool, function -> flatUpvalues, function -> upvalueCount);
+			freeChunk(vm, &function -> chunk);
+			FREE(vm, ObjFunction, object);
 			break;
 		}
 		case OBJ_NATIVE:
-			FREE(ObjNative, object);
+			FREE(vm, ObjNative, object);
 			break;
 		case OBJ_CLOSURE: {
 			ObjClosure* closure = (ObjClosure*)object;
-			FREE_ARRAY(ObjUpvalue*, closure -> upvalues, closure -> upvalueCount);
-			FREE(ObjClosure, object);
+			reallocate(vm, object, sizeof(ObjClosure) + sizeof(CapturedValue) * closure -> upvalueCount, 0);
 			break;
 		}
 		case OBJ_UPVALUE:
-			FREE(ObjUpvalue, object);
+			FREE(vm, ObjUpvalue, object);
 			break;
 		case OBJ_CLASS: {
-			FREE(ObjClass, object);
+			ObjClass* klass = (ObjClass*)object;
+			freeTable(vm, &klass -> methods);
+			freeShape(vm, klass -> shape);
+			FREE(vm, ObjClass, object);
 			break;
 		}
 		case OBJ_INSTANCE: {
 			ObjInstance* instance = (ObjInstance*)object;
-			freeTable(&instance -> fields);
-			FREE(ObjInstance, object);
+			if (instance -> fields != instance -> inlineFields)
+				FREE_ARRAY(vm, Value, instance -> fields, instance -> capacity);
+			if (instance -> dictionary != NULL) {
+				freeTable(vm, instance -> dictionary);
+				FREE(vm, Table, instance -> dictionary);
+			}
+			reallocate(vm, object, sizeof(ObjInstance) + sizeof(Value) * instance -> inlineCapacity, 0);
 			break;
 		}
 		case OBJ_BOUND_METHOD:
-			FREE(ObjBoundMethod, object);
+			FREE(vm, ObjBoundMethod, object);
+			break;
+		case OBJ_BUFFER: {
+			ObjBuffer* buffer = (ObjBuffer*)object;
+			FREE_ARRAY(vm, char, buffer -> chars, buffer -> capacity);
+			FREE(vm, ObjBuffer, object);
+			break;
+		}
+		case OBJ_SLICE:
+			FREE(vm, ObjSlice, object);
 			break;
 	}
-	free(vm.grayStack);
 }
 
-static void markRoots() {
-	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-		markValue(*slot);
+static void markRoots(VM* vm) {
+	for (Value* slot = vm -> stack; slot < vm -> stackTop; slot++) {
+		markValue(vm, *slot);
 	}
-	for (int i = 0; i < vm.frameCount; i++) {
-		markObject((Obj*)vm.frames[i].closure);
+	//Register code can raise stackTop over slots it has not written since
+	//they were last in use, but never past the end of some frame's
+	//registers. Clearing up to there means none of them can hold an object
+	//this collection frees.
+	Value* registersEnd = vm -> stackTop;
+	for (int i = 0; i < vm -> frameCount; i++) {
+		CallFrame* frame = &vm -> frames[i];
+		markObject(vm, (Obj*)frame -> closure);
+		Value* end = frame -> slots + frame -> closure -> function -> maxSlots;
+		if (end > registersEnd)
+			registersEnd = end;
+	}
+	if (vm -> registerMode) {
+		for (Value* slot = vm -> stackTop; slot < registersEnd; slot++) {
+			*slot = NIL_VAL;
+		}
 	}
-	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue -> next) {
-		markObject((Obj*)upvalue);
+	for (ObjUpvalue* upvalue = vm -> openUpvalues; upvalue != NULL; upvalue = upvalue -> next) {
+		markObject(vm, (Obj*)upvalue);
 	}
-	markTable(&vm.globals);
-	markCompilerRoots();
-	markObject((Obj*)vm.initString);
+	markTable(vm, &vm -> globalSlots);
+	markArray(vm, &vm -> globalValues);
+	markCompilerRoots(vm);
+	markObject(vm, (Obj*)vm -> initString);
 }
 
-static void traceReferences() {
-	while (vm.grayCount > 0) {
-		Obj* object = vm.grayStack[--vm.grayCount];
-		blackenObject(object);
+static void traceReferences(VM* vm) {
+	while (vm -> grayCount > 0) {
+		Obj* object = vm -> grayStack[--vm -> grayCount];
+		blackenObject(vm, object);
 	}
 }
 
-static void sweep() {
+static void sweep(VM* vm) {
 	Obj* previous = NULL;
-	Obj* object = vm.objects;
+	Obj* object = vm -> objects;
 	while (object != NULL) {
-		if (object -> isMarked) {
-			object -> isMarked = false;
+		if (isObjMarked(object)) {
+			setObjMarked(object, false);
 			previous = object;
-			object = object -> next;
+			object = objNext(object);
 		}
 		else {
 			Obj* unreached = object;
-			object = object -> next;
+			object = objNext(object);
 			if (previous != NULL)
-				previous -> next = object;
+				setObjNext(previous, object);
 			else
-				vm.objects = object;
-			freeObject(unreached);
+				vm -> objects = object;
+			freeObject(vm, unreached);
 		}
 	}
 }
 
 #define GC_HEAP_GROW_FACTOR 2
 
-void collectGarbage() {
+void collectGarbage(VM* vm) {
 	#ifdef DEBUG_LOG_GC
 	printf("-- gc begin\n");
-	size_t before = vm.bytesAllocated;
+	size_t before = vm -> bytesAllocated;
 	#endif
 
-	markRoots();
-	traceReferences();
-	tableRemoveWhite(&vm.strings);
-	sweep();
-	vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+	markRoots(vm);
+	traceReferences(vm);
+	tableRemoveWhite(&vm -> strings);
+	sweep(vm);
+	vm -> nextGC = vm -> bytesAllocated * GC_HEAP_GROW_FACTOR;
 
 	#ifdef DEBUG_LOG_GC
 	printf("-- gc end\n");
-	printf("	collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+	printf("	collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm -> bytesAllocated, before, vm -> bytesAllocated, vm -> nextGC);
 	#endif
 }
 
-void freeObjects() {
-	Obj* object = vm.objects;
+void freeObjects(VM* vm) {
+	Obj* object = vm -> objects;
 	while (object != NULL) {
-		Obj* next = object -> next;
-		freeObject(object);
+		Obj* next = objNext(object);
+		freeObject(vm, object);
 		object = next;
 	}
+	free(vm -> grayStack);
 }
@@ -6,16 +6,21 @@
 #include "value.h"
 #include "vm.h"
 #include "table.h"
+#include "jit.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-	(type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+	(type*)allocateObject(vm, sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type) {
-	Obj* object = (Obj*)reallocate(NULL, 0, size);
-	object -> type = type;
-	object -> next = vm.objects;
-	object -> isMarked = false;
-	vm.objects = object;
+//Puts memory the caller allocated on the heap list as an object of type.
+static void initObject(VM* vm, Obj* object, ObjType type) {
+	object -> header = (uint64_t)type << OBJ_TYPE_SHIFT;
+	setObjNext(object, vm -> objects);
+	vm -> objects = object;
+}
+
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+	Obj* object = (Obj*)reallocate(vm, NULL, 0, size);
+	initObject(vm, object, type);
 	
 	#ifdef DEBUG_LOG_GC
 	printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -24,133 +29,318 @@ static Obj* allocateObject(size_t size, ObjType type) {
 	return object;
 }
 
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
-	ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method) {
+	ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
 	bound -> receiver = receiver;
 	bound -> method = method;
 	return bound;
 }
 
-ObjClass* newClass(ObjString* name) {
-	ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+ObjClass* newClass(VM* vm, ObjString* name) {
+	Shape* shape = newShape(vm, NULL, NULL);
+	ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
 	klass -> name = name;
 	initTable(&klass -> methods);
+	klass -> shape = shape;
+	klass -> instanceSlots = 0;
 	return klass;
 }
 
-ObjClosure* newClosure(ObjFunction* function) {
-	ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function -> upvalueCount);
-	for (int i = 0; i < function -> upvalueCount; i++) {
-		upvalues[i] = NULL;
-	}
-	ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+ObjClosure* newClosure(VM* vm, ObjFunction* function) {
+	ObjClosure* closure = (ObjClosure*)allocateObject(vm,
+			sizeof(ObjClosure) + sizeof(CapturedValue) * function -> upvalueCount, OBJ_CLOSURE);
 	closure -> function = function;
-	closure -> upvalues = upvalues;
 	closure -> upvalueCount = function -> upvalueCount;
+	for (int i = 0; i < function -> upvalueCount; i++) {
+		if (function -> flatUpvalues[i])
+			closure -> upvalues[i].flat = NIL_VAL;
+		else
+			closure -> upvalues[i].boxed = NULL;
+	}
 	return closure;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-	ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-	string -> length = length;
-	string -> chars = chars;
+static size_t stringSize(int length) {
+	return sizeof(ObjString) + length + 1;
+}
+
+//Puts a filled in string on the heap and in the intern table.
+static ObjString* addString(VM* vm, ObjString* string, uint32_t hash) {
+	initObject(vm, (Obj*)string, OBJ_STRING);
 	string -> hash = hash;
-	push(OBJ_VAL(string));
-	tableSet(&vm.strings, string, NIL_VAL);	
-	pop();
+	push(vm, OBJ_VAL(string));
+	tableSet(vm, &vm -> strings, string, NIL_VAL);	
+	pop(vm);
 	return string;
 }
 
-ObjFunction* newFunction() {
-	ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction* newFunction(VM* vm) {
+	ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
 	function -> arity = 0;
 	function -> upvalueCount = 0;
+	function -> maxSlots = 0;
+	function -> sharesClosure = false;
+	function -> closure = NULL;
+	function -> flatUpvalues = NULL;
 	function -> name = NULL;
+	function -> code = NULL;
+	function -> codeOffsets = NULL;
+	function -> codeCount = 0;
+	function -> caches = NULL;
+	function -> cacheCount = 0;
+	function -> aotCode = NULL;
+#ifdef JIT
+	function -> hotness = JIT_THRESHOLD;
+	function -> jitCode = NULL;
+	function -> jitSize = 0;
+	function -> traces = NULL;
+#endif
 	initChunk(&function -> chunk);
 	return function;
 }
 
-ObjInstance* newInstance(ObjClass* klass) {
-	ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+ObjInstance* newInstance(VM* vm, ObjClass* klass) {
+	int slots = klass -> instanceSlots;
+	ObjInstance* instance = (ObjInstance*)allocateObject(vm, sizeof(ObjInstance) + sizeof(Value) * slots, OBJ_INSTANCE);
 	instance -> klass = klass;
-	initTable(&instance -> fields);
+	instance -> shape = klass -> shape;
+	instance -> fields = instance -> inlineFields;
+	instance -> capacity = slots;
+	instance -> inlineCapacity = slots;
+	instance -> dictionary = NULL;
 	return instance;
 }
 
-ObjNative* newNative(NativeFn function) {
-	ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+bool getField(ObjInstance* instance, ObjString* name, Value* value) {
+	if (instance -> shape == NULL)
+		return tableGet(instance -> dictionary, name, value);
+	int slot = shapeLookup(instance -> shape, name);
+	if (slot == -1)
+		return false;
+	*value = instance -> fields[slot];
+	return true;
+}
+
+//Moves every field into a private table once the instance can no longer
+//share a shape.
+static void toDictionary(VM* vm, ObjInstance* instance) {
+	Table* dictionary = ALLOCATE(vm, Table, 1);
+	initTable(dictionary);
+	instance -> dictionary = dictionary;
+	for (Shape* shape = instance -> shape; shape -> key != NULL; shape = shape -> parent) {
+		tableSet(vm, dictionary, shape -> key, instance -> fields[shape -> slotCount - 1]);
+	}
+	instance -> shape = NULL;
+	if (instance -> fields != instance -> inlineFields)
+		FREE_ARRAY(vm, Value, instance -> fields, instance -> capacity);
+	instance -> fields = instance -> inlineFields;
+	instance -> capacity = instance -> inlineCapacity;
+}
+
+void setField(VM* vm, ObjInstance* instance, ObjString* name, Value value) {
+	if (instance -> shape != NULL) {
+		int slot = shapeLookup(instance -> shape, name);
+		if (slot != -1) {
+			instance -> fields[slot] = value;
+			return;
+		}
+
+		Shape* next = shapeTransition(vm, instance -> shape, name);
+		if (next != NULL) {
+			if (next -> slotCount > instance -> capacity) {
+				int capacity = GROW_CAPACITY(instance -> capacity);
+				Value* fields = ALLOCATE(vm, Value, capacity);
+				for (int i = 0; i < instance -> shape -> slotCount; i++) {
+					fields[i] = instance -> fields[i];
+				}
+				if (instance -> fields != instance -> inlineFields)
+					FREE_ARRAY(vm, Value, instance -> fields, instance -> capacity);
+				instance -> fields = fields;
+				instance -> capacity = capacity;
+			}
+			instance -> fields[next -> slotCount - 1] = value;
+			instance -> shape = next;
+			if (next -> slotCount > instance -> klass -> instanceSlots)
+				instance -> klass -> instanceSlots = next -> slotCount;
+			return;
+		}
+		toDictionary(vm, instance);
+	}
+	tableSet(vm, instance -> dictionary, name, value);
+}
+
+ObjNative* newNative(VM* vm, NativeFn function) {
+	ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
 	native -> function = function;
 	return native;
 }
 
+#define WIDE_HASH_MIN_LENGTH 16
+
+static uint64_t mixWord(uint64_t hash, const char* chars) {
+	uint64_t word;
+	memcpy(&word, chars, sizeof(word));
+	hash = (hash ^ word) * 0xff51afd7ed558ccdu;
+	return hash ^ (hash >> 32);
+}
+
+//FNV-1a for short strings. Longer ones are taken eight bytes at a time,
+//with the last eight covering whatever the others left over. Never
+//returns 0, which marks a string that is not interned.
 static uint32_t hashString(const char* key, int length) {
 	uint32_t hash = 2166136261u;
-	for (int i = 0; i < length; i++) {
-		hash ^= (uint8_t)key[i];
-		hash *= 16777619;
+	if (length < WIDE_HASH_MIN_LENGTH) {
+		for (int i = 0; i < length; i++) {
+			hash ^= (uint8_t)key[i];
+			hash *= 16777619;
+		}
+	}
+	else {
+		uint64_t wide = (uint64_t)length * 0x9e3779b97f4a7c15u;
+		for (int i = 0; i + 8 <= length; i += 8)
+			wide = mixWord(wide, key + i);
+		if (length % 8 != 0)
+			wide = mixWord(wide, key + length - 8);
+		wide *= 0xc4ceb9fe1a85ec53u;
+		hash = (uint32_t)(wide ^ (wide >> 32));
 	}
-	return hash;
+	return hash == 0 ? 1 : hash;
 }
 
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
 	uint32_t hash = hashString(chars, length);
-	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+	ObjString* interned = tableFindString(&vm -> strings, chars, length, hash);
 	if (interned != NULL)
 		return interned;
-	char* heapChars = ALLOCATE(char, length + 1);
-	memcpy(heapChars, chars, length);
-	heapChars[length] = '\0';
-	return allocateString(heapChars, length, hash);
+	ObjString* string = reserveString(vm, length);
+	memcpy(string -> chars, chars, length);
+	return addString(vm, string, hash);
 }
 
-ObjUpvalue* newUpvalue(Value* slot) {
-	ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
+	ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
 	upvalue -> location = slot;
 	upvalue -> next = NULL;
 	upvalue -> closed = NIL_VAL;
 	return upvalue;
 }
 
-static void printFunction(ObjFunction* function) {
+//The characters are allocated first, while there is no object yet for a
+//collection to free.
+ObjBuffer* newBuffer(VM* vm, int capacity) {
+	char* chars = ALLOCATE(vm, char, capacity);
+	ObjBuffer* buffer = ALLOCATE_OBJ(vm, ObjBuffer, OBJ_BUFFER);
+	buffer -> count = 0;
+	buffer -> capacity = capacity;
+	buffer -> chars = chars;
+	return buffer;
+}
+
+//Grows buffer, which must be reachable, to hold at least capacity characters.
+void reserveBuffer(VM* vm, ObjBuffer* buffer, int capacity) {
+	if (buffer -> capacity >= capacity)
+		return;
+	int oldCapacity = buffer -> capacity;
+	int newCapacity = GROW_CAPACITY(oldCapacity);
+	while (newCapacity < capacity)
+		newCapacity = GROW_CAPACITY(newCapacity);
+	buffer -> chars = GROW_ARRAY(vm, char, buffer -> chars, oldCapacity, newCapacity);
+	buffer -> capacity = newCapacity;
+}
+
+ObjSlice* newSlice(VM* vm, ObjBuffer* buffer, int length) {
+	ObjSlice* slice = ALLOCATE_OBJ(vm, ObjSlice, OBJ_SLICE);
+	slice -> length = length;
+	slice -> buffer = buffer;
+	return slice;
+}
+
+//Interned strings are equal only if they are the same object. Strings
+//made at run time and slices have to be compared character by character.
+bool textsEqual(Value a, Value b) {
+	if (!IS_TEXT(a) || !IS_TEXT(b))
+		return false;
+	if (IS_STRING(a) && IS_STRING(b) && AS_STRING(a) -> hash != 0 && AS_STRING(b) -> hash != 0)
+		return false;
+	int length = textLength(a);
+	if (length != textLength(b))
+		return false;
+	char aChars[SHORT_STRING_MAX];
+	char bChars[SHORT_STRING_MAX];
+	return memcmp(textChars(a, aChars), textChars(b, bChars), length) == 0;
+}
+
+static void printFunction(FILE* out, ObjFunction* function) {
 	if (function -> name == NULL) {
-		printf("<script>");
+		fprintf(out, "<script>");
 		return;
 	}
-	printf("<fn %s>", function -> name -> chars);
+	fprintf(out, "<fn %s>", function -> name -> chars);
 }
 
-void printObject(Value value) {
+void fprintObject(FILE* out, Value value) {
 	switch (OBJ_TYPE(value)) {
 		case OBJ_STRING:
-			printf("%s", AS_CSTRING(value));
+			fprintf(out, "%s", AS_CSTRING(value));
 			break;
 		case OBJ_NATIVE:
-			printf("<native fn>");
+			fprintf(out, "<native fn>");
 			break;
 		case OBJ_CLOSURE:
-			printFunction(AS_CLOSURE(value) -> function);
+			printFunction(out, AS_CLOSURE(value) -> function);
 			break;
 		case OBJ_UPVALUE:
-			printf("upvalue");
+			fprintf(out, "upvalue");
 			break;
 		case OBJ_CLASS:
-			printf("%s", AS_CLASS(value) -> name -> chars);
+			fprintf(out, "%s", AS_CLASS(value) -> name -> chars);
 			break;
 		case OBJ_INSTANCE:
-			printf("%s instance", AS_INSTANCE(value) -> klass -> name -> chars);
+			fprintf(out, "%s instance", AS_INSTANCE(value) -> klass -> name -> chars);
 			break;
 		case OBJ_BOUND_METHOD:
-			printFunction(AS_BOUND_METHOD(value) -> method -> function);
+			printFunction(out, AS_BOUND_METHOD(value) -> method -> function);
+			break;
+		case OBJ_BUFFER:
+			fprintf(out, "buffer");
+			break;
+		case OBJ_SLICE:
+			fwrite(AS_SLICE(value) -> buffer -> chars, 1, AS_SLICE(value) -> length, out);
 			break;
 	}
 }
 
-ObjString* takeString(char* chars, int length) {
-	uint32_t hash = hashString(chars, length);
-	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-	if (interned != NULL) {
-		FREE_ARRAY(char, chars, length + 1);
-		return interned;
-	}
-	return allocateString(chars, length, hash);
+void printObject(Value value) {
+	fprintObject(stdout, value);
+}
+
+static bool fitsShortString(const char* chars, int length) {
+	return length <= SHORT_STRING_MAX && memchr(chars, '\0', length) == NULL;
+}
+
+//A string constant: kept in the value if it is short enough, interned
+//otherwise. Every string that fits in a value is kept in one, so two
+//short strings are equal exactly when their values are.
+Value copyStringValue(VM* vm, const char* chars, int length) {
+	if (fitsShortString(chars, length))
+		return shortStringVal(chars, length);
+	return OBJ_VAL(copyString(vm, chars, length));
+}
+
+//Allocates a string for the caller to write length characters into and
+//pass to finishString(). Until then it is not an object, so nothing else
+//may allocate in between.
+ObjString* reserveString(VM* vm, int length) {
+	ObjString* string = (ObjString*)reallocate(vm, NULL, 0, stringSize(length));
+	string -> length = length;
+	string -> chars[length] = '\0';
+	return string;
+}
+
+//Puts a reserved string on the heap without hashing or interning it,
+//which is all a string made at run time needs to be printed and compared.
+ObjString* finishString(VM* vm, ObjString* string) {
+	initObject(vm, (Obj*)string, OBJ_STRING);
+	string -> hash = 0;
+	return string;
 }
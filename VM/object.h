@@ -5,8 +5,9 @@
 #include "chunk.h"
 #include "value.h"
 #include "table.h"
+#include "shape.h"
 
-#define OBJ_TYPE(value)		(AS_OBJ(value) -> type)
+#define OBJ_TYPE(value)		(objType(AS_OBJ(value)))
 #define IS_STRING(value)	isObjType(value, OBJ_STRING)
 #define IS_FUNCTION(value)	isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value)	isObjType(value, OBJ_NATIVE)
@@ -14,6 +15,8 @@
 #define IS_CLASS(value)		isObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value)	isObjType(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value)	isObjType(value, OBJ_BOUND_METHOD)
+#define IS_SLICE(value)		isObjType(value, OBJ_SLICE)
+#define IS_TEXT(value)		(IS_SHORT_STRING(value) || IS_STRING(value) || IS_SLICE(value))
 
 #define AS_STRING(value)	((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)	(((ObjString*)AS_OBJ(value)) -> chars)
@@ -24,6 +27,7 @@
 #define AS_CLASS(value)		((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value)	((ObjInstance*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value)	((ObjBoundMethod*)AS_OBJ(value))
+#define AS_SLICE(value)		((ObjSlice*)AS_OBJ(value))
 
 //Needs fixing : Order is incorrect
 
@@ -36,36 +40,113 @@ typedef enum {
 	OBJ_BOUND_METHOD,
 	OBJ_CLASS,
 	OBJ_INSTANCE,
+	OBJ_BUFFER,
+	OBJ_SLICE,
 } ObjType;
 
+//The whole header is one word: the next object in vm -> objects in the
+//low 48 bits, which is all NaN boxing leaves a pointer anyway, the type
+//above it and the collector's mark in the top bit.
 struct Obj {
-	ObjType type;
-	bool isMarked;
-	struct Obj* next;
+	uint64_t header;
 };
 
+#define OBJ_NEXT_MASK	((uint64_t)0x0000ffffffffffff)
+#define OBJ_TYPE_SHIFT	48
+#define OBJ_MARK_BIT	((uint64_t)1 << 63)
+
+static inline ObjType objType(Obj* object) {
+	return (ObjType)((object -> header >> OBJ_TYPE_SHIFT) & 0xff);
+}
+
+static inline Obj* objNext(Obj* object) {
+	return (Obj*)(uintptr_t)(object -> header & OBJ_NEXT_MASK);
+}
+
+static inline void setObjNext(Obj* object, Obj* next) {
+	object -> header = (object -> header & ~OBJ_NEXT_MASK) | ((uint64_t)(uintptr_t)next & OBJ_NEXT_MASK);
+}
+
+static inline bool isObjMarked(Obj* object) {
+	return (object -> header & OBJ_MARK_BIT) != 0;
+}
+
+static inline void setObjMarked(Obj* object, bool marked) {
+	if (marked)
+		object -> header |= OBJ_MARK_BIT;
+	else
+		object -> header &= ~OBJ_MARK_BIT;
+}
+
 typedef struct {
 	Obj obj;
 	int arity;
 	int upvalueCount;
+	int maxSlots;
+	//Set by the compiler when no closure over the function can escape the
+	//frame that made it and there are no upvalues, so one closure, made on
+	//first use, serves every OP_CLOSURE of it.
+	bool sharesClosure;
+	struct Obj* closure;
+	//One flag per upvalue, set by the compiler for the ones its closures
+	//hold by value.
+	bool* flatUpvalues;
 	Chunk chunk;
 	ObjString* name;
+	struct Instr* code;
+	int* codeOffsets;
+	int codeCount;
+	struct InlineCache* caches;
+	int cacheCount;
+	//A JitFn a --emit-c build linked in for the function, if any.
+	void* aotCode;
+#ifdef JIT
+	//Calls left before the function is compiled, and the native code once
+	//it has been.
+	int hotness;
+	void* jitCode;
+	size_t jitSize;
+	//Traces of the function's loops.
+	struct Trace* traces;
+#endif
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+typedef Value (*NativeFn)(VM* vm, int argCount, Value* args);
 
 typedef struct {
 	Obj obj;
 	NativeFn function;
 } ObjNative;
 
+//The characters follow the header in the same allocation. Strings from
+//copyString() are interned, and so can be table keys. Strings made at
+//run time are not, and their hash is 0.
 struct ObjString {
 	Obj obj;
 	int length;
-	char* chars;
 	uint32_t hash;
+	char chars[];
 };
 
+//The characters of a string being built by repeated concatenation. It is
+//shared by the slices over it, and appending to the newest of them grows
+//it in place, so building a long string copies each piece once.
+typedef struct {
+	Obj obj;
+	int count;
+	int capacity;
+	char* chars;
+} ObjBuffer;
+
+//A string made by concatenation: the first length characters of buffer,
+//with no terminator. It prints as, and is equal to, the string with the
+//same characters.
+typedef struct {
+	Obj obj;
+	int length;
+	ObjBuffer* buffer;
+} ObjSlice;
+
 typedef struct ObjUpvalue {
 	Obj obj;
 	Value* location;
@@ -73,23 +154,43 @@ typedef struct ObjUpvalue {
 	struct ObjUpvalue* next;
 } ObjUpvalue;
 
+//A captured variable as a closure holds it. Variables that are never
+//assigned are copied into the closure. The rest are shared with the frame
+//and other closures through an ObjUpvalue.
+typedef union {
+	ObjUpvalue* boxed;
+	Value flat;
+} CapturedValue;
+
 typedef struct {
 	Obj obj;
 	ObjFunction* function;
-	ObjUpvalue** upvalues;
 	int upvalueCount;
+	CapturedValue upvalues[];
 } ObjClosure;
 
 typedef struct {
 	Obj obj;
 	ObjString* name;
 	Table methods;
+	Shape* shape;
+	int instanceSlots;
 } ObjClass;
 
+//Field values live in fields[], indexed by the slots of shape. New
+//instances reserve room inline for as many fields as their class has
+//needed so far and move to a heap array if they outgrow it. An instance
+//whose shape is NULL is in dictionary mode and keeps its fields in
+//dictionary instead.
 typedef struct {
 	Obj obj;
 	ObjClass* klass;
-	Table fields;
+	Shape* shape;
+	Value* fields;
+	int capacity;
+	int inlineCapacity;
+	Table* dictionary;
+	Value inlineFields[];
 } ObjInstance;
 
 typedef struct {
@@ -98,20 +199,55 @@ typedef struct {
 	ObjClosure* method;
 } ObjBoundMethod;
 
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
-ObjClass* newClass(ObjString* name);
-ObjClosure* newClosure(ObjFunction* function);
-ObjFunction* newFunction();
-ObjInstance* newInstance(ObjClass* klass);
-ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
-ObjUpvalue* newUpvalue(Value* slot);
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method);
+ObjClass* newClass(VM* vm, ObjString* name);
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
+ObjFunction* newFunction(VM* vm);
+ObjInstance* newInstance(VM* vm, ObjClass* klass);
+bool getField(ObjInstance* instance, ObjString* name, Value* value);
+void setField(VM* vm, ObjInstance* instance, ObjString* name, Value value);
+ObjNative* newNative(VM* vm, NativeFn function);
+ObjString* reserveString(VM* vm, int length);
+ObjString* finishString(VM* vm, ObjString* string);
+ObjString* copyString(VM* vm, const char* chars, int length);
+Value copyStringValue(VM* vm, const char* chars, int length);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot);
+ObjBuffer* newBuffer(VM* vm, int capacity);
+void reserveBuffer(VM* vm, ObjBuffer* buffer, int capacity);
+ObjSlice* newSlice(VM* vm, ObjBuffer* buffer, int length);
+bool textsEqual(Value a, Value b);
 
 void printObject(Value value);
+void fprintObject(FILE* out, Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
-	return IS_OBJ(value) && AS_OBJ(value) -> type == type;
+	return IS_OBJ(value) && objType(AS_OBJ(value)) == type;
+}
+
+//The characters of a short string, string or slice. A short string's are
+//written to scratch, which has room for SHORT_STRING_MAX of them.
+static inline const char* textChars(Value value, char* scratch) {
+	if (IS_SHORT_STRING(value)) {
+		shortStringChars(value, scratch);
+		return scratch;
+	}
+	return IS_STRING(value) ? AS_STRING(value) -> chars : AS_SLICE(value) -> buffer -> chars;
+}
+
+//Copies the characters of a short string, string or slice to dest.
+static inline void copyText(Value value, char* dest) {
+	if (IS_SHORT_STRING(value))
+		shortStringChars(value, dest);
+	else if (IS_STRING(value))
+		memcpy(dest, AS_STRING(value) -> chars, AS_STRING(value) -> length);
+	else
+		memcpy(dest, AS_SLICE(value) -> buffer -> chars, AS_SLICE(value) -> length);
+}
+
+static inline int textLength(Value value) {
+	if (IS_SHORT_STRING(value))
+		return shortStringLength(value);
+	return IS_STRING(value) ? AS_STRING(value) -> length : AS_SLICE(value) -> length;
 }
 
 #endif
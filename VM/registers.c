@@ -0,0 +1,494 @@
+#include <stdlib.h>
+
+#include "registers.h"
+#include "memory.h"
+
+//What the translator knows about the value at one stack position. A copy
+//of a local or a constant is not moved into the position's own register
+//until something needs it there, so the instruction that consumes it can
+//read the local, or take the constant, directly.
+typedef enum {
+	VALUE_REGISTER,
+	VALUE_LOCAL,
+	VALUE_CONSTANT,
+	VALUE_NIL,
+	VALUE_TRUE,
+	VALUE_FALSE
+} ValueKind;
+
+typedef struct {
+	ValueKind kind;
+	//The register a VALUE_LOCAL is a copy of.
+	int local;
+	Value* constant;
+} StackValue;
+
+typedef struct {
+	VM* vm;
+	Instr* code;
+	int* offsets;
+	//Jump targets, as indices into the stack code until the end.
+	int* targets;
+	int count;
+	int capacity;
+	//The bytecode offset of the stack instruction being translated.
+	int offset;
+	StackValue* stack;
+} Translator;
+
+static bool fallsThrough(uint8_t op) {
+	return op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+}
+
+//The stack height before each instruction, following every path from the
+//entry, or -1 for code nothing reaches. Returns the greatest height.
+static int stackHeights(VM* vm, ObjFunction* function, Instr* code, int* targets, int count, int* heights) {
+	int* worklist = ALLOCATE(vm, int, count);
+	int pending = 0;
+	for (int i = 0; i < count; i++)
+		heights[i] = -1;
+	heights[0] = function -> arity + 1;
+	worklist[pending++] = 0;
+	int max = heights[0];
+	while (pending > 0) {
+		int i = worklist[--pending];
+		int height = heights[i] + stackEffect(code[i].op, code[i].arg);
+		if (height > max)
+			max = height;
+		int next[2] = {-1, -1};
+		if (fallsThrough(code[i].op) && i + 1 < count)
+			next[0] = i + 1;
+		if (targets[i] != -1)
+			next[1] = targets[i];
+		for (int j = 0; j < 2; j++) {
+			if (next[j] != -1 && heights[next[j]] == -1) {
+				heights[next[j]] = height;
+				worklist[pending++] = next[j];
+			}
+		}
+	}
+	FREE_ARRAY(vm, int, worklist, count);
+	return max;
+}
+
+//Appends an instruction. The pointer is good until the next one.
+static Instr* emit(Translator* t, uint8_t op, int a, int b, int c) {
+	if (t -> count == t -> capacity) {
+		int capacity = GROW_CAPACITY(t -> capacity);
+		t -> code = GROW_ARRAY(t -> vm, Instr, t -> code, t -> capacity, capacity);
+		t -> offsets = GROW_ARRAY(t -> vm, int, t -> offsets, t -> capacity, capacity);
+		t -> targets = GROW_ARRAY(t -> vm, int, t -> targets, t -> capacity, capacity);
+		t -> capacity = capacity;
+	}
+	Instr* instr = &t -> code[t -> count];
+	instr -> op = op;
+	instr -> arg = (uint8_t)a;
+	instr -> arg2 = (uint8_t)b;
+	instr -> arg3 = (uint8_t)c;
+	instr -> as.constant = NULL;
+	t -> offsets[t -> count] = t -> offset;
+	t -> targets[t -> count] = -1;
+	t -> count++;
+	return instr;
+}
+
+static void emitJump(Translator* t, uint8_t op, int a, int b, int target) {
+	emit(t, op, 0, a, b);
+	t -> targets[t -> count - 1] = target;
+}
+
+//Moves the value at a stack position into its own register.
+static void materialize(Translator* t, int position) {
+	StackValue* value = &t -> stack[position];
+	switch (value -> kind) {
+		case VALUE_REGISTER:
+			return;
+		case VALUE_LOCAL:
+			emit(t, OP_MOVE, position, value -> local, 0);
+			break;
+		case VALUE_CONSTANT:
+			emit(t, OP_LOAD_CONSTANT, position, 0, 0) -> as.constant = value -> constant;
+			break;
+		case VALUE_NIL:
+			emit(t, OP_LOAD_NIL, position, 0, 0);
+			break;
+		case VALUE_TRUE:
+		case VALUE_FALSE:
+			emit(t, OP_LOAD_BOOL, position, value -> kind == VALUE_TRUE, 0);
+			break;
+	}
+	value -> kind = VALUE_REGISTER;
+}
+
+//Everything below height in its own register, as it has to be where paths
+//meet and before a call, which may change a local through an upvalue.
+static void flush(Translator* t, int height) {
+	for (int i = 0; i < height; i++)
+		materialize(t, i);
+}
+
+//The register an instruction can read the value at a position from.
+static int operand(Translator* t, int position) {
+	StackValue* value = &t -> stack[position];
+	if (value -> kind == VALUE_LOCAL)
+		return value -> local;
+	materialize(t, position);
+	return position;
+}
+
+//Before a local is written, copies of it still waiting below the values an
+//instruction consumes need their own registers.
+static void beforeWrite(Translator* t, int local, int consumed) {
+	for (int i = local + 1; i < consumed; i++) {
+		if (t -> stack[i].kind == VALUE_LOCAL && t -> stack[i].local == local)
+			materialize(t, i);
+	}
+}
+
+static void setRegister(Translator* t, int position) {
+	t -> stack[position].kind = VALUE_REGISTER;
+}
+
+//Where an instruction that leaves its result at position writes it. When
+//all the code does next is store the result in a local and pop it, that
+//is the local, and *skip is how many stack instructions that saves.
+static int destination(Translator* t, Instr* code, bool* isTarget, int count, int i, int position, int* skip) {
+	if (i + 2 < count && code[i + 1].op == OP_SET_LOCAL && code[i + 2].op == OP_POP &&
+			!isTarget[i + 1] && !isTarget[i + 2]) {
+		int local = code[i + 1].arg;
+		beforeWrite(t, local, position);
+		setRegister(t, local);
+		*skip = 2;
+		return local;
+	}
+	setRegister(t, position);
+	return position;
+}
+
+static void store(Translator* t, int local, int position, int height) {
+	StackValue* value = &t -> stack[position];
+	if (value -> kind == VALUE_LOCAL && value -> local == local)
+		return;
+	if (position == local)
+		return;
+	beforeWrite(t, local, height);
+	switch (value -> kind) {
+		case VALUE_REGISTER:
+			emit(t, OP_MOVE, local, position, 0);
+			break;
+		case VALUE_LOCAL:
+			emit(t, OP_MOVE, local, value -> local, 0);
+			break;
+		case VALUE_CONSTANT:
+			emit(t, OP_LOAD_CONSTANT, local, 0, 0) -> as.constant = value -> constant;
+			break;
+		case VALUE_NIL:
+			emit(t, OP_LOAD_NIL, local, 0, 0);
+			break;
+		case VALUE_TRUE:
+		case VALUE_FALSE:
+			emit(t, OP_LOAD_BOOL, local, value -> kind == VALUE_TRUE, 0);
+			break;
+	}
+	setRegister(t, local);
+}
+
+static void push(Translator* t, int position, ValueKind kind, int local, Value* constant) {
+	t -> stack[position].kind = kind;
+	t -> stack[position].local = local;
+	t -> stack[position].constant = constant;
+}
+
+static uint8_t registerOpcode(uint8_t op) {
+	switch (op) {
+		case OP_ADD: return OP_ADD_R;
+		case OP_SUBTRACT: return OP_SUBTRACT_R;
+		case OP_MULTIPLY: return OP_MULTIPLY_R;
+		case OP_DIVIDE: return OP_DIVIDE_R;
+		case OP_MODULO: return OP_MODULO_R;
+		case OP_BIT_AND: return OP_BIT_AND_R;
+		case OP_BIT_OR: return OP_BIT_OR_R;
+		case OP_BIT_XOR: return OP_BIT_XOR_R;
+		case OP_SHIFT_LEFT: return OP_SHIFT_LEFT_R;
+		case OP_SHIFT_RIGHT: return OP_SHIFT_RIGHT_R;
+		case OP_GREATER: return OP_GREATER_R;
+		case OP_LESS: return OP_LESS_R;
+		case OP_EQUAL: return OP_EQUAL_R;
+		case OP_NEGATE: return OP_NEGATE_R;
+		case OP_NOT: return OP_NOT_R;
+		case OP_CALL: return OP_CALL_R;
+		case OP_TAIL_CALL: return OP_TAIL_CALL_R;
+		case OP_INVOKE: return OP_INVOKE_R;
+		case OP_SUPER_INVOKE: return OP_SUPER_INVOKE_R;
+		case OP_CLOSURE: return OP_CLOSURE_R;
+		case OP_CLOSE_UPVALUE: return OP_CLOSE_UPVALUE_R;
+		case OP_CLASS: return OP_CLASS_R;
+		case OP_INHERIT: return OP_INHERIT_R;
+		case OP_GET_PROPERTY: return OP_GET_PROPERTY_R;
+		case OP_SET_PROPERTY: return OP_SET_PROPERTY_R;
+		case OP_GET_SUPER: return OP_GET_SUPER_R;
+		case OP_METHOD: return OP_METHOD_R;
+		default: return op;
+	}
+}
+
+//A stack instruction run as is, once the operands it pops are on top.
+static void bridge(Translator* t, Instr* instr, int height, int operands) {
+	for (int i = height - operands; i < height; i++)
+		materialize(t, i);
+	emit(t, registerOpcode(instr -> op), instr -> arg, 0, height) -> as = instr -> as;
+}
+
+int translateRegisters(VM* vm, ObjFunction* function, Instr** codeOut, int** offsetsOut, int** targetsOut, int count) {
+	Instr* code = *codeOut;
+	int* offsets = *offsetsOut;
+	int* targets = *targetsOut;
+
+	int* heights = ALLOCATE(vm, int, count);
+	int maxHeight = stackHeights(vm, function, code, targets, count, heights);
+	if (maxHeight > UINT8_MAX) {
+		FREE_ARRAY(vm, int, heights, count);
+		return -1;
+	}
+	bool* isTarget = ALLOCATE(vm, bool, count);
+	int* newIndex = ALLOCATE(vm, int, count + 1);
+	for (int i = 0; i < count; i++)
+		isTarget[i] = false;
+	for (int i = 0; i < count; i++) {
+		if (targets[i] != -1)
+			isTarget[targets[i]] = true;
+	}
+
+	Translator t;
+	t.vm = vm;
+	t.code = NULL;
+	t.offsets = NULL;
+	t.targets = NULL;
+	t.count = 0;
+	t.capacity = 0;
+	t.stack = ALLOCATE(vm, StackValue, maxHeight + 1);
+	for (int i = 0; i <= maxHeight; i++)
+		push(&t, i, VALUE_REGISTER, 0, NULL);
+	Value* constants = function -> chunk.constants.values;
+
+	bool reached = true;
+	for (int i = 0; i < count;) {
+		int height = heights[i];
+		newIndex[i] = t.count;
+		if (height == -1) {
+			i++;
+			continue;
+		}
+		t.offset = offsets[i];
+		if (isTarget[i]) {
+			//The jumps here left everything in registers. Code falling in
+			//has to as well, before the label.
+			if (reached)
+				flush(&t, height);
+			newIndex[i] = t.count;
+			for (int j = 0; j < height; j++)
+				setRegister(&t, j);
+		}
+		Instr* instr = &code[i];
+		int top = height - 1;
+		int skip = 0;
+
+		switch (instr -> op) {
+			case OP_CONSTANT:
+				push(&t, height, VALUE_CONSTANT, 0, instr -> as.constant);
+				break;
+			case OP_NIL:
+				push(&t, height, VALUE_NIL, 0, NULL);
+				break;
+			case OP_TRUE:
+				push(&t, height, VALUE_TRUE, 0, NULL);
+				break;
+			case OP_FALSE:
+				push(&t, height, VALUE_FALSE, 0, NULL);
+				break;
+			case OP_POP:
+				break;
+			case OP_GET_LOCAL: {
+				StackValue value = t.stack[instr -> arg];
+				if (value.kind == VALUE_REGISTER)
+					push(&t, height, VALUE_LOCAL, instr -> arg, NULL);
+				else
+					t.stack[height] = value;
+				break;
+			}
+			case OP_SET_LOCAL:
+				store(&t, instr -> arg, top, height);
+				if (i + 1 < count && code[i + 1].op == OP_POP && !isTarget[i + 1])
+					skip = 1;
+				break;
+			case OP_GET_GLOBAL: {
+				int result = destination(&t, code, isTarget, count, i, height, &skip);
+				emit(&t, OP_GET_GLOBAL_R, result, 0, 0) -> as.slot = instr -> as.slot;
+				break;
+			}
+			case OP_SET_GLOBAL:
+			case OP_DEFINE_GLOBAL: {
+				int source = operand(&t, top);
+				uint8_t op = instr -> op == OP_SET_GLOBAL ? OP_SET_GLOBAL_R : OP_DEFINE_GLOBAL_R;
+				emit(&t, op, source, 0, 0) -> as.slot = instr -> as.slot;
+				break;
+			}
+			case OP_GET_UPVALUE:
+			case OP_GET_FLAT_UPVALUE: {
+				int result = destination(&t, code, isTarget, count, i, height, &skip);
+				uint8_t op = instr -> op == OP_GET_UPVALUE ? OP_GET_UPVALUE_R : OP_GET_FLAT_UPVALUE_R;
+				emit(&t, op, result, instr -> arg, 0);
+				break;
+			}
+			case OP_SET_UPVALUE:
+				emit(&t, OP_SET_UPVALUE_R, operand(&t, top), instr -> arg, 0);
+				break;
+			case OP_LESS:
+			case OP_GREATER:
+			case OP_EQUAL: {
+				//A comparison that only feeds a branch, with the condition
+				//popped on both paths, becomes a compare-and-jump.
+				int jump = i + 1;
+				if (i + 2 < count && code[jump].op == OP_JUMP_IF_FALSE && code[i + 2].op == OP_POP &&
+						!isTarget[jump] && !isTarget[i + 2] && code[targets[jump]].op == OP_POP) {
+					int a = operand(&t, top - 1);
+					int b = operand(&t, top);
+					flush(&t, top - 1);
+					uint8_t op = instr -> op == OP_LESS ? OP_LESS_JUMP_R :
+						instr -> op == OP_GREATER ? OP_GREATER_JUMP_R : OP_EQUAL_JUMP_R;
+					emitJump(&t, op, a, b, targets[jump]);
+					skip = 2;
+					break;
+				}
+			}
+			//Fall through.
+			case OP_ADD:
+			case OP_SUBTRACT:
+			case OP_MULTIPLY:
+			case OP_DIVIDE:
+			case OP_MODULO:
+			case OP_BIT_AND:
+			case OP_BIT_OR:
+			case OP_BIT_XOR:
+			case OP_SHIFT_LEFT:
+			case OP_SHIFT_RIGHT: {
+				StackValue right = t.stack[top];
+				int a = operand(&t, top - 1);
+				if ((instr -> op == OP_ADD || instr -> op == OP_SUBTRACT) &&
+						right.kind == VALUE_CONSTANT && IS_NUMBER(*right.constant)) {
+					int result = destination(&t, code, isTarget, count, i, top - 1, &skip);
+					uint8_t op = instr -> op == OP_ADD ? OP_ADD_RK : OP_SUBTRACT_RK;
+					emit(&t, op, result, a, 0) -> as.constant = right.constant;
+					break;
+				}
+				int b = operand(&t, top);
+				int result = destination(&t, code, isTarget, count, i, top - 1, &skip);
+				emit(&t, registerOpcode(instr -> op), result, a, b);
+				break;
+			}
+			case OP_NEGATE:
+			case OP_NOT: {
+				int source = operand(&t, top);
+				int result = destination(&t, code, isTarget, count, i, top, &skip);
+				emit(&t, registerOpcode(instr -> op), result, source, 0);
+				break;
+			}
+			case OP_PRINT:
+				emit(&t, OP_PRINT_R, operand(&t, top), 0, 0);
+				break;
+			case OP_JUMP_IF_FALSE: {
+				StackValue condition = t.stack[top];
+				//Numbers and strings are always true, so the jump never is.
+				if (condition.kind == VALUE_CONSTANT || condition.kind == VALUE_TRUE)
+					break;
+				//The condition only needs a register of its own if something
+				//after the jump, or at its target, still uses it.
+				bool popped = i + 1 < count && code[i + 1].op == OP_POP && !isTarget[i + 1] &&
+					code[targets[i]].op == OP_POP;
+				int source;
+				if (popped) {
+					source = operand(&t, top);
+					flush(&t, top);
+				}
+				else {
+					flush(&t, height);
+					source = top;
+				}
+				emitJump(&t, OP_TEST_JUMP, source, 0, targets[i]);
+				break;
+			}
+			case OP_JUMP:
+			case OP_LOOP: {
+				flush(&t, height);
+				emitJump(&t, instr -> op, 0, 0, targets[i]);
+				break;
+			}
+			case OP_RETURN:
+				emit(&t, OP_RETURN_R, 0, 0, operand(&t, top) + 1);
+				break;
+			case OP_CALL:
+			case OP_TAIL_CALL:
+			case OP_INVOKE:
+			case OP_SUPER_INVOKE: {
+				flush(&t, height);
+				bridge(&t, instr, height, 0);
+				setRegister(&t, height + stackEffect(instr -> op, instr -> arg) - 1);
+				break;
+			}
+			case OP_CLOSURE: {
+				//Captured locals are read through the upvalue from now on.
+				const uint8_t* upvalues = instr -> as.upvalues;
+				ObjFunction* closure = AS_FUNCTION(constants[upvalues[-1]]);
+				for (int j = 0; j < closure -> upvalueCount; j++) {
+					if (upvalues[2 * j])
+						materialize(&t, upvalues[2 * j + 1]);
+				}
+				bridge(&t, instr, height, 0);
+				setRegister(&t, height);
+				break;
+			}
+			case OP_CLASS:
+				bridge(&t, instr, height, 0);
+				setRegister(&t, height);
+				break;
+			case OP_CLOSE_UPVALUE:
+			case OP_GET_PROPERTY:
+				bridge(&t, instr, height, 1);
+				break;
+			case OP_SET_PROPERTY:
+			case OP_GET_SUPER:
+			case OP_METHOD:
+			case OP_INHERIT:
+				bridge(&t, instr, height, 2);
+				break;
+			default:
+				//Superinstructions and quickened forms are never in the input.
+				break;
+		}
+
+		reached = fallsThrough(instr -> op);
+		for (int j = 1; j <= skip; j++)
+			newIndex[i + j] = t.count;
+		i += 1 + skip;
+	}
+	newIndex[count] = t.count;
+
+	for (int i = 0; i < t.count; i++) {
+		if (t.targets[i] != -1)
+			t.targets[i] = newIndex[t.targets[i]];
+	}
+	if (maxHeight > function -> maxSlots)
+		function -> maxSlots = maxHeight;
+
+	FREE_ARRAY(vm, StackValue, t.stack, maxHeight + 1);
+	FREE_ARRAY(vm, int, newIndex, count + 1);
+	FREE_ARRAY(vm, bool, isTarget, count);
+	FREE_ARRAY(vm, int, heights, count);
+	FREE_ARRAY(vm, Instr, code, count);
+	FREE_ARRAY(vm, int, offsets, count);
+	FREE_ARRAY(vm, int, targets, count);
+	*codeOut = GROW_ARRAY(vm, Instr, t.code, t.capacity, t.count);
+	*offsetsOut = GROW_ARRAY(vm, int, t.offsets, t.capacity, t.count);
+	*targetsOut = GROW_ARRAY(vm, int, t.targets, t.capacity, t.count);
+	return t.count;
+}
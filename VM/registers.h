@@ -0,0 +1,15 @@
+#ifndef Von_registers_h
+#define Von_registers_h
+
+#include "common.h"
+#include "decode.h"
+
+//Rewrites a function's decoded stack code as register code, in place of
+//code, offsets and targets, where targets holds instruction indices. The
+//registers are the stack slots the stack code would have used, so both
+//forms call and return the same way and can call each other. Returns the
+//new instruction count, or -1 when the function needs more registers than
+//an operand byte can name and has to stay on the stack.
+int translateRegisters(VM* vm, ObjFunction* function, Instr** code, int** offsets, int** targets, int count);
+
+#endif
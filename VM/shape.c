@@ -0,0 +1,61 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "shape.h"
+
+Shape* newShape(VM* vm, Shape* parent, ObjString* key) {
+	Shape* shape = ALLOCATE(vm, Shape, 1);
+	shape -> parent = parent;
+	shape -> key = key;
+	shape -> slotCount = parent == NULL ? 0 : parent -> slotCount + 1;
+	shape -> transitions = NULL;
+	shape -> transitionCount = 0;
+	shape -> transitionCapacity = 0;
+	return shape;
+}
+
+//Returns the slot holding key, or -1 if instances of this shape have no
+//such field.
+int shapeLookup(Shape* shape, ObjString* key) {
+	for (; shape -> key != NULL; shape = shape -> parent) {
+		if (shape -> key == key)
+			return shape -> slotCount - 1;
+	}
+	return -1;
+}
+
+//Returns the shape reached by adding key, creating it on first use. NULL
+//means the tree has grown too wide or too deep here and the instance
+//should switch to dictionary mode.
+Shape* shapeTransition(VM* vm, Shape* shape, ObjString* key) {
+	for (int i = 0; i < shape -> transitionCount; i++) {
+		if (shape -> transitions[i] -> key == key)
+			return shape -> transitions[i];
+	}
+	if (shape -> slotCount == SHAPE_MAX_FIELDS || shape -> transitionCount == SHAPE_MAX_TRANSITIONS)
+		return NULL;
+
+	if (shape -> transitionCapacity < shape -> transitionCount + 1) {
+		int oldCapacity = shape -> transitionCapacity;
+		shape -> transitionCapacity = GROW_CAPACITY(oldCapacity);
+		shape -> transitions = GROW_ARRAY(vm, Shape*, shape -> transitions, oldCapacity, shape -> transitionCapacity);
+	}
+	Shape* child = newShape(vm, shape, key);
+	shape -> transitions[shape -> transitionCount++] = child;
+	return child;
+}
+
+void markShape(VM* vm, Shape* shape) {
+	markObject(vm, (Obj*)shape -> key);
+	for (int i = 0; i < shape -> transitionCount; i++) {
+		markShape(vm, shape -> transitions[i]);
+	}
+}
+
+void freeShape(VM* vm, Shape* shape) {
+	for (int i = 0; i < shape -> transitionCount; i++) {
+		freeShape(vm, shape -> transitions[i]);
+	}
+	FREE_ARRAY(vm, Shape*, shape -> transitions, shape -> transitionCapacity);
+	FREE(vm, Shape, shape);
+}
@@ -0,0 +1,31 @@
+#ifndef Von_shape_h
+#define Von_shape_h
+
+#include "common.h"
+#include "value.h"
+
+//Past these limits instances stop sharing shapes and keep their fields in
+//a private table instead.
+#define SHAPE_MAX_FIELDS 64
+#define SHAPE_MAX_TRANSITIONS 32
+
+//A shape describes the field layout shared by every instance of a class
+//that had the same fields added in the same order. Each shape adds one key
+//to its parent; the key's slot is slotCount - 1. Every class owns the
+//transition tree that starts at its root shape.
+typedef struct Shape {
+	struct Shape* parent;
+	ObjString* key;
+	int slotCount;
+	struct Shape** transitions;
+	int transitionCount;
+	int transitionCapacity;
+} Shape;
+
+Shape* newShape(VM* vm, Shape* parent, ObjString* key);
+int shapeLookup(Shape* shape, ObjString* key);
+Shape* shapeTransition(VM* vm, Shape* shape, ObjString* key);
+void markShape(VM* vm, Shape* shape);
+void freeShape(VM* vm, Shape* shape);
+
+#endif
@@ -1,144 +1,364 @@
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+//Control bytes of slots without a key. Both have the high bit set, which
+//the hash bits of a full slot never do.
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+
+//At most this many slots hold a key or a tombstone.
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+//The group is picked with the low bits of the hash, so the control byte
+//takes the top ones.
+static inline uint8_t hashTag(uint32_t hash) {
+	return (uint8_t)(hash >> 25);
+}
+
+//A bit for each control byte of the group equal to byte.
+static inline uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+#ifdef __SSE2__
+	__m128i control = _mm_loadu_si128((const __m128i*)group);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < TABLE_GROUP; i++) {
+		mask |= (uint32_t)(group[i] == byte) << i;
+	}
+	return mask;
+#endif
+}
+
+//A bit for each slot of the group that is empty or a tombstone.
+static inline uint32_t matchFree(const uint8_t* group) {
+#ifdef __SSE2__
+	return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < TABLE_GROUP; i++) {
+		mask |= (uint32_t)(group[i] >> 7) << i;
+	}
+	return mask;
+#endif
+}
+
+static inline int lowestBit(uint32_t mask) {
+	return __builtin_ctz(mask);
+}
+
+static inline bool isFull(uint8_t control) {
+	return (control & 0x80) == 0;
+}
 
 void initTable(Table* table) {
 	table -> count = 0;
 	table -> capacity = 0;
+	table -> growthLeft = 0;
+	table -> control = NULL;
 	table -> entries = NULL;
+	table -> oldCapacity = 0;
+	table -> migrated = 0;
+	table -> oldControl = NULL;
+	table -> oldEntries = NULL;
+}
+
+static void freeOld(VM* vm, Table* table) {
+	FREE_ARRAY(vm, uint8_t, table -> oldControl, table -> oldCapacity);
+	FREE_ARRAY(vm, Entry, table -> oldEntries, table -> oldCapacity);
+	table -> oldCapacity = 0;
+	table -> migrated = 0;
+	table -> oldControl = NULL;
+	table -> oldEntries = NULL;
 }
 
-void freeTable(Table* table) {
-	FREE_ARRAY(Entry, table -> entries, table -> capacity);
+void freeTable(VM* vm, Table* table) {
+	FREE_ARRAY(vm, uint8_t, table -> control, table -> capacity);
+	FREE_ARRAY(vm, Entry, table -> entries, table -> capacity);
+	freeOld(vm, table);
 	initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-	uint32_t index = key -> hash & (capacity - 1);
-	Entry* tombstone = NULL;
-	for (;;) {
-		Entry* entry = &entries[index];
-		if (entry -> key == NULL) {
-			if (IS_NIL(entry -> value)) {
-				return tombstone != NULL ? tombstone : entry;
-			}
-			else {
-				if (tombstone == NULL)
-					tombstone = entry;
-			}
-		}
-		else if (entry -> key == key) {
-			return entry;
+//The slot of the arrays holding key, or -1. Groups are visited at
+//triangular offsets from the first, which reaches every one of them since
+//there is a power of two, and a group with an empty slot ends the search
+//because an insert would have stopped there. Slots before start are
+//skipped without reading their entries.
+static inline int findEntry(const uint8_t* controls, Entry* entries, int capacity, int start,
+		ObjString* key) {
+	uint32_t hash = key -> hash;
+	uint8_t tag = hashTag(hash);
+	uint32_t groupMask = (uint32_t)capacity / TABLE_GROUP - 1;
+	uint32_t group = hash & groupMask;
+	for (uint32_t step = 1;; step++) {
+		const uint8_t* control = controls + group * TABLE_GROUP;
+		for (uint32_t match = matchByte(control, tag); match != 0; match &= match - 1) {
+			int index = (int)(group * TABLE_GROUP) + lowestBit(match);
+			if (index >= start && entries[index].key == key)
+				return index;
 		}
-		index = (index + 1) & (capacity + 1);
-	}	
+		if (matchByte(control, CONTROL_EMPTY) != 0)
+			return -1;
+		group = (group + step) & groupMask;
+	}
+}
+
+//The first slot along the hash's probe sequence a new key can go in.
+static inline int findFree(Table* table, uint32_t hash) {
+	uint32_t groupMask = (uint32_t)table -> capacity / TABLE_GROUP - 1;
+	uint32_t group = hash & groupMask;
+	for (uint32_t step = 1;; step++) {
+		uint32_t free = matchFree(table -> control + group * TABLE_GROUP);
+		if (free != 0)
+			return (int)(group * TABLE_GROUP) + lowestBit(free);
+		group = (group + step) & groupMask;
+	}
+}
+
+//The slot of the old arrays still holding key, or -1. Moved slots keep
+//their control bytes so that probes through them still end where they
+//used to, but their entries are stale copies whose keys may have been
+//freed since, so they are never read.
+static inline int findOld(Table* table, ObjString* key) {
+	if (table -> oldControl == NULL)
+		return -1;
+	return findEntry(table -> oldControl, table -> oldEntries, table -> oldCapacity,
+			table -> migrated, key);
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
 	if (table -> count == 0)
 		return false;
-	Entry* entry = findEntry(table -> entries, table -> capacity, key);
-	if (entry -> key == NULL)
+	int index = findEntry(table -> control, table -> entries, table -> capacity, 0, key);
+	if (index != -1) {
+		*value = table -> entries[index].value;
+		return true;
+	}
+	index = findOld(table, key);
+	if (index == -1)
 		return false;
-	*value = entry -> value;
+	*value = table -> oldEntries[index].value;
 	return true;
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-	Entry* entries = ALLOCATE(Entry, capacity);
-	for (int i = 0; i < capacity; i++) {
-		entries[i].key = NULL;
-		entries[i].value = NIL_VAL;
+//Moves up to groups groups of the old arrays into the new ones, and frees
+//the old arrays once nothing is left in them. The slots were set aside
+//when the resize started, so growthLeft is not touched.
+static void migrate(VM* vm, Table* table, int groups) {
+	int end = table -> migrated + groups * TABLE_GROUP;
+	if (end > table -> oldCapacity)
+		end = table -> oldCapacity;
+	for (int start = table -> migrated; start < end; start += TABLE_GROUP) {
+		uint32_t full = ~matchFree(table -> oldControl + start) & 0xffff;
+		for (; full != 0; full &= full - 1) {
+			Entry* entry = &table -> oldEntries[start + lowestBit(full)];
+			uint32_t hash = entry -> key -> hash;
+			int index = findFree(table, hash);
+			table -> control[index] = hashTag(hash);
+			table -> entries[index] = *entry;
+		}
 	}
-	table -> count = 0;
-	for (int i = 0; i < table -> capacity; i++) {
-		Entry* entry = &table -> entries[i];
-		if (entry -> key == NULL)
-			continue;
-		Entry* dest = findEntry(entries, capacity, entry -> key);
-		dest -> key = entry -> key;
-		dest -> value = entry -> value;
-		table -> count++;
-	}
-	FREE_ARRAY(Entry, table -> entries, table -> capacity);
-	table -> entries = entries;
+	table -> migrated = end;
+	if (end == table -> oldCapacity)
+		freeOld(vm, table);
+}
+
+//Only allocates and clears the control bytes; the keys already in the
+//table stay in the old arrays until migrate() gets to them. Entries are
+//only read behind a full control byte, so they are left uninitialized.
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+	uint8_t* control = ALLOCATE(vm, uint8_t, capacity);
+	Entry* entries = ALLOCATE(vm, Entry, capacity);
+	memset(control, CONTROL_EMPTY, capacity);
+
+	table -> oldCapacity = table -> capacity;
+	table -> migrated = 0;
+	table -> oldControl = table -> control;
+	table -> oldEntries = table -> entries;
 	table -> capacity = capacity;
+	table -> growthLeft = TABLE_MAX_LOAD(capacity) - table -> count;
+	table -> control = control;
+	table -> entries = entries;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) {
-	if (table -> count + 1 > table -> capacity * TABLE_MAX_LOAD) {
-		int capacity = GROW_CAPACITY(table -> capacity);
-		adjustCapacity(table, capacity);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
+	if (table -> oldControl != NULL) {
+		migrate(vm, table, TABLE_MIGRATE_GROUPS);
+		//Keys that have not been moved yet are updated where they are.
+		int old = findOld(table, key);
+		if (old != -1) {
+			table -> oldEntries[old].value = value;
+			return false;
+		}
+	}
+	//One pass looks for the key and for the first slot it could go in.
+	int index = -1;
+	if (table -> capacity > 0) {
+		uint32_t hash = key -> hash;
+		uint8_t tag = hashTag(hash);
+		uint32_t groupMask = (uint32_t)table -> capacity / TABLE_GROUP - 1;
+		uint32_t group = hash & groupMask;
+		for (uint32_t step = 1;; step++) {
+			const uint8_t* control = table -> control + group * TABLE_GROUP;
+			for (uint32_t match = matchByte(control, tag); match != 0; match &= match - 1) {
+				Entry* entry = &table -> entries[group * TABLE_GROUP + lowestBit(match)];
+				if (entry -> key == key) {
+					entry -> value = value;
+					return false;
+				}
+			}
+			uint32_t free = matchFree(control);
+			if (index == -1 && free != 0)
+				index = (int)(group * TABLE_GROUP) + lowestBit(free);
+			if (matchByte(control, CONTROL_EMPTY) != 0)
+				break;
+			group = (group + step) & groupMask;
+		}
 	}
-	Entry* entry = findEntry(table -> entries, table -> capacity, key);
-	bool isNewKey = entry -> key == NULL;
-	if (isNewKey && IS_NIL(entry -> value))
-		table -> count++;
-	entry -> key = key;
-	entry -> value = value;
-	return isNewKey;
+	if (table -> growthLeft == 0 && (index == -1 || table -> control[index] == CONTROL_EMPTY)) {
+		//A migration that has not caught up is finished first, so there is
+		//never more than one old array.
+		if (table -> oldControl != NULL)
+			migrate(vm, table, table -> oldCapacity / TABLE_GROUP);
+		//Mostly tombstones is cleared out in place rather than grown.
+		int capacity = table -> capacity;
+		if (capacity == 0)
+			capacity = TABLE_GROUP;
+		else if (table -> count >= TABLE_MAX_LOAD(capacity) / 2)
+			capacity *= 2;
+		adjustCapacity(vm, table, capacity);
+		if (table -> oldControl != NULL)
+			migrate(vm, table, TABLE_MIGRATE_GROUPS);
+		index = findFree(table, key -> hash);
+	}
+	if (table -> control[index] == CONTROL_EMPTY)
+		table -> growthLeft--;
+	table -> control[index] = hashTag(key -> hash);
+	table -> entries[index].key = key;
+	table -> entries[index].value = value;
+	table -> count++;
+	return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
 	if (table -> count == 0)
 		return false;
-	Entry* entry = findEntry(table -> entries, table -> capacity, key);
-	if (entry -> key == NULL)
-		return false;
-	entry -> key = NULL;
-	entry  -> value = BOOL_VAL(true);
+	int index = findEntry(table -> control, table -> entries, table -> capacity, 0, key);
+	if (index != -1) {
+		//A group that still has an empty slot never sent a probe on past it,
+		//so the slot can go back to empty instead of leaving a tombstone.
+		if (matchByte(table -> control + (index & ~(TABLE_GROUP - 1)), CONTROL_EMPTY) != 0) {
+			table -> control[index] = CONTROL_EMPTY;
+			table -> growthLeft++;
+		}
+		else {
+			table -> control[index] = CONTROL_DELETED;
+		}
+	}
+	else {
+		//Nothing is inserted into the old arrays, so a tombstone there is
+		//only skipped by lookups and dropped by the migration.
+		index = findOld(table, key);
+		if (index == -1)
+			return false;
+		table -> oldControl[index] = CONTROL_DELETED;
+	}
+	table -> count--;
 	return true;
 }
 
-void tableAddAll(Table* from, Table* to) {
+void tableAddAll(VM* vm, Table* from, Table* to) {
 	for (int i = 0; i < from -> capacity; i++) {
-		Entry* entry = &from -> entries[i];
-		if (entry -> key != NULL) {
-			tableSet(to, entry -> key, entry -> value);
+		if (isFull(from -> control[i]))
+			tableSet(vm, to, from -> entries[i].key, from -> entries[i].value);
+	}
+	for (int i = from -> migrated; i < from -> oldCapacity; i++) {
+		if (isFull(from -> oldControl[i]))
+			tableSet(vm, to, from -> oldEntries[i].key, from -> oldEntries[i].value);
+	}
+}
+
+static inline int findString(const uint8_t* controls, Entry* entries, int capacity, int start,
+		const char* chars, int length, uint32_t hash) {
+	uint8_t tag = hashTag(hash);
+	uint32_t groupMask = (uint32_t)capacity / TABLE_GROUP - 1;
+	uint32_t group = hash & groupMask;
+	for (uint32_t step = 1;; step++) {
+		const uint8_t* control = controls + group * TABLE_GROUP;
+		for (uint32_t match = matchByte(control, tag); match != 0; match &= match - 1) {
+			int index = (int)(group * TABLE_GROUP) + lowestBit(match);
+			if (index < start)
+				continue;
+			ObjString* key = entries[index].key;
+			if (key -> length == length && key -> hash == hash &&
+					memcmp(key -> chars, chars, length) == 0)
+				return index;
 		}
+		if (matchByte(control, CONTROL_EMPTY) != 0)
+			return -1;
+		group = (group + step) & groupMask;
 	}
 }
 
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
 	if (table -> count == 0)
 		return NULL;
-	uint32_t index = hash & (table -> capacity - 1);
-	for (;;) {
-		Entry* entry = &table -> entries[index];
-		if (entry -> key == NULL) {
-			if (IS_NIL(entry -> value))
-				return NULL;
-		}
-		else if (entry -> key -> length == length &&
-				entry -> key -> hash == hash &&
-				memcmp(entry -> key -> chars, chars, length) == 0) {
-			return entry -> key;
-		}
-		index = (index + 1) & (table -> capacity - 1);
-	}
+	int index = findString(table -> control, table -> entries, table -> capacity, 0,
+			chars, length, hash);
+	if (index != -1)
+		return table -> entries[index].key;
+	if (table -> oldControl == NULL)
+		return NULL;
+	index = findString(table -> oldControl, table -> oldEntries, table -> oldCapacity,
+			table -> migrated, chars, length, hash);
+	return index == -1 ? NULL : table -> oldEntries[index].key;
 }
 
-void markTable(Table* table) {
+//The key of some entry holding value, or NULL. A linear search, so only
+//for things like error messages.
+ObjString* tableFindKey(Table* table, Value value) {
 	for (int i = 0; i < table -> capacity; i++) {
-		Entry* entry = &table -> entries[i];
-		markObject((Obj*)entry -> key);
-		markValue(entry -> value);
+		if (isFull(table -> control[i]) && valuesEqual(table -> entries[i].value, value))
+			return table -> entries[i].key;
+	}
+	for (int i = table -> migrated; i < table -> oldCapacity; i++) {
+		if (isFull(table -> oldControl[i]) && valuesEqual(table -> oldEntries[i].value, value))
+			return table -> oldEntries[i].key;
 	}
+	return NULL;
 }
 
-void tableRemoveWhite(Table* table) {
+//A collection can start in the middle of a migration, so both sets of
+//arrays are walked.
+void markTable(VM* vm, Table* table) {
 	for (int i = 0; i < table -> capacity; i++) {
-		Entry* entry = &table -> entries[i];
-		if (entry -> key != NULL && !entry -> key -> obj.isMarked) {
-			tableDelete(table, entry -> key);
+		if (isFull(table -> control[i])) {
+			markObject(vm, (Obj*)table -> entries[i].key);
+			markValue(vm, table -> entries[i].value);
+		}
+	}
+	for (int i = table -> migrated; i < table -> oldCapacity; i++) {
+		if (isFull(table -> oldControl[i])) {
+			markObject(vm, (Obj*)table -> oldEntries[i].key);
+			markValue(vm, table -> oldEntries[i].value);
 		}
 	}
 }
 
-
+void tableRemoveWhite(Table* table) {
+	for (int i = 0; i < table -> capacity; i++) {
+		if (isFull(table -> control[i]) && !isObjMarked((Obj*)table -> entries[i].key))
+			tableDelete(table, table -> entries[i].key);
+	}
+	for (int i = table -> migrated; i < table -> oldCapacity; i++) {
+		if (isFull(table -> oldControl[i]) && !isObjMarked((Obj*)table -> oldEntries[i].key))
+			tableDelete(table, table -> oldEntries[i].key);
+	}
+}
@@ -4,25 +4,50 @@
 #include "common.h"
 #include "value.h"
 
+//Slots come in groups of this many, each with a control byte of its own.
+//A lookup checks every control byte of a group at once.
+#define TABLE_GROUP 16
+
+//Groups of the old arrays moved into the new ones by each tableSet()
+//while a resize is under way.
+#define TABLE_MIGRATE_GROUPS 8
+
 typedef struct {
 	ObjString* key;
 	Value value;
 } Entry;
 
+//An open-addressed table probed a group at a time. A full slot's control
+//byte holds the top seven bits of its key's hash, so a lookup only reads
+//the entries whose byte matches. Only full slots have a meaningful entry.
+//
+//Growing does not rehash everything at once. The old arrays are kept
+//next to the new ones and emptied a few groups per insert, so until
+//oldControl is NULL again a key may live in either.
 typedef struct {
 	int count;
 	int capacity;
+	//Empty slots that can still be filled before the table has to grow.
+	//Filling a tombstone does not use one up.
+	int growthLeft;
+	uint8_t* control;
 	Entry* entries;
+	int oldCapacity;
+	//Slots of the old arrays before this one have all been moved.
+	int migrated;
+	uint8_t* oldControl;
+	Entry* oldEntries;
 } Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
-bool tableSet(Table* table, ObjString* key, Value value);
-void tableAddAll(Table* from, Table* to);
+void freeTable(VM* vm, Table* table);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
+void tableAddAll(VM* vm, Table* from, Table* to);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableDelete(Table* table, ObjString* key);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
-void markTable(Table* table);
+ObjString* tableFindKey(Table* table, Value value);
+void markTable(VM* vm, Table* table);
 void tableRemoveWhite(Table* table);
 
 #endif
@@ -0,0 +1,620 @@
+#include "trace.h"
+
+#ifdef JIT
+
+#include <stdlib.h>
+
+#include "assembler.h"
+#include "vm.h"
+
+//A tracing JIT for loops. When a back edge gets hot, the recorder runs one
+//more iteration itself, starting at the loop header, and emits native code
+//for exactly the path that iteration takes. Every value the trace touches
+//lives in an xmm register: a number is its own unboxed double, and nil and
+//the bools keep their tagged bits. Types are checked once on entry, and the
+//branches the iteration did not take become side exits that write the
+//registers back to the frame and return to the interpreter. Anything the
+//recorder does not handle, like calls, properties, strings or inner loops,
+//abandons the recording and the loop stays interpreted.
+//
+//Frame positions, both locals and temporaries, are numbered by their offset
+//from the frame's slots, so a push is just a write to the next position.
+//The code is called as trace(vm, slots) and uses rdi and rsi for those.
+
+#define VM_REGISTER RDI
+#define SLOTS RSI
+
+//xmm0 to xmm13 hold frame positions. xmm15 is scratch.
+#define TRACE_REGISTERS 14
+#define SCRATCH 15
+
+#define MAX_POSITIONS 256
+#define MAX_OPS 256
+#define MAX_BACK_EDGES 8
+
+typedef enum {
+	KIND_NUMBER,
+	KIND_BOOL,
+	KIND_NIL,
+	KIND_OTHER,
+} Kind;
+
+typedef struct {
+	int jump;
+	int depth;
+	Instr* resume;
+} SideExit;
+
+typedef struct {
+	VM* vm;
+	Value* slots;
+	Instr* header;
+	Instr* loop;
+	Assembler as;
+	int headerDepth;
+	//The register holding each frame position, or -1 if the trace never
+	//touches it, and the other way around.
+	int registers[MAX_POSITIONS];
+	int positions[TRACE_REGISTERS];
+	int registerCount;
+	//Positions below headerDepth that are read before they are written,
+	//and so are type checked on entry.
+	bool guarded[MAX_POSITIONS];
+	Kind entryKinds[MAX_POSITIONS];
+	SideExit exits[MAX_OPS];
+	int exitCount;
+	//Other back edges the iteration went through. A for loop jumps back
+	//from its increment to its condition, but going through the same one
+	//twice means an inner loop.
+	Instr* backEdges[MAX_BACK_EDGES];
+	int backEdgeCount;
+} Recorder;
+
+static Kind kindOf(Value value) {
+	if (IS_NUMBER(value))
+		return KIND_NUMBER;
+	if (IS_BOOL(value))
+		return KIND_BOOL;
+	if (IS_NIL(value))
+		return KIND_NIL;
+	return KIND_OTHER;
+}
+
+static int depthOf(Recorder* r) {
+	return (int)(r -> vm -> stackTop - r -> slots);
+}
+
+//Returns the register for a frame position, or -1 once they have run out.
+static int touch(Recorder* r, int position, bool read) {
+	if (position >= MAX_POSITIONS)
+		return -1;
+	if (r -> registers[position] == -1) {
+		if (r -> registerCount == TRACE_REGISTERS)
+			return -1;
+		r -> registers[position] = r -> registerCount;
+		r -> positions[r -> registerCount++] = position;
+		//Nothing has written the position yet, so it still holds the value
+		//it had on entry.
+		if (read && position < r -> headerDepth) {
+			r -> guarded[position] = true;
+			r -> entryKinds[position] = kindOf(r -> slots[position]);
+		}
+	}
+	return r -> registers[position];
+}
+
+static void addExit(Recorder* r, int jump, int depth, Instr* resume) {
+	SideExit* exit = &r -> exits[r -> exitCount++];
+	exit -> jump = jump;
+	exit -> depth = depth;
+	exit -> resume = resume;
+}
+
+//Jumps away unless rax holds a value of the given kind. Returns the jump.
+static int guardKind(Assembler* as, Kind kind) {
+	switch (kind) {
+		case KIND_NUMBER:
+			emitLoadImmediate(as, RDX, QNAN);
+			emitArith(as, MOV, RCX, RAX);
+			emitArith(as, AND, RCX, RDX);
+			emitArith(as, CMP, RCX, RDX);
+			return emitJump(as, CC_E);
+		case KIND_BOOL:
+			emitLoadImmediate(as, RDX, 1);
+			emitArith(as, MOV, RCX, RAX);
+			emitArith(as, OR, RCX, RDX);
+			emitLoadImmediate(as, RDX, TRUE_VAL);
+			emitArith(as, CMP, RCX, RDX);
+			return emitJump(as, CC_NE);
+		default:
+			emitLoadImmediate(as, RDX, NIL_VAL);
+			emitArith(as, CMP, RAX, RDX);
+			return emitJump(as, CC_NE);
+	}
+}
+
+static void move(Assembler* as, int dst, int src) {
+	if (dst != src)
+		emitSseRegisters(as, 0x66, MOVAPD, dst, src);
+}
+
+static void loadConstant(Assembler* as, int dst, Value value) {
+	emitLoadImmediate(as, RAX, value);
+	emitMovqToXmm(as, dst, RAX);
+}
+
+//Turns the 0 or 1 in rax into a bool in the given register.
+static void storeBool(Assembler* as, int dst) {
+	emitLoadImmediate(as, RCX, FALSE_VAL);
+	emitArith(as, OR, RAX, RCX);
+	emitMovqToXmm(as, dst, RAX);
+}
+
+static bool pushConstant(Recorder* r, Value value) {
+	int dst = touch(r, depthOf(r), false);
+	if (kindOf(value) == KIND_OTHER || dst == -1)
+		return false;
+	loadConstant(&r -> as, dst, value);
+	*r -> vm -> stackTop++ = value;
+	return true;
+}
+
+static double apply(uint8_t sseOp, double a, double b) {
+	switch (sseOp) {
+		case ADDSD: return a + b;
+		case SUBSD: return a - b;
+		case MULSD: return a * b;
+		default: return a / b;
+	}
+}
+
+static bool arithmetic(Recorder* r, uint8_t sseOp) {
+	Value* top = r -> vm -> stackTop;
+	int depth = depthOf(r);
+	if (!IS_NUMBERS(top[-2], top[-1]))
+		return false;
+	int a = touch(r, depth - 2, true);
+	int b = touch(r, depth - 1, true);
+	if (a == -1 || b == -1)
+		return false;
+	emitSseRegisters(&r -> as, 0xF2, sseOp, a, b);
+	top[-2] = NUMBER_VAL(apply(sseOp, AS_NUMBER(top[-2]), AS_NUMBER(top[-1])));
+	r -> vm -> stackTop--;
+	return true;
+}
+
+//Adds a local and either another local or a constant into a new position,
+//for the superinstructions that do that.
+static bool addToLocal(Recorder* r, uint8_t sseOp, int slot, int otherSlot, Value constant) {
+	Value a = r -> slots[slot];
+	Value b = otherSlot != -1 ? r -> slots[otherSlot] : constant;
+	int depth = depthOf(r);
+	if (!IS_NUMBERS(a, b))
+		return false;
+	int left = touch(r, slot, true);
+	int right = otherSlot != -1 ? touch(r, otherSlot, true) : SCRATCH;
+	int dst = touch(r, depth, false);
+	if (left == -1 || right == -1 || dst == -1)
+		return false;
+	if (otherSlot == -1)
+		loadConstant(&r -> as, SCRATCH, constant);
+	move(&r -> as, dst, left);
+	emitSseRegisters(&r -> as, 0xF2, sseOp, dst, right);
+	*r -> vm -> stackTop++ = NUMBER_VAL(apply(sseOp, AS_NUMBER(a), AS_NUMBER(b)));
+	return true;
+}
+
+//Compares the top two numbers so that CC_A means the comparison holds.
+//Returns whether it held this time, or -1 if they are not numbers.
+static int compare(Recorder* r, bool greater) {
+	Value* top = r -> vm -> stackTop;
+	int depth = depthOf(r);
+	if (!IS_NUMBERS(top[-2], top[-1]))
+		return -1;
+	int a = touch(r, depth - 2, true);
+	int b = touch(r, depth - 1, true);
+	if (a == -1 || b == -1)
+		return -1;
+	//ucomisd only sets "above" for an ordered result, so NaN compares false
+	//like it does in C.
+	if (greater)
+		emitSseRegisters(&r -> as, 0x66, UCOMISD, a, b);
+	else
+		emitSseRegisters(&r -> as, 0x66, UCOMISD, b, a);
+	double x = AS_NUMBER(top[-2]);
+	double y = AS_NUMBER(top[-1]);
+	return greater ? x > y : x < y;
+}
+
+//Leaves 1 in rax if the top two values are equal and 0 otherwise. Returns
+//whether they were equal this time, or -1 if the registers ran out.
+static int equal(Recorder* r) {
+	Assembler* as = &r -> as;
+	Value* top = r -> vm -> stackTop;
+	int depth = depthOf(r);
+	int a = touch(r, depth - 2, true);
+	int b = touch(r, depth - 1, true);
+	if (a == -1 || b == -1)
+		return -1;
+	Kind left = kindOf(top[-2]);
+	Kind right = kindOf(top[-1]);
+	if (left == KIND_NUMBER && right == KIND_NUMBER) {
+		//Unordered sets both ZF and PF, so NaN is not equal to itself.
+		emitArith(as, XOR, RAX, RAX);
+		emitArith(as, XOR, RCX, RCX);
+		emitSseRegisters(as, 0x66, UCOMISD, a, b);
+		emitSetcc(as, CC_NP, RAX);
+		emitSetcc(as, CC_E, RCX);
+		emitArith(as, AND, RAX, RCX);
+	}
+	else if (left != KIND_NUMBER && right != KIND_NUMBER) {
+		emitMovqFromXmm(as, RCX, a);
+		emitMovqFromXmm(as, RDX, b);
+		emitArith(as, XOR, RAX, RAX);
+		emitArith(as, CMP, RCX, RDX);
+		emitSetcc(as, CC_E, RAX);
+	}
+	else {
+		emitArith(as, XOR, RAX, RAX);
+	}
+	return valuesEqual(top[-2], top[-1]);
+}
+
+//Follows a conditional jump the way it went this time and leaves a side
+//exit for the other way. jumped says which way that was, and the condition
+//code says when the exit is taken.
+static void branch(Recorder* r, Instr* instr, bool jumped, int condition, Instr** next) {
+	int jump = emitJump(&r -> as, condition);
+	addExit(r, jump, depthOf(r), jumped ? instr + 1 : instr -> as.target);
+	*next = jumped ? instr -> as.target : instr + 1;
+}
+
+//Emits and runs one instruction. Returns false, with nothing done, for
+//anything the trace cannot do.
+static bool recordInstruction(Recorder* r, Instr* instr, Instr** next) {
+	VM* vm = r -> vm;
+	Assembler* as = &r -> as;
+	Value* top = vm -> stackTop;
+	int depth = depthOf(r);
+	*next = instr + 1;
+	switch (instr -> op) {
+		case OP_CONSTANT:
+			return pushConstant(r, *instr -> as.constant);
+		case OP_NIL:
+			return pushConstant(r, NIL_VAL);
+		case OP_TRUE:
+			return pushConstant(r, TRUE_VAL);
+		case OP_FALSE:
+			return pushConstant(r, FALSE_VAL);
+		case OP_POP:
+			vm -> stackTop--;
+			return true;
+		case OP_POPN:
+			vm -> stackTop -= instr -> arg;
+			return true;
+		case OP_GET_LOCAL: {
+			int slot = instr -> arg;
+			if (kindOf(r -> slots[slot]) == KIND_OTHER)
+				return false;
+			int src = touch(r, slot, true);
+			int dst = touch(r, depth, false);
+			if (src == -1 || dst == -1)
+				return false;
+			move(as, dst, src);
+			*vm -> stackTop++ = r -> slots[slot];
+			return true;
+		}
+		case OP_SET_LOCAL:
+		case OP_SET_LOCAL_POP: {
+			int src = touch(r, depth - 1, true);
+			int dst = touch(r, instr -> arg, false);
+			if (src == -1 || dst == -1)
+				return false;
+			move(as, dst, src);
+			r -> slots[instr -> arg] = top[-1];
+			if (instr -> op == OP_SET_LOCAL_POP)
+				vm -> stackTop--;
+			return true;
+		}
+		case OP_GET_GLOBAL: {
+			Value value = vm -> globalValues.values[instr -> as.slot];
+			//Undefined globals are KIND_OTHER too.
+			Kind kind = kindOf(value);
+			int dst = touch(r, depth, false);
+			if (kind == KIND_OTHER || dst == -1)
+				return false;
+			emitLoad(as, RCX, VM_REGISTER, offsetof(VM, globalValues) + offsetof(ValueArray, values));
+			emitLoad(as, RAX, RCX, 8 * instr -> as.slot);
+			//Something outside the trace may have changed it, so the
+			//interpreter does this instruction over if the type is different.
+			addExit(r, guardKind(as, kind), depth, instr);
+			emitMovqToXmm(as, dst, RAX);
+			*vm -> stackTop++ = value;
+			return true;
+		}
+		case OP_SET_GLOBAL: {
+			int src = touch(r, depth - 1, true);
+			if (IS_UNDEFINED(vm -> globalValues.values[instr -> as.slot]) || src == -1)
+				return false;
+			emitLoad(as, RCX, VM_REGISTER, offsetof(VM, globalValues) + offsetof(ValueArray, values));
+			emitMovqFromXmm(as, RAX, src);
+			emitStore(as, RCX, 8 * instr -> as.slot, RAX);
+			vm -> globalValues.values[instr -> as.slot] = top[-1];
+			return true;
+		}
+		case OP_ADD:
+		case OP_ADD_NUM:
+		case OP_ADD_STR:
+			return arithmetic(r, ADDSD);
+		case OP_SUBTRACT:
+		case OP_SUBTRACT_NUM:
+			return arithmetic(r, SUBSD);
+		case OP_MULTIPLY:
+		case OP_MULTIPLY_NUM:
+			return arithmetic(r, MULSD);
+		case OP_DIVIDE:
+		case OP_DIVIDE_NUM:
+			return arithmetic(r, DIVSD);
+		case OP_ADD_LOCALS:
+			return addToLocal(r, ADDSD, instr -> arg, instr -> arg2, NIL_VAL);
+		case OP_ADD_LOCAL_CONSTANT:
+			return addToLocal(r, ADDSD, instr -> arg, -1, *instr -> as.constant);
+		case OP_SUBTRACT_LOCAL_CONSTANT:
+			return addToLocal(r, SUBSD, instr -> arg, -1, *instr -> as.constant);
+		case OP_NEGATE: {
+			int dst = touch(r, depth - 1, true);
+			if (!IS_NUMBER(top[-1]) || dst == -1)
+				return false;
+			loadConstant(as, SCRATCH, SIGN_BIT);
+			emitSseRegisters(as, 0x66, XORPD, dst, SCRATCH);
+			top[-1] = NUMBER_VAL(-AS_NUMBER(top[-1]));
+			return true;
+		}
+		case OP_NOT: {
+			int dst = touch(r, depth - 1, true);
+			if (dst == -1)
+				return false;
+			Value value = top[-1];
+			if (IS_BOOL(value)) {
+				emitMovqFromXmm(as, RAX, dst);
+				emitLoadImmediate(as, RCX, 1);
+				emitArith(as, XOR, RAX, RCX);
+				emitMovqToXmm(as, dst, RAX);
+			}
+			else {
+				loadConstant(as, dst, BOOL_VAL(IS_NIL(value)));
+			}
+			top[-1] = BOOL_VAL(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)));
+			return true;
+		}
+		case OP_EQUAL: {
+			int result = equal(r);
+			if (result == -1)
+				return false;
+			storeBool(as, r -> registers[depth - 2]);
+			top[-2] = BOOL_VAL(result);
+			vm -> stackTop--;
+			return true;
+		}
+		case OP_GREATER:
+		case OP_GREATER_NUM:
+		case OP_LESS:
+		case OP_LESS_NUM: {
+			//Clear rax first, since xor would clobber the flags afterwards.
+			emitArith(as, XOR, RAX, RAX);
+			int result = compare(r, instr -> op == OP_GREATER || instr -> op == OP_GREATER_NUM);
+			if (result == -1)
+				return false;
+			emitSetcc(as, CC_A, RAX);
+			storeBool(as, r -> registers[depth - 2]);
+			top[-2] = BOOL_VAL(result);
+			vm -> stackTop--;
+			return true;
+		}
+		case OP_LESS_JUMP:
+		case OP_GREATER_JUMP: {
+			int result = compare(r, instr -> op == OP_GREATER_JUMP);
+			if (result == -1)
+				return false;
+			vm -> stackTop -= 2;
+			branch(r, instr, !result, result ? CC_BE : CC_A, next);
+			return true;
+		}
+		case OP_EQUAL_JUMP: {
+			int result = equal(r);
+			if (result == -1)
+				return false;
+			emitArith(as, TEST, RAX, RAX);
+			vm -> stackTop -= 2;
+			branch(r, instr, !result, result ? CC_E : CC_NE, next);
+			return true;
+		}
+		case OP_JUMP_IF_FALSE: {
+			Value value = top[-1];
+			if (!IS_BOOL(value)) {
+				//Nil and numbers always go the same way.
+				if (IS_NIL(value))
+					*next = instr -> as.target;
+				return true;
+			}
+			int src = touch(r, depth - 1, true);
+			if (src == -1)
+				return false;
+			emitMovqFromXmm(as, RAX, src);
+			emitLoadImmediate(as, RCX, FALSE_VAL);
+			emitArith(as, CMP, RAX, RCX);
+			bool falsey = !AS_BOOL(value);
+			branch(r, instr, falsey, falsey ? CC_NE : CC_E, next);
+			return true;
+		}
+		case OP_JUMP:
+			*next = instr -> as.target;
+			return true;
+		case OP_LOOP:
+		case OP_LOOP_TRACE:
+			for (int i = 0; i < r -> backEdgeCount; i++) {
+				if (r -> backEdges[i] == instr)
+					return false;
+			}
+			if (r -> backEdgeCount == MAX_BACK_EDGES)
+				return false;
+			r -> backEdges[r -> backEdgeCount++] = instr;
+			*next = instr -> op == OP_LOOP ? instr -> as.target : instr -> as.trace -> header;
+			return true;
+		default:
+			return false;
+	}
+}
+
+//Writes back every position below the exit's depth and returns where the
+//interpreter carries on.
+static void emitExit(Recorder* r, SideExit* exit) {
+	Assembler* as = &r -> as;
+	patchJump(as, exit -> jump, as -> count);
+	for (int i = 0; i < r -> registerCount; i++) {
+		if (r -> positions[i] < exit -> depth)
+			emitSse(as, 0xF2, MOVSD_STORE, i, SLOTS, 8 * r -> positions[i]);
+	}
+	emitLea(as, RAX, SLOTS, 8 * exit -> depth);
+	emitStore(as, VM_REGISTER, offsetof(VM, stackTop), RAX);
+	emitLoadImmediate(as, RAX, (uint64_t)(uintptr_t)exit -> resume);
+	emitByte(as, 0xC3);
+}
+
+//Loads the positions the loop carries in and checks their types. If they
+//are not what the trace expects it returns the header, having done nothing.
+static void emitEntry(Recorder* r, int loopStart) {
+	Assembler* as = &r -> as;
+	int failures[TRACE_REGISTERS];
+	int failureCount = 0;
+	for (int i = 0; i < r -> registerCount; i++) {
+		int position = r -> positions[i];
+		if (position >= r -> headerDepth)
+			continue;
+		emitLoad(as, RAX, SLOTS, 8 * position);
+		if (r -> guarded[position])
+			failures[failureCount++] = guardKind(as, r -> entryKinds[position]);
+		emitMovqToXmm(as, i, RAX);
+	}
+	emitJumpTo(as, CC_ALWAYS, loopStart);
+	for (int i = 0; i < failureCount; i++) {
+		patchJump(as, failures[i], as -> count);
+	}
+	emitLoadImmediate(as, RAX, (uint64_t)(uintptr_t)r -> header);
+	emitByte(as, 0xC3);
+}
+
+static Trace* finishTrace(Recorder* r, ObjFunction* function, int loopStart) {
+	Assembler* as = &r -> as;
+	emitJumpTo(as, CC_ALWAYS, loopStart);
+	for (int i = 0; i < r -> exitCount; i++) {
+		emitExit(r, &r -> exits[i]);
+	}
+	int entry = as -> count;
+	emitEntry(r, loopStart);
+	//The code starts with a jump to the entry, at offset 0.
+	patchJump(as, 1, entry);
+
+	Trace* trace = (Trace*)malloc(sizeof(Trace));
+	Instr** exits = (Instr**)malloc(sizeof(Instr*) * (r -> exitCount + 1));
+	if (trace == NULL || exits == NULL) {
+		free(trace);
+		free(exits);
+		freeAssembler(as);
+		return NULL;
+	}
+	trace -> code = finishAssembler(as, &trace -> size);
+	if (trace -> code == NULL) {
+		free(trace);
+		free(exits);
+		return NULL;
+	}
+	int exitCount = 0;
+	exits[exitCount++] = r -> header;
+	for (int i = 0; i < r -> exitCount; i++) {
+		bool seen = false;
+		for (int j = 0; j < exitCount && !seen; j++) {
+			seen = exits[j] == r -> exits[i].resume;
+		}
+		if (!seen)
+			exits[exitCount++] = r -> exits[i].resume;
+	}
+	trace -> header = r -> header;
+	trace -> exits = exits;
+	trace -> exitCount = exitCount;
+	trace -> next = function -> traces;
+	function -> traces = trace;
+	return trace;
+}
+
+//Records the loop that ends at loop, which has just jumped back and has
+//not gone to its header yet. On success the loop instruction points at the
+//new trace, and it is up to the caller to turn it into OP_LOOP_TRACE.
+//Either way resume is where the interpreter goes next: the loop itself once
+//an iteration has been recorded, or the first instruction the recorder
+//could not handle.
+Trace* recordTrace(VM* vm, ObjFunction* function, Value* slots, Instr* loop, Instr** resume) {
+	Recorder r;
+	r.vm = vm;
+	r.slots = slots;
+	r.header = loop -> as.target;
+	r.loop = loop;
+	r.headerDepth = (int)(vm -> stackTop - slots);
+	r.registerCount = 0;
+	r.exitCount = 0;
+	r.backEdgeCount = 0;
+	for (int i = 0; i < MAX_POSITIONS; i++) {
+		r.registers[i] = -1;
+		r.guarded[i] = false;
+	}
+	initAssembler(&r.as);
+	emitJump(&r.as, CC_ALWAYS);
+	int loopStart = r.as.count;
+
+	Instr* instr = r.header;
+	for (int ops = 0; instr != loop; ops++) {
+		Instr* next;
+		//Everything past the back edge is outside the loop.
+		if (ops == MAX_OPS || instr > loop || !recordInstruction(&r, instr, &next)) {
+			freeAssembler(&r.as);
+			vm -> stats.traceAborts++;
+			*resume = instr;
+			return NULL;
+		}
+		instr = next;
+	}
+	*resume = loop;
+
+	//The next iteration has to find what the trace assumed on entry.
+	for (int i = 0; i < r.registerCount; i++) {
+		int position = r.positions[i];
+		if (r.guarded[position] && kindOf(slots[position]) != r.entryKinds[position]) {
+			freeAssembler(&r.as);
+			vm -> stats.traceAborts++;
+			return NULL;
+		}
+	}
+
+	Trace* trace = finishTrace(&r, function, loopStart);
+	if (trace == NULL) {
+		vm -> stats.traceAborts++;
+		return NULL;
+	}
+	loop -> as.trace = trace;
+	vm -> stats.traceCompilations++;
+	return trace;
+}
+
+void freeTraces(ObjFunction* function) {
+	Trace* trace = function -> traces;
+	while (trace != NULL) {
+		Trace* next = trace -> next;
+		freeCode(trace -> code, trace -> size);
+		free(trace -> exits);
+		free(trace);
+		trace = next;
+	}
+	function -> traces = NULL;
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef Von_trace_h
+#define Von_trace_h
+
+#include "common.h"
+
+#ifdef JIT
+
+#include "object.h"
+#include "decode.h"
+
+//How many times a loop jumps back before the interpreter records it.
+#define TRACE_THRESHOLD 50
+
+//How many recordings of the same loop may be abandoned before it is left
+//to the interpreter for good.
+#define TRACE_MAX_ATTEMPTS 4
+
+//Native code for the path one iteration of a loop took when it was
+//recorded. It keeps running iterations until a guard fails, then writes the
+//frame back and returns the instruction to carry on from.
+typedef struct Trace {
+	Instr* header;
+	void* code;
+	size_t size;
+	//Every instruction the code can return.
+	Instr** exits;
+	int exitCount;
+	struct Trace* next;
+} Trace;
+
+typedef Instr* (*TraceFn)(VM* vm, Value* slots);
+
+Trace* recordTrace(VM* vm, ObjFunction* function, Value* slots, Instr* loop, Instr** resume);
+void freeTraces(ObjFunction* function);
+
+#endif
+
+#endif
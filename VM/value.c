@@ -11,60 +11,81 @@ void initValueArray(ValueArray* array) {
 	array -> values = NULL;
 }
 
-void writeValueArray(ValueArray* array, Value values) {
+void writeValueArray(VM* vm, ValueArray* array, Value values) {
 	if (array -> capacity < array -> count + 1) {
 		int oldCapacity = array -> capacity;
 		array -> capacity = GROW_CAPACITY(oldCapacity);
-		array -> values = GROW_ARRAY(Value, array -> values, oldCapacity, array -> capacity);
+		array -> values = GROW_ARRAY(vm, Value, array -> values, oldCapacity, array -> capacity);
 	}
 	array -> values[array -> count] = values;
 	array -> count++;
 }
 
-void freeValueArray(ValueArray* array) {
-	FREE_ARRAY(Value, array -> values, array -> capacity);
+void freeValueArray(VM* vm, ValueArray* array) {
+	FREE_ARRAY(vm, Value, array -> values, array -> capacity);
 	initValueArray(array);
 }
 
-void printValue(Value value) {
+void fprintValue(FILE* out, Value value) {
 	#ifdef NAN_BOXING
 		if (IS_BOOL(value)) {
-			printf(AS_BOOL(value) ? "true" : "false");
+			fprintf(out, AS_BOOL(value) ? "true" : "false");
 		}
 		else if (IS_NIL(value)) {
-			printf("nil");
+			fprintf(out, "nil");
 		}
 		else if (IS_NUMBER(value)) {
-			printf("%g", AS_NUMBER(value));
+			fprintf(out, "%g", AS_NUMBER(value));
+		}
+		else if (IS_INT(value)) {
+			fprintf(out, "%d", AS_INT(value));
 		}
 		else if (IS_OBJ(value)) {
-			printObject(value);
+			fprintObject(out, value);
+		}
+		else if (IS_SHORT_STRING(value)) {
+			char chars[SHORT_STRING_MAX];
+			fwrite(chars, 1, shortStringChars(value, chars), out);
 		}
 	#else
 	switch (value.type) {
 		case VAL_BOOL:
-			printf(AS_BOOL(value) ? "true" : "false");
+			fprintf(out, AS_BOOL(value) ? "true" : "false");
 			break;
 		case VAL_NIL:
-			printf("nil");
+			fprintf(out, "nil");
 			break;
 		case VAL_NUMBER:
-			printf("%g", AS_NUMBER(value));
+			fprintf(out, "%g", AS_NUMBER(value));
+			break;
+		case VAL_INT:
+			fprintf(out, "%d", AS_INT(value));
+			break;
 		case VAL_OBJ:
-			printObject(value);
+			fprintObject(out, value);
 			break;
 	}
 	#endif
 }
 
+void printValue(Value value) {
+	fprintValue(stdout, value);
+}
+
 bool valuesEqual(Value a, Value b) {
 	#ifdef NAN_BOXING
 		if (IS_NUMBER(a) && IS_NUMBER(b)) {
 			return AS_NUMBER(a) == AS_NUMBER(b);
 		}	
-		return a == b;
+		if (a == b)
+			return true;
+		if (IS_NUMERIC(a) && IS_NUMERIC(b))
+			return numericValue(a) == numericValue(b);
+		return textsEqual(a, b);
 	#else
 
+	if (IS_NUMERIC(a) && IS_NUMERIC(b))
+		return numericValue(a) == numericValue(b);
 	if (a.type != b.type)
 		return false;
 	switch (a.type) {
@@ -75,7 +96,9 @@ bool valuesEqual(Value a, Value b) {
 		case VAL_NUMBER:
 			return AS_NUMBER(a) == AS_NUMBER(b);
 		case VAL_OBJ:
-			return AS_OBJ(a) == AS_OBJ(b);
+			if (AS_OBJ(a) == AS_OBJ(b))
+				return true;
+			return textsEqual(a, b);
 		default:
 			return false;
 	}
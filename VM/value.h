@@ -1,6 +1,7 @@
 #ifndef Von_value_h
 #define Von_value_h
 
+#include <stdio.h>
 #include <string.h>
 #include "common.h"
 
@@ -13,6 +14,7 @@ typedef struct ObjString ObjString;
 #define TAG_NIL		1
 #define TAG_FALSE	2
 #define TAG_TRUE 	3
+#define TAG_UNDEFINED	4
 
 typedef uint64_t Value;
 
@@ -21,6 +23,11 @@ typedef uint64_t Value;
 #define TRUE_VAL		((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL			((Value)(uint64_t)(QNAN | TAG_NIL))
 
+//Marks a global slot that has been named but not yet defined. It never
+//reaches the stack.
+#define UNDEFINED_VAL		((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define IS_UNDEFINED(value)	((value) == UNDEFINED_VAL)
+
 #define BOOL_VAL(b)		((b) ? TRUE_VAL : FALSE_VAL)
 #define AS_BOOL(value)		((value) == TRUE_VAL)
 #define IS_BOOL(value)		(((value) | 1) == TRUE_VAL)
@@ -35,6 +42,9 @@ typedef uint64_t Value;
 	(((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define IS_NUMBER(value)	(((value) & QNAN) != QNAN)
+//Both tests in one branch.
+#define IS_NUMBERS(a, b) \
+	((((a) & QNAN) != QNAN) & (((b) & QNAN) != QNAN))
 #define AS_NUMBER(value)	valueToNum(value)
 #define NUMBER_VAL(num)		numToValue(num)
 
@@ -50,13 +60,65 @@ static inline Value numToValue(double num) {
 	return value;
 }
 
+//Strings of up to SHORT_STRING_MAX bytes, none of them zero, are kept in
+//the value itself: a byte per eight bits from the bottom, padded with
+//zeros, under a tag no singleton uses.
+#define TAG_SHORT_STRING	((uint64_t)1 << 49)
+#define SHORT_STRING_MAX	6
+
+#define IS_SHORT_STRING(value) \
+	(((value) & (SIGN_BIT | QNAN | TAG_SHORT_STRING)) == (QNAN | TAG_SHORT_STRING))
+
+static inline Value shortStringVal(const char* chars, int length) {
+	Value value = QNAN | TAG_SHORT_STRING;
+	for (int i = 0; i < length; i++) {
+		value |= (uint64_t)(uint8_t)chars[i] << (8 * i);
+	}
+	return value;
+}
+
+//No character is zero, so the length is how many of the low bytes are in
+//use, which comparisons find without a loop.
+static inline int shortStringLength(Value value) {
+	uint64_t chars = value & 0x0000ffffffffffff;
+	return (chars != 0) + (chars > 0xff) + (chars > 0xffff) + (chars > 0xffffff) +
+		(chars > 0xffffffffu) + (chars > 0xffffffffffu);
+}
+
+//Writes the characters, without a terminator, and returns how many.
+static inline int shortStringChars(Value value, char* chars) {
+	int length = shortStringLength(value);
+	for (int i = 0; i < length; i++) {
+		chars[i] = (char)(value >> (8 * i));
+	}
+	return length;
+}
+
+//b after a, for two short strings that fit in one together.
+static inline Value appendShortString(Value a, int aLength, Value b) {
+	return a | ((b & 0x0000ffffffffffff) << (8 * aLength));
+}
+
+//A 32-bit integer in the low half, under a tag of its own. Literals are
+//still doubles: ints come out of the integer operators, so x | 0 makes
+//one, and stay ints through + - * % while the results fit.
+#define TAG_INT		((uint64_t)1 << 48)
+
+#define IS_INT(value) \
+	(((value) & (SIGN_BIT | QNAN | TAG_SHORT_STRING | TAG_INT)) == (QNAN | TAG_INT))
+#define IS_INTS(a, b)		(IS_INT(a) & IS_INT(b))
+#define AS_INT(value)		((int32_t)(uint32_t)(value))
+#define INT_VAL(i)		((Value)(QNAN | TAG_INT | (uint32_t)(int32_t)(i)))
+
 #else
 
 typedef enum {
 	VAL_BOOL,
 	VAL_NIL,
 	VAL_NUMBER,
+	VAL_INT,
 	VAL_OBJ,
+	VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -64,6 +126,7 @@ typedef struct {
 	union {
 		bool boolean;
 		double number;
+		int32_t integer;
 		Obj* obj;
 	} as;
 } Value;
@@ -72,18 +135,51 @@ typedef struct {
 #define IS_NUL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
+#define IS_NUMBERS(a, b)  (IS_NUMBER(a) && IS_NUMBER(b))
+#define IS_INT(value)     ((value).type == VAL_INT)
+#define IS_INTS(a, b)     (IS_INT(a) && IS_INT(b))
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value)	  ((value).as.boolean)
 #define AS_NUMBER(value)  ((value).as.number)
+#define AS_INT(value)     ((value).as.integer)
 #define AS_OBJ(value)	  ((value).as.obj)
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL		  ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)    ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object)	  ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL	  ((Value){VAL_UNDEFINED, {.number = 0}})
+
+//There is no room to keep a string in the value itself, so none are short.
+#define SHORT_STRING_MAX	0
+#define IS_SHORT_STRING(value)	false
+
+static inline Value shortStringVal(const char* chars, int length) {
+	return NIL_VAL;
+}
+
+static inline int shortStringLength(Value value) {
+	return 0;
+}
+
+static inline int shortStringChars(Value value, char* chars) {
+	return 0;
+}
+
+static inline Value appendShortString(Value a, int aLength, Value b) {
+	return NIL_VAL;
+}
 
 #endif
 
+//Either kind of number, as a double.
+#define IS_NUMERIC(value)	(IS_NUMBER(value) || IS_INT(value))
+
+static inline double numericValue(Value value) {
+	return IS_INT(value) ? (double)AS_INT(value) : AS_NUMBER(value);
+}
 
 typedef struct {
 	int capacity;
@@ -93,8 +189,9 @@ typedef struct {
 
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
-void writeValueArray(ValueArray* array, Value values);
-void freeValueArray(ValueArray* array);
+void writeValueArray(VM* vm, ValueArray* array, Value values);
+void freeValueArray(VM* vm, ValueArray* array);
 void printValue(Value value);
+void fprintValue(FILE* out, Value value);
 
 #endif
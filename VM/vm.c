@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
 
 #include "object.h"
@@ -9,180 +11,447 @@
 #include "debug.h"
 #include "../compiler/compiler.h"
 #include "vm.h"
+#include "jit.h"
+#include "trace.h"
 
-VM vm;
+//Frames printed at each end of a runtime error's stack trace.
+#define TRACE_FRAMES 10
 
-static Value clockNative(int argCount, Value* args) {
+static Value clockNative(VM* vm, int argCount, Value* args) {
 	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static void resetStack() {
-	vm.stackTop = vm.stack;
-	vm.frameCount = 0;
-	vm.openUpvalues = 0;
+//Register code reads slots above stackTop, so no slot may ever hold
+//anything but a value.
+static void clearStack(Value* stack, int from, int to) {
+	for (int i = from; i < to; i++)
+		stack[i] = NIL_VAL;
 }
 
-static void runtimeError (const char* format, ...) {
+static void resetStack(VM* vm) {
+	vm -> stackTop = vm -> stack;
+	vm -> frameCount = 0;
+	vm -> openUpvalues = 0;
+}
+
+static void runtimeError(VM* vm, const char* format, ...) {
 	va_list args;
 	va_start(args, format);
-	vfprintf(stderr, format, args);
+	vfprintf(vm -> err, format, args);
 	va_end(args);
-	fputs("\n", stderr);
+	fputs("\n", vm -> err);
 
-	for (int i = vm.frameCount - 1; i >= 0; i--) {
-		CallFrame* frame = &vm.frames[i];
+	//A deep recursion only shows the frames at either end of the trace.
+	for (int i = vm -> frameCount - 1; i >= 0; i--) {
+		if (i == vm -> frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+			fprintf(vm -> err, "... %d more frames\n", i - TRACE_FRAMES + 1);
+			i = TRACE_FRAMES - 1;
+		}
+		CallFrame* frame = &vm -> frames[i];
 		ObjFunction* function = frame -> closure -> function;
-		size_t instruction = frame -> ip - function -> chunk.code - 1;
-		fprintf(stderr, "[line &d] in ", function -> chunk.lines[instruction]);
+		size_t instruction = frame -> ip - function -> code - 1;
+		fprintf(vm -> err, "[line %d] in ", function -> chunk.lines[function -> codeOffsets[instruction]]);
 		if (function -> name == NULL) {
-			fprintf(stderr, "script\n");
+			fprintf(vm -> err, "script\n");
 		}
 		else {
-			fprintf(stderr, "%s()\n", function -> name -> chars);
+			fprintf(vm -> err, "%s()\n", function -> name -> chars);
 		}
 	}
-	resetStack();
+	resetStack(vm);
 }
 
-static void defineNative(const char* name, NativeFn function) {
-	push(OBJ_VAL(copyString(name, (int)strlen(name))));
-	push(OBJ_VAL(newNative(function)));
-	tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-	pop();
-	pop();
+//Globals live in a dense array. The compiler turns every global name into
+//a slot here, so the same name gets the same slot across every script and
+//REPL line run by this VM. A slot stays UNDEFINED_VAL until its
+//declaration has run.
+int globalSlot(VM* vm, ObjString* name) {
+	Value slot;
+	if (tableGet(&vm -> globalSlots, name, &slot))
+		return (int)AS_NUMBER(slot);
+	push(vm, OBJ_VAL(name));
+	int index = vm -> globalValues.count;
+	writeValueArray(vm, &vm -> globalValues, UNDEFINED_VAL);
+	tableSet(vm, &vm -> globalSlots, name, NUMBER_VAL(index));
+	pop(vm);
+	return index;
 }
 
-void initVM() {
-	resetStack();
-	vm.objects = NULL;
-	vm.bytesAllocated = 0;
-	vm.nextGC = 1024 * 1024;
-	vm.grayCount = 0;
-	vm.grayCapacity = 0;
-	vm.grayStack = NULL;
-	initTable(&vm.globals);
-	initTable(&vm.strings);
-	vm.initString = NULL;
-	vm.initString = copyString("init", 4);
-	defineNative("clock", clockNative);
+//Only needed for error messages, so a linear search is fine.
+ObjString* globalName(VM* vm, int slot) {
+	return tableFindKey(&vm -> globalSlots, NUMBER_VAL(slot));
 }
 
-void freeVM() {
-	freeTable(&vm.globals);	
-	freeTable(&vm.strings);
-	vm.initString = NULL;
-	freeObjects();
+static void defineNative(VM* vm, const char* name, NativeFn function) {
+	push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+	push(vm, OBJ_VAL(newNative(vm, function)));
+	int slot = globalSlot(vm, AS_STRING(vm -> stack[0]));
+	vm -> globalValues.values[slot] = vm -> stack[1];
+	pop(vm);
+	pop(vm);
 }
 
-void push(Value value) {
-	*vm.stackTop = value;
-	vm.stackTop++;
+void initVM(VM* vm) {
+	vm -> stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+	vm -> stackCapacity = STACK_INITIAL;
+	vm -> frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+	vm -> frameCapacity = FRAMES_INITIAL;
+	vm -> maxFrames = FRAMES_DEFAULT_MAX;
+	if (vm -> stack == NULL || vm -> frames == NULL)
+		exit(1);
+	clearStack(vm -> stack, 0, STACK_INITIAL);
+	resetStack(vm);
+	vm -> objects = NULL;
+	vm -> parser = NULL;
+	vm -> out = stdout;
+	vm -> err = stderr;
+	vm -> bytesAllocated = 0;
+	vm -> nextGC = 1024 * 1024;
+	vm -> grayCount = 0;
+	vm -> grayCapacity = 0;
+	vm -> grayStack = NULL;
+	vm -> stats.cacheHits = 0;
+	vm -> stats.cacheMisses = 0;
+	vm -> stats.megamorphicLookups = 0;
+	vm -> stats.quickenings = 0;
+	vm -> stats.deoptimizations = 0;
+	vm -> stats.jitCompilations = 0;
+	vm -> stats.traceCompilations = 0;
+	vm -> stats.traceAborts = 0;
+	vm -> jitEnabled = true;
+	vm -> jitDepth = 0;
+	vm -> registerMode = false;
+	initTable(&vm -> globalSlots);
+	initValueArray(&vm -> globalValues);
+	initTable(&vm -> strings);
+	vm -> initString = NULL;
+	vm -> initString = copyString(vm, "init", 4);
+	defineNative(vm, "clock", clockNative);
+#ifdef DEBUG_PROFILE_OPCODES
+	initOpcodeProfile(&vm -> profile);
+#endif
 }
 
-Value pop() {
-	vm.stackTop--;
-	return *vm.stackTop;
+void freeVM(VM* vm) {
+#ifdef DEBUG_PROFILE_OPCODES
+	printOpcodeProfile(&vm -> profile);
+	freeOpcodeProfile(&vm -> profile);
+#endif
+	freeTable(vm, &vm -> globalSlots);
+	freeValueArray(vm, &vm -> globalValues);
+	freeTable(vm, &vm -> strings);
+	vm -> initString = NULL;
+	freeObjects(vm);
+	free(vm -> stack);
+	free(vm -> frames);
+	vm -> stack = NULL;
+	vm -> frames = NULL;
 }
 
-static Value peek(int distance) {
-	return vm.stackTop[-1 - distance];
+void printStats(VM* vm) {
+	fprintf(vm -> err, "inline caches: %llu hits, %llu misses, %llu megamorphic lookups\n",
+			(unsigned long long)vm -> stats.cacheHits,
+			(unsigned long long)vm -> stats.cacheMisses,
+			(unsigned long long)vm -> stats.megamorphicLookups);
+	fprintf(vm -> err, "quickening: %llu rewrites, %llu deoptimizations\n",
+			(unsigned long long)vm -> stats.quickenings,
+			(unsigned long long)vm -> stats.deoptimizations);
+#ifdef JIT
+	fprintf(vm -> err, "jit: %llu functions compiled\n",
+			(unsigned long long)vm -> stats.jitCompilations);
+	fprintf(vm -> err, "traces: %llu compiled, %llu abandoned\n",
+			(unsigned long long)vm -> stats.traceCompilations,
+			(unsigned long long)vm -> stats.traceAborts);
+#endif
 }
 
-static bool call(ObjClosure* closure, int argCount) {
+void push(VM* vm, Value value) {
+	*vm -> stackTop = value;
+	vm -> stackTop++;
+}
+
+Value pop(VM* vm) {
+	vm -> stackTop--;
+	return *vm -> stackTop;
+}
+
+static Value peek(VM* vm, int distance) {
+	return vm -> stackTop[-1 - distance];
+}
+
+//Makes room for count more values above stackTop. Growing may move the
+//stack, so frame slots and open upvalues, which point into it, are rebased
+//and anything run() cached from the frame must be reloaded.
+static void ensureStack(VM* vm, int count) {
+	int used = (int)(vm -> stackTop - vm -> stack);
+	if (used + count <= vm -> stackCapacity)
+		return;
+	int capacity = vm -> stackCapacity;
+	while (capacity < used + count) {
+		capacity *= 2;
+	}
+	Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+	if (stack == NULL)
+		exit(1);
+	memcpy(stack, vm -> stack, sizeof(Value) * used);
+	clearStack(stack, used, capacity);
+	for (int i = 0; i < vm -> frameCount; i++) {
+		vm -> frames[i].slots = stack + (vm -> frames[i].slots - vm -> stack);
+	}
+	for (ObjUpvalue* upvalue = vm -> openUpvalues; upvalue != NULL; upvalue = upvalue -> next) {
+		upvalue -> location = stack + (upvalue -> location - vm -> stack);
+	}
+	free(vm -> stack);
+	vm -> stack = stack;
+	vm -> stackCapacity = capacity;
+	vm -> stackTop = stack + used;
+}
+
+static bool call(VM* vm, ObjClosure* closure, int argCount) {
 	if (argCount != closure -> function -> arity) {
-		runtimeError("Expected %d arguments but got %d.", closure -> function -> arity, argCount);
+		runtimeError(vm, "Expected %d arguments but got %d.", closure -> function -> arity, argCount);
 		return false;
 	}
-	if (vm.frameCount == FRAMES_MAX) {
-		runtimeError("Stack overflow");
+	if (vm -> frameCount == vm -> maxFrames) {
+		runtimeError(vm, "Stack overflow");
 		return false;
 	}
+	if (vm -> frameCount == vm -> frameCapacity) {
+		vm -> frameCapacity *= 2;
+		vm -> frames = (CallFrame*)realloc(vm -> frames, sizeof(CallFrame) * vm -> frameCapacity);
+		if (vm -> frames == NULL)
+			exit(1);
+	}
+	//The callee and its arguments are already on the stack.
+	ensureStack(vm, closure -> function -> maxSlots - argCount - 1 + STACK_SLACK);
 
-
-	CallFrame* frame = &vm.frames[vm.frameCount++];
+	CallFrame* frame = &vm -> frames[vm -> frameCount++];
 	frame -> closure = closure;
-	frame -> ip = closure -> function -> chunk.code;
-	frame -> slots = vm.stackTop - argCount - 1;
+	//Left NULL until run() decodes the function on its first call.
+	frame -> ip = closure -> function -> code;
+	frame -> slots = vm -> stackTop - argCount - 1;
 	return true;
 }
 
-static bool callValue(Value callee, int argCount) {
+static bool callValue(VM* vm, Value callee, int argCount) {
 	if (IS_OBJ(callee)) {
 		switch(OBJ_TYPE(callee)) {
 			case OBJ_NATIVE: {
 				NativeFn native = AS_NATIVE(callee);
-				Value result = native(argCount, vm.stackTop - argCount);
-				vm.stackTop -= argCount + 1;
-				push(result);
+				Value result = native(vm, argCount, vm -> stackTop - argCount);
+				vm -> stackTop -= argCount + 1;
+				push(vm, result);
 				return true;
 			}
 			case OBJ_CLOSURE: 
-				return call(AS_CLOSURE(callee), argCount);
+				return call(vm, AS_CLOSURE(callee), argCount);
 			case OBJ_CLASS: {
 				ObjClass* klass = AS_CLASS(callee);
-				vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+				vm -> stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
 				Value initializer;
-				if (tableGet(&klass -> methods, vm.initString, &initializer)) {
-					return call(AS_CLOSURE(initializer), argCount);
+				if (tableGet(&klass -> methods, vm -> initString, &initializer)) {
+					return call(vm, AS_CLOSURE(initializer), argCount);
 				}
 				else if (argCount != 0) {
-					runtimeError("Expected 0 arguments but got %d.", argCount);
+					runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
 					return false;
 				}
 				return true;
 			}
 			case OBJ_BOUND_METHOD: {
 				ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-				vm.stackTop[-argCount - 1] = bound -> receiver;
-				return call(bound -> method, argCount);
+				vm -> stackTop[-argCount - 1] = bound -> receiver;
+				return call(vm, bound -> method, argCount);
 			}
 			default:
 				break;
 		}
 	}
-	runtimeError("Can only call functions and classes.");
+	runtimeError(vm, "Can only call functions and classes.");
 	return false;
 }
 
-static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
-	Value method;
-	if (!tableGet(&klass -> methods, name, &method)) {
-		runtimeError("Undefined property '%s'.", name -> chars);
+//Adds what a lookup resolved to, replacing a stale entry for the same
+//receiver if there is one. Super calls cache on the class alone and leave
+//shape NULL. Every entry records the class so marking it keeps the class,
+//and with it the shapes the entry points at, alive.
+static void addCacheEntry(InlineCache* cache, CacheKind kind, ObjClass* klass, Shape* shape, Shape* transition, int index, Value method) {
+	if (cache -> megamorphic)
+		return;
+	CacheEntry* entry = NULL;
+	for (int i = 0; i < cache -> count; i++) {
+		CacheEntry* candidate = &cache -> entries[i];
+		if (candidate -> kind == kind && candidate -> shape == shape && (kind != CACHE_METHOD || candidate -> klass == klass)) {
+			entry = candidate;
+			break;
+		}
+	}
+	if (entry == NULL) {
+		if (cache -> count == CACHE_ENTRIES) {
+			cache -> megamorphic = true;
+			return;
+		}
+		entry = &cache -> entries[cache -> count++];
+	}
+	entry -> kind = kind;
+	entry -> klass = klass;
+	entry -> shape = shape;
+	entry -> transition = transition;
+	entry -> index = index;
+	entry -> method = method;
+}
+
+static bool lookupMethod(VM* vm, InlineCache* cache, ObjClass* klass, Value* method) {
+	if (!cache -> megamorphic) {
+		for (int i = 0; i < cache -> count; i++) {
+			CacheEntry* entry = &cache -> entries[i];
+			if (entry -> klass == klass && entry -> kind == CACHE_METHOD) {
+				vm -> stats.cacheHits++;
+				*method = entry -> method;
+				return true;
+			}
+		}
+		vm -> stats.cacheMisses++;
+	}
+	else {
+		vm -> stats.megamorphicLookups++;
+	}
+	if (!tableGet(&klass -> methods, cache -> name, method)) {
+		runtimeError(vm, "Undefined property '%s'.", cache -> name -> chars);
 		return false;
 	}
-	return call(AS_CLOSURE(method), argCount);
+	addCacheEntry(cache, CACHE_METHOD, klass, NULL, NULL, -1, *method);
+	return true;
 }
 
-static bool invoke(ObjString* name, int argCount) {
-	Value receiver = peek(argCount);
+//Resolves a property of an instance through the call site's cache. The
+//shape says which fields an instance has, so a field entry needs only the
+//shape to match and a method entry, which also needs the class, is known
+//not to be shadowed by a field. Class method tables never change after
+//the class body has run, which is what makes caching the method safe.
+//Instances in dictionary mode always take the slow path.
+static bool lookupProperty(VM* vm, InlineCache* cache, ObjInstance* instance, Value* value, bool* isField) {
+	Shape* shape = instance -> shape;
+	ObjString* name = cache -> name;
+	if (!cache -> megamorphic) {
+		for (int i = 0; i < cache -> count; i++) {
+			CacheEntry* entry = &cache -> entries[i];
+			if (entry -> shape != shape || shape == NULL)
+				continue;
+			if (entry -> kind == CACHE_FIELD) {
+				vm -> stats.cacheHits++;
+				*value = instance -> fields[entry -> index];
+				*isField = true;
+				return true;
+			}
+			if (entry -> kind == CACHE_METHOD && entry -> klass == instance -> klass) {
+				vm -> stats.cacheHits++;
+				*value = entry -> method;
+				*isField = false;
+				return true;
+			}
+		}
+		vm -> stats.cacheMisses++;
+	}
+	else {
+		vm -> stats.megamorphicLookups++;
+	}
+
+	if (getField(instance, name, value)) {
+		if (shape != NULL)
+			addCacheEntry(cache, CACHE_FIELD, instance -> klass, shape, NULL, shapeLookup(shape, name), NIL_VAL);
+		*isField = true;
+		return true;
+	}
+	*isField = false;
+	if (!tableGet(&instance -> klass -> methods, name, value)) {
+		runtimeError(vm, "Undefined property '%s'.", name -> chars);
+		return false;
+	}
+	if (shape != NULL)
+		addCacheEntry(cache, CACHE_METHOD, instance -> klass, shape, NULL, -1, *value);
+	return true;
+}
+
+//Stores to an existing field, or adds a new one by following a cached
+//shape transition. A transition entry is only taken while the instance
+//still has room for the new slot; growing the storage goes through
+//setField.
+static void setProperty(VM* vm, InlineCache* cache, ObjInstance* instance, Value value) {
+	Shape* shape = instance -> shape;
+	if (!cache -> megamorphic) {
+		for (int i = 0; i < cache -> count; i++) {
+			CacheEntry* entry = &cache -> entries[i];
+			if (entry -> shape != shape || shape == NULL)
+				continue;
+			if (entry -> kind == CACHE_FIELD) {
+				vm -> stats.cacheHits++;
+				instance -> fields[entry -> index] = value;
+				return;
+			}
+			if (entry -> kind == CACHE_ADD_FIELD && entry -> index < instance -> capacity) {
+				vm -> stats.cacheHits++;
+				instance -> fields[entry -> index] = value;
+				instance -> shape = entry -> transition;
+				return;
+			}
+		}
+		vm -> stats.cacheMisses++;
+	}
+	else {
+		vm -> stats.megamorphicLookups++;
+	}
+
+	setField(vm, instance, cache -> name, value);
+	Shape* next = instance -> shape;
+	if (shape == NULL || next == NULL)
+		return;
+	if (next == shape)
+		addCacheEntry(cache, CACHE_FIELD, instance -> klass, shape, NULL, shapeLookup(shape, cache -> name), NIL_VAL);
+	else
+		addCacheEntry(cache, CACHE_ADD_FIELD, instance -> klass, shape, next, next -> slotCount - 1, NIL_VAL);
+}
+
+static bool invoke(VM* vm, InlineCache* cache, int argCount) {
+	Value receiver = peek(vm, argCount);
 	if (!IS_INSTANCE(receiver)) {
-		runtimeError("Only instances have methods.");
+		runtimeError(vm, "Only instances have methods.");
 		return false;
 	}
 	ObjInstance* instance = AS_INSTANCE(receiver);
 	Value value;
-	if (tableGet(&instance -> fields, name, &value)) {
-		vm.stackTop[-argCount - 1] = value;
-		return callValue(value, argCount);
+	bool isField;
+	if (!lookupProperty(vm, cache, instance, &value, &isField))
+		return false;
+	if (isField) {
+		vm -> stackTop[-argCount - 1] = value;
+		return callValue(vm, value, argCount);
 	}
-	return invokeFromClass(instance -> klass, name, argCount);
+	return call(vm, AS_CLOSURE(value), argCount);
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name) {
+static bool invokeSuper(VM* vm, InlineCache* cache, ObjClass* superclass, int argCount) {
+	Value method;
+	if (!lookupMethod(vm, cache, superclass, &method))
+		return false;
+	return call(vm, AS_CLOSURE(method), argCount);
+}
+
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name) {
 	Value method;
 	if (!tableGet(&klass -> methods, name, &method)) {
-		runtimeError("Undefined property '%s'.", name -> chars);
+		runtimeError(vm, "Undefined property '%s'.", name -> chars);
 		return false;
 	}
-	ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
-	pop();
-	push(OBJ_VAL(bound));
+	ObjBoundMethod* bound = newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
+	pop(vm);
+	push(vm, OBJ_VAL(bound));
 	return true;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
 	ObjUpvalue* prevUpvalue = NULL;
-	ObjUpvalue* upvalue = vm.openUpvalues;
+	ObjUpvalue* upvalue = vm -> openUpvalues;
 	while (upvalue != NULL && upvalue -> location > local) {
 		prevUpvalue = upvalue;
 		upvalue = upvalue -> next;
@@ -190,11 +459,11 @@ static ObjUpvalue* captureUpvalue(Value* local) {
 	if (upvalue != NULL && upvalue -> location == local) {
 		return upvalue;
 	}
-	ObjUpvalue* createdUpvalue = newUpvalue(local);
+	ObjUpvalue* createdUpvalue = newUpvalue(vm, local);
 	createdUpvalue -> next = upvalue;
 	
 	if (prevUpvalue == NULL) {
-		vm.openUpvalues = createdUpvalue;
+		vm -> openUpvalues = createdUpvalue;
 	}
 	else {
 		prevUpvalue -> next = createdUpvalue;
@@ -202,343 +471,1577 @@ static ObjUpvalue* captureUpvalue(Value* local) {
 	return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last) {
-	while (vm.openUpvalues != NULL && vm.openUpvalues -> location >= last) {
-		ObjUpvalue* upvalue = vm.openUpvalues;
+static void closeUpvalues(VM* vm, Value* last) {
+	while (vm -> openUpvalues != NULL && vm -> openUpvalues -> location >= last) {
+		ObjUpvalue* upvalue = vm -> openUpvalues;
 		upvalue -> closed = *upvalue -> location;
 		upvalue -> location = &upvalue -> closed;
-		vm.openUpvalues = upvalue -> next;
+		vm -> openUpvalues = upvalue -> next;
 	}
 }
 
-static void defineMethod(ObjString* name) {
-	Value method = peek(0);
-	ObjClass* klass = AS_CLASS(peek(1));
-	tableSet(&klass -> methods, name, method);
-	pop();
+static void defineMethod(VM* vm, ObjString* name) {
+	Value method = peek(vm, 0);
+	ObjClass* klass = AS_CLASS(peek(vm, 1));
+	tableSet(vm, &klass -> methods, name, method);
+	pop(vm);
+}
+
+static bool inherit(VM* vm) {
+	Value superclass = peek(vm, 1);
+	if (!IS_CLASS(superclass)) {
+		runtimeError(vm, "Superclass must be a class.");
+		return false;
+	}
+	ObjClass* subclass = AS_CLASS(peek(vm, 0));
+	tableAddAll(vm, &AS_CLASS(superclass) -> methods, &subclass -> methods);
+	pop(vm);
+	return true;
 }
 
 static bool isFalsey(Value value) {
 	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-	ObjString* b = AS_STRING(peek(0));
-	ObjString* a = AS_STRING(peek(1));
+//Results that fit in a value stay in one, and the rest up to this long
+//are new strings. Longer ones are slices of a buffer that later
+//concatenations onto them append to.
+#define SLICE_MIN_LENGTH 64
+
+static void concatenate(VM* vm) {
+	Value b = peek(vm, 0);
+	Value a = peek(vm, 1);
+	int aLength = textLength(a);
+	int length = aLength + textLength(b);
+
+	Value result;
+	if (IS_SLICE(a) && AS_SLICE(a) -> length == AS_SLICE(a) -> buffer -> count) {
+		//Nothing has been appended past a yet, so b can go on the end. Copy
+		//b after growing, in case it is a slice of the same buffer.
+		ObjBuffer* buffer = AS_SLICE(a) -> buffer;
+		reserveBuffer(vm, buffer, length);
+		copyText(b, buffer -> chars + aLength);
+		buffer -> count = length;
+		result = OBJ_VAL(newSlice(vm, buffer, length));
+	}
+	else if (length <= SHORT_STRING_MAX && IS_SHORT_STRING(a) && IS_SHORT_STRING(b)) {
+		result = appendShortString(a, aLength, b);
+	}
+	else if (length < SLICE_MIN_LENGTH) {
+		ObjString* string = reserveString(vm, length);
+		copyText(a, string -> chars);
+		copyText(b, string -> chars + aLength);
+		result = OBJ_VAL(finishString(vm, string));
+	}
+	else {
+		ObjBuffer* buffer = newBuffer(vm, length * 2);
+		copyText(a, buffer -> chars);
+		copyText(b, buffer -> chars + aLength);
+		buffer -> count = length;
+		push(vm, OBJ_VAL(buffer));
+		result = OBJ_VAL(newSlice(vm, buffer, length));
+		pop(vm);
+	}
+	pop(vm);
+	pop(vm);
+	push(vm, result);
+}
+
+//The integer part of a number wrapped into 32 bits, the way the integer
+//operators read their operands.
+static int32_t toInt32(Value value) {
+	if (IS_INT(value))
+		return AS_INT(value);
+	double number = AS_NUMBER(value);
+	if (!isfinite(number))
+		return 0;
+	return (int32_t)(uint32_t)(int64_t)fmod(trunc(number), 4294967296.0);
+}
+
+//Whether a number is an int, or a double that holds one exactly. -0 is
+//not one, since an int would lose its sign.
+static bool asInt(Value value, int32_t* result) {
+	if (IS_INT(value)) {
+		*result = AS_INT(value);
+		return true;
+	}
+	double number = AS_NUMBER(value);
+	if (number >= INT32_MIN && number <= INT32_MAX && number == (int32_t)number && !signbit(number)) {
+		*result = (int32_t)number;
+		return true;
+	}
+	return false;
+}
+
+//+ - * and the comparisons on two ints, when the result is an int or a
+//bool. A product of zero with a negative factor is -0, which is left to
+//doubles. run() inlines this ahead of arithmetic().
+static inline bool intArithmetic(uint8_t op, int32_t a, int32_t b, Value* result) {
+	int64_t value;
+	switch (op) {
+		case OP_ADD:
+			value = (int64_t)a + b;
+			break;
+		case OP_SUBTRACT:
+			value = (int64_t)a - b;
+			break;
+		case OP_MULTIPLY:
+			value = (int64_t)a * b;
+			if (value == 0 && (a < 0 || b < 0))
+				return false;
+			break;
+		case OP_GREATER:
+			*result = BOOL_VAL(a > b);
+			return true;
+		case OP_LESS:
+			*result = BOOL_VAL(a < b);
+			return true;
+		default:
+			return false;
+	}
+	if (value != (int32_t)value)
+		return false;
+	*result = INT_VAL((int32_t)value);
+	return true;
+}
 
-	int length = a -> length + b -> length;
-	char* chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a -> chars, a -> length);
-	memcpy(chars, b -> chars, b -> length);
-	chars[length] = '\0';
+//Every operator on numbers past the two-double fast paths run() inlines:
+//ints, ints mixed with doubles, and the integer operators. An int with
+//another int, or with a double holding one, stays an int under + - * %
+//while the result fits. The rest is done as doubles, so / always gives
+//one. OP_NEGATE only looks at a. Reports an error and returns false when
+//an operand is not a number.
+static bool arithmetic(VM* vm, uint8_t op, Value a, Value b, Value* result) {
+	if (op == OP_NEGATE) {
+		//-0 and -INT32_MIN are doubles.
+		if (IS_INT(a) && AS_INT(a) != INT32_MIN && AS_INT(a) != 0)
+			*result = INT_VAL(-AS_INT(a));
+		else if (IS_NUMERIC(a))
+			*result = NUMBER_VAL(-numericValue(a));
+		else {
+			runtimeError(vm, "Operand must be a number.");
+			return false;
+		}
+		return true;
+	}
+	if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) {
+		runtimeError(vm, op == OP_ADD ? "Operands must be two numbers or two strings." :
+			"Operands must be numbers.");
+		return false;
+	}
+	switch (op) {
+		case OP_BIT_AND:
+			*result = INT_VAL(toInt32(a) & toInt32(b));
+			return true;
+		case OP_BIT_OR:
+			*result = INT_VAL(toInt32(a) | toInt32(b));
+			return true;
+		case OP_BIT_XOR:
+			*result = INT_VAL(toInt32(a) ^ toInt32(b));
+			return true;
+		case OP_SHIFT_LEFT:
+			*result = INT_VAL((int32_t)((uint32_t)toInt32(a) << (toInt32(b) & 31)));
+			return true;
+		case OP_SHIFT_RIGHT:
+			*result = INT_VAL(toInt32(a) >> (toInt32(b) & 31));
+			return true;
+	}
+	int32_t x;
+	int32_t y;
+	if ((IS_INT(a) || IS_INT(b)) && asInt(a, &x) && asInt(b, &y)) {
+		if (intArithmetic(op, x, y, result))
+			return true;
+		//A zero divisor falls through to fmod() for NaN, and so does a zero
+		//remainder of a negative x, which is -0.
+		if (op == OP_MODULO && y != 0) {
+			int32_t remainder = y == -1 ? 0 : x % y;
+			if (remainder != 0 || x >= 0) {
+				*result = INT_VAL(remainder);
+				return true;
+			}
+		}
+	}
+	double p = numericValue(a);
+	double q = numericValue(b);
+	switch (op) {
+		case OP_ADD:
+			*result = NUMBER_VAL(p + q);
+			break;
+		case OP_SUBTRACT:
+			*result = NUMBER_VAL(p - q);
+			break;
+		case OP_MULTIPLY:
+			*result = NUMBER_VAL(p * q);
+			break;
+		case OP_DIVIDE:
+			*result = NUMBER_VAL(p / q);
+			break;
+		case OP_MODULO:
+			*result = NUMBER_VAL(fmod(p, q));
+			break;
+		case OP_GREATER:
+			*result = BOOL_VAL(p > q);
+			break;
+		case OP_LESS:
+			*result = BOOL_VAL(p < q);
+			break;
+	}
+	return true;
+}
 
-	ObjString* result = takeString(chars, length);
-	pop();
-	pop();
-	push(OBJ_VAL(result));
+//The slow path of a register add. The operands are pushed above top,
+//which is past every register the frame uses, so they all stay safe from
+//the collector.
+static bool addValues(VM* vm, Value* top, Value a, Value b, Value* result) {
+	if (!IS_TEXT(a) || !IS_TEXT(b))
+		return arithmetic(vm, OP_ADD, a, b, result);
+	vm -> stackTop = top;
+	push(vm, a);
+	push(vm, b);
+	concatenate(vm);
+	*result = pop(vm);
+	return true;
 }
 
-static InterpretResult run() {
-	CallFrame* frame = &vm.frames[vm.frameCount - 1];
-	#define READ_BYTE() (*frame -> ip++)
+//Reuses the current frame for a call in return position. The callee and
+//its arguments slide down over the caller's slots once anything that
+//captured those slots has been closed.
+static bool tailCall(VM* vm, ObjClosure* closure, int argCount) {
+	if (argCount != closure -> function -> arity) {
+		runtimeError(vm, "Expected %d arguments but got %d.", closure -> function -> arity, argCount);
+		return false;
+	}
+	CallFrame* frame = &vm -> frames[vm -> frameCount - 1];
+	closeUpvalues(vm, frame -> slots);
+	memmove(frame -> slots, vm -> stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+	vm -> stackTop = frame -> slots + argCount + 1;
+	ensureStack(vm, closure -> function -> maxSlots - argCount - 1 + STACK_SLACK);
+	frame = &vm -> frames[vm -> frameCount - 1];
+	frame -> closure = closure;
+	frame -> ip = closure -> function -> code;
+	return true;
+}
+
+//Replaces the instance on top of the stack with the value of a property,
+//binding it first if it is a method.
+static bool getProperty(VM* vm, InlineCache* cache) {
+	if (!IS_INSTANCE(peek(vm, 0))) {
+		runtimeError(vm, "Only instances have properties.");
+		return false;
+	}
+	ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
+	Value value;
+	bool isField;
+	if (!lookupProperty(vm, cache, instance, &value, &isField))
+		return false;
+	if (!isField) {
+		value = OBJ_VAL(newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(value)));
+	}
+	pop(vm);
+	push(vm, value);
+	return true;
+}
+
+static bool storeProperty(VM* vm, InlineCache* cache) {
+	if (!IS_INSTANCE(peek(vm, 1))) {
+		runtimeError(vm, "Only instances have fields.");
+		return false;
+	}
+	ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
+	setProperty(vm, cache, instance, peek(vm, 0));
+	Value value = pop(vm);
+	pop(vm);
+	push(vm, value);
+	return true;
+}
+
+static void makeClosure(VM* vm, CallFrame* frame, const uint8_t* upvalues) {
+	ObjFunction* function = AS_FUNCTION(frame -> closure -> function -> chunk.constants.values[upvalues[-1]]);
+	if (function -> sharesClosure) {
+		if (function -> closure == NULL)
+			function -> closure = (Obj*)newClosure(vm, function);
+		push(vm, OBJ_VAL(function -> closure));
+		return;
+	}
+	ObjClosure* closure = newClosure(vm, function);
+	push(vm, OBJ_VAL(closure));
+
+	for (int i = 0; i < closure -> upvalueCount; i++) {
+		uint8_t isLocal = *upvalues++;
+		uint8_t index = *upvalues++;
+		if (isLocal && function -> flatUpvalues[i]) {
+			closure -> upvalues[i].flat = frame -> slots[index];
+		}
+		else if (isLocal) {
+			closure -> upvalues[i].boxed = captureUpvalue(vm, frame -> slots + index);
+		}
+		else {
+			closure -> upvalues[i] = frame -> closure -> upvalues[index];
+		}
+	}
+}
+
+//The generic instruction a quickened one stands in for.
+static uint8_t genericOpcode(uint8_t op) {
+	switch (op) {
+		case OP_ADD_NUM:
+		case OP_ADD_STR:
+			return OP_ADD;
+		case OP_SUBTRACT_NUM:
+			return OP_SUBTRACT;
+		case OP_MULTIPLY_NUM:
+			return OP_MULTIPLY;
+		case OP_DIVIDE_NUM:
+			return OP_DIVIDE;
+		case OP_LESS_NUM:
+			return OP_LESS;
+		case OP_GREATER_NUM:
+			return OP_GREATER;
+		default:
+			return op;
+	}
+}
+
+//How many times an instruction may fall back from a quickened form before
+//it is left generic for good.
+#define MAX_DEOPTIMIZATIONS 4
+
+static InterpretResult run(VM* vm);
+
+//Counts an entry into a decoded function and returns its native code once
+//it has some. Code from a --emit-c build also waits for the function to be
+//decoded, since it uses the decoded instructions' operands.
+static JitFn hotCode(VM* vm, ObjFunction* function) {
+	if (function -> code == NULL)
+		return NULL;
+	if (function -> aotCode != NULL)
+		return (JitFn)function -> aotCode;
+#ifdef JIT
+	if (function -> jitCode != NULL)
+		return (JitFn)function -> jitCode;
+	if (!vm -> jitEnabled || vm -> registerMode || function -> hotness == 0)
+		return NULL;
+	if (--function -> hotness == 0 && jitCompile(function))
+		vm -> stats.jitCompilations++;
+	return (JitFn)function -> jitCode;
+#else
+	return NULL;
+#endif
+}
+
+//Runs the frame on top until it returns: in native code while the
+//functions it ends up in (through tail calls) are compiled, and in a
+//nested run() otherwise.
+static bool runFrame(VM* vm) {
+	int frameIndex = vm -> frameCount - 1;
+	for (;;) {
+		ObjFunction* function = vm -> frames[frameIndex].closure -> function;
+		JitFn code = vm -> jitDepth < JIT_MAX_DEPTH ? hotCode(vm, function) : NULL;
+		if (code == NULL)
+			return run(vm) == INTERPRET_OK;
+		vm -> jitDepth++;
+		JitStatus status = code(vm, frameIndex);
+		vm -> jitDepth--;
+		if (status != JIT_TAIL_CALL)
+			return status == JIT_OK;
+	}
+}
+
+//Natives, and classes without an initializer, are done by the time
+//callValue() returns and leave no frame behind.
+static bool finishCall(VM* vm, int frameCount) {
+	return vm -> frameCount == frameCount || runFrame(vm);
+}
+
+bool jitArithmetic(VM* vm, uint8_t op) {
+	if (op == OP_NEGATE)
+		return arithmetic(vm, op, peek(vm, 0), NIL_VAL, vm -> stackTop - 1);
+	if (op == OP_ADD && IS_TEXT(peek(vm, 0)) && IS_TEXT(peek(vm, 1))) {
+		concatenate(vm);
+		return true;
+	}
+	if (!arithmetic(vm, op, peek(vm, 1), peek(vm, 0), vm -> stackTop - 2))
+		return false;
+	vm -> stackTop--;
+	return true;
+}
+
+uint8_t jitCompare(VM* vm, bool greater) {
+	Value result;
+	if (!arithmetic(vm, greater ? OP_GREATER : OP_LESS, peek(vm, 1), peek(vm, 0), &result))
+		return 2;
+	return AS_BOOL(result);
+}
+
+void jitError(VM* vm, const char* message) {
+	runtimeError(vm, "%s", message);
+}
+
+void jitUndefinedGlobal(VM* vm, int slot) {
+	runtimeError(vm, "Undefined variable '%s'.", globalName(vm, slot) -> chars);
+}
+
+bool jitCall(VM* vm, int argCount) {
+	Value callee = peek(vm, argCount);
+	if (IS_CLOSURE(callee))
+		return call(vm, AS_CLOSURE(callee), argCount) && runFrame(vm);
+	int frameCount = vm -> frameCount;
+	if (!callValue(vm, callee, argCount))
+		return false;
+	return finishCall(vm, frameCount);
+}
+
+JitStatus jitTailCall(VM* vm, int argCount) {
+	Value callee = peek(vm, argCount);
+	if (IS_BOUND_METHOD(callee)) {
+		vm -> stackTop[-argCount - 1] = AS_BOUND_METHOD(callee) -> receiver;
+		callee = OBJ_VAL(AS_BOUND_METHOD(callee) -> method);
+	}
+	if (!IS_CLOSURE(callee))
+		return jitCall(vm, argCount) ? JIT_OK : JIT_ERROR;
+	return tailCall(vm, AS_CLOSURE(callee), argCount) ? JIT_TAIL_CALL : JIT_ERROR;
+}
+
+bool jitInvoke(VM* vm, InlineCache* cache, int argCount) {
+	int frameCount = vm -> frameCount;
+	if (!invoke(vm, cache, argCount))
+		return false;
+	return finishCall(vm, frameCount);
+}
+
+bool jitGetProperty(VM* vm, InlineCache* cache) {
+	return getProperty(vm, cache);
+}
+
+bool jitSetProperty(VM* vm, InlineCache* cache) {
+	return storeProperty(vm, cache);
+}
+
+void jitClosure(VM* vm, const uint8_t* upvalues) {
+	makeClosure(vm, &vm -> frames[vm -> frameCount - 1], upvalues);
+}
+
+void jitCloseUpvalues(VM* vm, Value* last) {
+	closeUpvalues(vm, last);
+}
+
+void jitPrint(VM* vm, Value value) {
+	fprintValue(vm -> out, value);
+	fputc('\n', vm -> out);
+}
+
+void jitClass(VM* vm, ObjString* name) {
+	push(vm, OBJ_VAL(newClass(vm, name)));
+}
+
+bool jitInherit(VM* vm) {
+	return inherit(vm);
+}
+
+void jitMethod(VM* vm, ObjString* name) {
+	defineMethod(vm, name);
+}
+
+bool jitGetSuper(VM* vm, ObjString* name) {
+	ObjClass* superclass = AS_CLASS(pop(vm));
+	return bindMethod(vm, superclass, name);
+}
+
+bool jitSuperInvoke(VM* vm, InlineCache* cache, int argCount) {
+	ObjClass* superclass = AS_CLASS(pop(vm));
+	int frameCount = vm -> frameCount;
+	if (!invokeSuper(vm, cache, superclass, argCount))
+		return false;
+	return finishCall(vm, frameCount);
+}
+
+static InterpretResult run(VM* vm) {
+	#ifdef COMPUTED_GOTO
+	//One indirect jump per handler instead of a single shared one, so the
+	//branch predictor can learn which opcode tends to follow which.
+	static void* dispatchTable[] = {
+		[OP_ADD] = &&L_OP_ADD,
+		[OP_SUBTRACT] = &&L_OP_SUBTRACT,
+		[OP_MULTIPLY] = &&L_OP_MULTIPLY,
+		[OP_DIVIDE] = &&L_OP_DIVIDE,
+		[OP_MODULO] = &&L_OP_MODULO,
+		[OP_BIT_AND] = &&L_OP_BIT_AND,
+		[OP_BIT_OR] = &&L_OP_BIT_OR,
+		[OP_BIT_XOR] = &&L_OP_BIT_XOR,
+		[OP_SHIFT_LEFT] = &&L_OP_SHIFT_LEFT,
+		[OP_SHIFT_RIGHT] = &&L_OP_SHIFT_RIGHT,
+		[OP_NEGATE] = &&L_OP_NEGATE,
+		[OP_CONSTANT] = &&L_OP_CONSTANT,
+		[OP_RETURN] = &&L_OP_RETURN,
+		[OP_NIL] = &&L_OP_NIL,
+		[OP_TRUE] = &&L_OP_TRUE,
+		[OP_FALSE] = &&L_OP_FALSE,
+		[OP_NOT] = &&L_OP_NOT,
+		[OP_EQUAL] = &&L_OP_EQUAL,
+		[OP_GREATER] = &&L_OP_GREATER,
+		[OP_LESS] = &&L_OP_LESS,
+		[OP_PRINT] = &&L_OP_PRINT,
+		[OP_POP] = &&L_OP_POP,
+		[OP_DEFINE_GLOBAL] = &&L_OP_DEFINE_GLOBAL,
+		[OP_GET_GLOBAL] = &&L_OP_GET_GLOBAL,
+		[OP_SET_GLOBAL] = &&L_OP_SET_GLOBAL,
+		[OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
+		[OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
+		[OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+		[OP_JUMP] = &&L_OP_JUMP,
+		[OP_LOOP] = &&L_OP_LOOP,
+		[OP_CALL] = &&L_OP_CALL,
+		[OP_TAIL_CALL] = &&L_OP_TAIL_CALL,
+		[OP_INVOKE] = &&L_OP_INVOKE,
+		[OP_SUPER_INVOKE] = &&L_OP_SUPER_INVOKE,
+		[OP_CLOSURE] = &&L_OP_CLOSURE,
+		[OP_GET_UPVALUE] = &&L_OP_GET_UPVALUE,
+		[OP_SET_UPVALUE] = &&L_OP_SET_UPVALUE,
+		[OP_CLOSE_UPVALUE] = &&L_OP_CLOSE_UPVALUE,
+		[OP_CLASS] = &&L_OP_CLASS,
+		[OP_INHERIT] = &&L_OP_INHERIT,
+		[OP_GET_PROPERTY] = &&L_OP_GET_PROPERTY,
+		[OP_SET_PROPERTY] = &&L_OP_SET_PROPERTY,
+		[OP_GET_SUPER] = &&L_OP_GET_SUPER,
+		[OP_METHOD] = &&L_OP_METHOD,
+		[OP_ADD_LOCALS] = &&L_OP_ADD_LOCALS,
+		[OP_ADD_LOCAL_CONSTANT] = &&L_OP_ADD_LOCAL_CONSTANT,
+		[OP_SUBTRACT_LOCAL_CONSTANT] = &&L_OP_SUBTRACT_LOCAL_CONSTANT,
+		[OP_SET_LOCAL_POP] = &&L_OP_SET_LOCAL_POP,
+		[OP_POPN] = &&L_OP_POPN,
+		[OP_LESS_JUMP] = &&L_OP_LESS_JUMP,
+		[OP_GREATER_JUMP] = &&L_OP_GREATER_JUMP,
+		[OP_EQUAL_JUMP] = &&L_OP_EQUAL_JUMP,
+		[OP_GET_LOCAL_PROPERTY] = &&L_OP_GET_LOCAL_PROPERTY,
+		[OP_ADD_NUM] = &&L_OP_ADD_NUM,
+		[OP_ADD_STR] = &&L_OP_ADD_STR,
+		[OP_SUBTRACT_NUM] = &&L_OP_SUBTRACT_NUM,
+		[OP_MULTIPLY_NUM] = &&L_OP_MULTIPLY_NUM,
+		[OP_DIVIDE_NUM] = &&L_OP_DIVIDE_NUM,
+		[OP_LESS_NUM] = &&L_OP_LESS_NUM,
+		[OP_GREATER_NUM] = &&L_OP_GREATER_NUM,
+#ifdef JIT
+		[OP_LOOP_TRACE] = &&L_OP_LOOP_TRACE,
+#endif
+		[OP_GET_FLAT_UPVALUE] = &&L_OP_GET_FLAT_UPVALUE,
+		[OP_MOVE] = &&L_OP_MOVE,
+		[OP_LOAD_CONSTANT] = &&L_OP_LOAD_CONSTANT,
+		[OP_LOAD_NIL] = &&L_OP_LOAD_NIL,
+		[OP_LOAD_BOOL] = &&L_OP_LOAD_BOOL,
+		[OP_GET_GLOBAL_R] = &&L_OP_GET_GLOBAL_R,
+		[OP_SET_GLOBAL_R] = &&L_OP_SET_GLOBAL_R,
+		[OP_DEFINE_GLOBAL_R] = &&L_OP_DEFINE_GLOBAL_R,
+		[OP_GET_UPVALUE_R] = &&L_OP_GET_UPVALUE_R,
+		[OP_SET_UPVALUE_R] = &&L_OP_SET_UPVALUE_R,
+		[OP_GET_FLAT_UPVALUE_R] = &&L_OP_GET_FLAT_UPVALUE_R,
+		[OP_ADD_R] = &&L_OP_ADD_R,
+		[OP_SUBTRACT_R] = &&L_OP_SUBTRACT_R,
+		[OP_MULTIPLY_R] = &&L_OP_MULTIPLY_R,
+		[OP_DIVIDE_R] = &&L_OP_DIVIDE_R,
+		[OP_MODULO_R] = &&L_OP_MODULO_R,
+		[OP_BIT_AND_R] = &&L_OP_BIT_AND_R,
+		[OP_BIT_OR_R] = &&L_OP_BIT_OR_R,
+		[OP_BIT_XOR_R] = &&L_OP_BIT_XOR_R,
+		[OP_SHIFT_LEFT_R] = &&L_OP_SHIFT_LEFT_R,
+		[OP_SHIFT_RIGHT_R] = &&L_OP_SHIFT_RIGHT_R,
+		[OP_GREATER_R] = &&L_OP_GREATER_R,
+		[OP_LESS_R] = &&L_OP_LESS_R,
+		[OP_EQUAL_R] = &&L_OP_EQUAL_R,
+		[OP_ADD_RK] = &&L_OP_ADD_RK,
+		[OP_SUBTRACT_RK] = &&L_OP_SUBTRACT_RK,
+		[OP_NEGATE_R] = &&L_OP_NEGATE_R,
+		[OP_NOT_R] = &&L_OP_NOT_R,
+		[OP_PRINT_R] = &&L_OP_PRINT_R,
+		[OP_TEST_JUMP] = &&L_OP_TEST_JUMP,
+		[OP_LESS_JUMP_R] = &&L_OP_LESS_JUMP_R,
+		[OP_GREATER_JUMP_R] = &&L_OP_GREATER_JUMP_R,
+		[OP_EQUAL_JUMP_R] = &&L_OP_EQUAL_JUMP_R,
+		[OP_CALL_R] = &&L_OP_CALL_R,
+		[OP_TAIL_CALL_R] = &&L_OP_TAIL_CALL_R,
+		[OP_INVOKE_R] = &&L_OP_INVOKE_R,
+		[OP_SUPER_INVOKE_R] = &&L_OP_SUPER_INVOKE_R,
+		[OP_CLOSURE_R] = &&L_OP_CLOSURE_R,
+		[OP_CLOSE_UPVALUE_R] = &&L_OP_CLOSE_UPVALUE_R,
+		[OP_CLASS_R] = &&L_OP_CLASS_R,
+		[OP_INHERIT_R] = &&L_OP_INHERIT_R,
+		[OP_GET_PROPERTY_R] = &&L_OP_GET_PROPERTY_R,
+		[OP_SET_PROPERTY_R] = &&L_OP_SET_PROPERTY_R,
+		[OP_GET_SUPER_R] = &&L_OP_GET_SUPER_R,
+		[OP_METHOD_R] = &&L_OP_METHOD_R,
+		[OP_RETURN_R] = &&L_OP_RETURN_R,
+	};
+	void* const* handlers = dispatchTable;
+	#else
+	void* const* handlers = NULL;
+	#endif
+
+	//Frames below this one belong to whoever called run(). Compiled code
+	//calls back in here for functions it cannot run itself.
+	int baseFrame = vm -> frameCount - 1;
+	CallFrame* frame;
+	//The hot frame state lives in locals so the compiler can keep it in
+	//registers. It is written back to the frame before anything that can
+	//report an error or push a new frame.
+	Instr* ip;
+	Value* slots;
+	//So does the top of the stack: tos holds the top value and sp the slot
+	//it belongs in, whose memory is stale. Most instructions then touch
+	//memory for their second operand at most. Register code keeps every
+	//value in memory and leaves the two alone.
+	Value* sp;
+	Value tos;
+
+	#define READ_BYTE() (ip[-1].arg)
+
+	#define READ_SECOND_BYTE() (ip[-1].arg2)
+
+	#define READ_THIRD_BYTE() (ip[-1].arg3)
 	
-	#define READ_CONSTANT() \
-		(frame -> closure -> function -> chunk.constants.values[READ_BYTE()])
+	#define READ_CONSTANT() (*ip[-1].as.constant)
 
-	#define READ_SHORT() \
-		(frame -> ip += 2, \
-		 (uint16_t)((frame -> ip[-2] << 8) | frame -> ip[-1]))
+	#define READ_TARGET() (ip[-1].as.target)
 	
-	#define READ_STRING() AS_STRING(READ_CONSTANT())
+	#define READ_STRING() (ip[-1].as.name)
+
+	#define READ_CACHE() (ip[-1].as.cache)
+
+	#define READ_SLOT() (ip[-1].as.slot)
+
+	#define STORE_FRAME() (frame -> ip = ip)
+
+	//Writes the cached top back before anything that works on the stack
+	//through vm -> stackTop, which includes calls, natives, compiled code
+	//and every allocation, since the collector marks the stack.
+	#define SPILL() \
+	do { \
+		*sp = tos; \
+		vm -> stackTop = sp + 1; \
+	} while (false)
+
+	#define RELOAD() \
+	do { \
+		sp = vm -> stackTop - 1; \
+		tos = *sp; \
+	} while (false)
+
+	//Every frame has at least its callee slot, so the stack under a frame
+	//is never empty and there is always a top to cache.
+	#define PUSH(value) \
+	do { \
+		Value pushed = (value); \
+		*sp++ = tos; \
+		tos = pushed; \
+	} while (false)
+
+	#define DROP() (tos = *--sp)
+
+	//The newest local may be the cached top.
+	#define LOCAL(slot) (slots + (slot) == sp ? tos : slots[slot])
+
+	#define LOAD_FRAME() \
+	do { \
+		frame = &vm -> frames[vm -> frameCount - 1]; \
+		ip = frame -> ip; \
+		slots = frame -> slots; \
+	} while (false)
+
+	//Like LOAD_FRAME() but for a frame call() just pushed, whose function
+	//may not have been decoded yet.
+	#define DECODE_FRAME() \
+	do { \
+		LOAD_FRAME(); \
+		if (ip == NULL) { \
+			ip = frame -> ip = decodeFunction(vm, frame -> closure -> function, handlers); \
+		} \
+	} while (false)
+
+	//A frame entered at the top of a hot function, or one with code from a
+	//--emit-c build, is handed to runFrame() and has returned by the time it
+	//is back.
+	#define ENTER_FRAME() \
+	do { \
+		DECODE_FRAME(); \
+		if (ip == frame -> closure -> function -> code && vm -> jitDepth < JIT_MAX_DEPTH && \
+				hotCode(vm, frame -> closure -> function) != NULL) { \
+			if (!runFrame(vm)) \
+				return INTERPRET_RUNTIME_ERROR; \
+			if (vm -> frameCount == baseFrame) \
+				return INTERPRET_OK; \
+			LOAD_FRAME(); \
+		} \
+		RELOAD(); \
+	} while (false)
+
+	#define RUNTIME_ERROR(...) \
+	do { \
+		STORE_FRAME(); \
+		runtimeError(vm, __VA_ARGS__); \
+		return INTERPRET_RUNTIME_ERROR; \
+	} while (false)
 	
-	#define BINARY_OP(valueType, op) \
+	#ifdef COMPUTED_GOTO
+	#define SET_OP(instr, opcode) \
+	do { \
+		(instr) -> op = (opcode); \
+		(instr) -> handler = handlers[opcode]; \
+	} while (false)
+	#else
+	#define SET_OP(instr, opcode) ((instr) -> op = (opcode))
+	#endif
+
+	//Arithmetic and comparison instructions rewrite themselves into a
+	//form specialized for the operand types they just saw. The unused arg
+	//byte counts how often the instruction had to fall back.
+	#define QUICKEN(opcode) \
+	do { \
+		if (ip[-1].arg < MAX_DEOPTIMIZATIONS) { \
+			SET_OP(&ip[-1], opcode); \
+			vm -> stats.quickenings++; \
+		} \
+	} while (false)
+
+
+	//Anything but two doubles goes through arithmetic(), once the common
+	//cases on two ints have been tried inline.
+	#define SLOW_BINARY_OP(opcode) \
 	do {\
-		if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-			runtimeError("Operands must be numbers."); \
-			return INTERPRET_RUNTIME_ERROR;\
+		Value result;\
+		if (!IS_INTS(sp[-1], tos) || !intArithmetic(opcode, AS_INT(sp[-1]), AS_INT(tos), &result)) { \
+			STORE_FRAME();\
+			if (!arithmetic(vm, opcode, sp[-1], tos, &result)) \
+				return INTERPRET_RUNTIME_ERROR;\
 		}\
-		double b = pop();\
-		double a = pop();\
-		push(valueType(a op b));\
+		sp--;\
+		tos = result;\
 	} while(false)
-	for (;;) {
+
+	#define BINARY_OP(opcode, valueType, op) \
+	do {\
+		if (!IS_NUMBERS(tos, sp[-1])) { \
+			SLOW_BINARY_OP(opcode); \
+			break; \
+		}\
+		double b = AS_NUMBER(tos);\
+		double a = AS_NUMBER(*--sp);\
+		tos = valueType(a op b);\
+	} while(false)
+
+	//The integer operators, inline for two ints.
+	#define INT_BINARY_OP(opcode, result) \
+	do {\
+		if (!IS_INTS(tos, sp[-1])) { \
+			SLOW_BINARY_OP(opcode); \
+			break; \
+		}\
+		int32_t b = AS_INT(tos);\
+		int32_t a = AS_INT(*--sp);\
+		tos = INT_VAL(result);\
+	} while(false)
+
+	#define QUICKENED_BINARY_OP(valueType, op) \
+	do {\
+		Value b = tos;\
+		Value a = sp[-1];\
+		if (!IS_NUMBERS(a, b)) \
+			goto deoptimize;\
+		sp--;\
+		tos = valueType(AS_NUMBER(a) op AS_NUMBER(b));\
+	} while(false)
+
+	#define COMPARE_JUMP(opcode, op) \
+	do {\
+		bool holds;\
+		if (IS_NUMBERS(tos, sp[-1])) \
+			holds = AS_NUMBER(sp[-1]) op AS_NUMBER(tos);\
+		else { \
+			Value result;\
+			STORE_FRAME();\
+			if (!arithmetic(vm, opcode, sp[-1], tos, &result)) \
+				return INTERPRET_RUNTIME_ERROR;\
+			holds = AS_BOOL(result);\
+		}\
+		sp -= 2;\
+		tos = *sp;\
+		if (!holds) \
+			ip = READ_TARGET();\
+	} while(false)
+
+	#define REGISTER_BINARY_OP(opcode, valueType, op) \
+	do {\
+		Value a = slots[READ_SECOND_BYTE()];\
+		Value b = slots[READ_THIRD_BYTE()];\
+		if (!IS_NUMBERS(a, b)) { \
+			if (IS_INTS(a, b) && intArithmetic(opcode, AS_INT(a), AS_INT(b), &slots[READ_BYTE()])) \
+				break; \
+			STORE_FRAME(); \
+			if (!arithmetic(vm, opcode, a, b, &slots[READ_BYTE()])) \
+				return INTERPRET_RUNTIME_ERROR; \
+			break; \
+		}\
+		slots[READ_BYTE()] = valueType(AS_NUMBER(a) op AS_NUMBER(b));\
+	} while(false)
+
+	#define REGISTER_INT_BINARY_OP(opcode, result) \
+	do {\
+		Value x = slots[READ_SECOND_BYTE()];\
+		Value y = slots[READ_THIRD_BYTE()];\
+		if (!IS_INTS(x, y)) { \
+			STORE_FRAME(); \
+			if (!arithmetic(vm, opcode, x, y, &slots[READ_BYTE()])) \
+				return INTERPRET_RUNTIME_ERROR; \
+			break; \
+		}\
+		int32_t a = AS_INT(x);\
+		int32_t b = AS_INT(y);\
+		slots[READ_BYTE()] = INT_VAL(result);\
+	} while(false)
+
+	//Sets up the stack a bridged register instruction hands to the stack
+	//instruction of the same name.
+	#define BRIDGE() \
+	do { \
+		vm -> stackTop = slots + READ_THIRD_BYTE(); \
+		RELOAD(); \
+	} while (false)
+
+	#define REGISTER_COMPARE_JUMP(opcode, op) \
+	do {\
+		Value a = slots[READ_SECOND_BYTE()];\
+		Value b = slots[READ_THIRD_BYTE()];\
+		bool holds;\
+		if (IS_NUMBERS(a, b)) \
+			holds = AS_NUMBER(a) op AS_NUMBER(b);\
+		else { \
+			Value result;\
+			STORE_FRAME();\
+			if (!arithmetic(vm, opcode, a, b, &result)) \
+				return INTERPRET_RUNTIME_ERROR;\
+			holds = AS_BOOL(result);\
+		}\
+		if (!holds) \
+			ip = READ_TARGET();\
+	} while(false)
+
 	#ifdef DEBUG_TRACE_EXECUTION
-		printf("	");
-		for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-			printf("[ ");
-			printValue(*slot);
-			printf(" ]");
-		}
-		printf("\n");
-		disassembleInstruction(&frame -> closure -> function -> chunk, (int)(frame -> ip - frame -> closure -> function -> chunk.code));
+	#define TRACE_INSTRUCTION() \
+	do { \
+		ObjFunction* function = frame -> closure -> function; \
+		printf("	"); \
+		for (Value* slot = vm -> stack; slot < sp; slot++) { \
+			printf("[ "); \
+			printValue(*slot); \
+			printf(" ]"); \
+		} \
+		printf("[ "); \
+		printValue(tos); \
+		printf(" ]"); \
+		printf("\n"); \
+		disassembleInstruction(vm, &function -> chunk, function -> codeOffsets[ip - function -> code]); \
+	} while (false)
+	#else
+	#define TRACE_INSTRUCTION() do {} while (false)
 	#endif
-		uint8_t instruction;
-		switch (instruction = READ_BYTE()) {
-			case OP_CONSTANT: {
-				Value constant = READ_CONSTANT();
-				push(constant);
-				break;
-			}
-			case OP_NEGATE:
-					if (!IS_NUMBER(peek(0))) {
-						runtimeError("Operand must be a number.");
-						return INTERPRET_RUNTIME_ERROR;
-					}
-					push(NUMBER_VAL(-AS_NUMBER(pop())));
-					break;
-			case OP_ADD: {
-					if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-						concatenate();
-					}
-					else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-						double b = AS_NUMBER(pop());
-						double a = AS_NUMBER(pop());
-						push(NUMBER_VAL(a + b));
-					}
-					else {
-						runtimeError("Operands must be two numbers or two strings.");
-						return INTERPRET_RUNTIME_ERROR;
-					}
-					break;
-			}
-			case OP_SUBTRACT:
-					BINARY_OP(NUMBER_VAL, -);
-					break;
-			case OP_MULTIPLY:
-					BINARY_OP(NUMBER_VAL, *);
-					break;
-			case OP_DIVIDE:
-					BINARY_OP(NUMBER_VAL, /);
-					break;
-			case OP_NIL:
-					push(NIL_VAL);
-					break;
-			case OP_TRUE:
-					push(BOOL_VAL(true));
-					break;
-			case OP_FALSE:
-					push(BOOL_VAL(false));
-					break;
-			case OP_NOT:
-					push(BOOL_VAL(isFalsey(pop())));
-					break;
-			case OP_EQUAL: {
-					Value b = pop();
-					Value a = pop();
-					push(BOOL_VAL(valuesEqual(a, b)));
-					break;	
-			}
-			case OP_GREATER:
-				       BINARY_OP(BOOL_VAL, >);
-				       break;
-			case OP_LESS:
-				       BINARY_OP(BOOL_VAL, <);
-				       break;
-			case OP_PRINT: {
-					printValue(pop());
-					printf("\n");
-					break;		
-		       }
-			case OP_POP:
-				       pop();
-				       break;
-			case OP_DEFINE_GLOBAL: {
-					ObjString* name = READ_STRING();
-					tableSet(&vm.globals, name, peek(0));
-					pop();
-					break;
-			}
-			case OP_GET_GLOBAL: {
-					ObjString* name = READ_STRING();
-					Value value;
-					if (!tableGet(&vm.globals, name, &value)) {
-						runtimeError("Undefined variable %s", name -> chars);
+
+	#ifdef DEBUG_PROFILE_OPCODES
+	#define PROFILE_INSTRUCTION() recordOpcode(&vm -> profile, ip -> op)
+	#else
+	#define PROFILE_INSTRUCTION() do {} while (false)
+	#endif
+
+	//The function may have native code that was only waiting for it to be
+	//decoded.
+	ENTER_FRAME();
+
+	#ifdef COMPUTED_GOTO
+	#define CASE(op) L_##op
+	#define DISPATCH() \
+	do { \
+		TRACE_INSTRUCTION(); \
+		PROFILE_INSTRUCTION(); \
+		goto *(ip++) -> handler; \
+	} while (false)
+
+	DISPATCH();
+	#else
+	#define CASE(op) case op
+	#define DISPATCH() continue
+
+	for (;;) {
+		TRACE_INSTRUCTION();
+		PROFILE_INSTRUCTION();
+		switch ((ip++) -> op) {
+	#endif
+			CASE(OP_CONSTANT):
+				PUSH(READ_CONSTANT());
+				DISPATCH();
+			CASE(OP_NEGATE):
+				if (!IS_NUMBER(tos)) {
+					STORE_FRAME();
+					if (!arithmetic(vm, OP_NEGATE, tos, NIL_VAL, &tos))
 						return INTERPRET_RUNTIME_ERROR;
+					DISPATCH();
+				}
+				tos = NUMBER_VAL(-AS_NUMBER(tos));
+				DISPATCH();
+			CASE(OP_ADD):
+				if (IS_NUMBERS(tos, sp[-1]))
+					QUICKEN(OP_ADD_NUM);
+				else if (IS_TEXT(tos) && IS_TEXT(sp[-1]))
+					QUICKEN(OP_ADD_STR);
+			add: {
+				Value b = tos;
+				Value a = sp[-1];
+				if (IS_TEXT(a) && IS_TEXT(b)) {
+					SPILL();
+					concatenate(vm);
+					RELOAD();
+				}
+				else if (IS_NUMBERS(a, b)) {
+					sp--;
+					tos = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+				}
+				else {
+					SLOW_BINARY_OP(OP_ADD);
+				}
+				DISPATCH();
+			}
+			CASE(OP_SUBTRACT):
+				if (IS_NUMBERS(tos, sp[-1]))
+					QUICKEN(OP_SUBTRACT_NUM);
+				BINARY_OP(OP_SUBTRACT, NUMBER_VAL, -);
+				DISPATCH();
+			CASE(OP_MULTIPLY):
+				if (IS_NUMBERS(tos, sp[-1]))
+					QUICKEN(OP_MULTIPLY_NUM);
+				BINARY_OP(OP_MULTIPLY, NUMBER_VAL, *);
+				DISPATCH();
+			CASE(OP_DIVIDE):
+				if (IS_NUMBERS(tos, sp[-1]))
+					QUICKEN(OP_DIVIDE_NUM);
+				BINARY_OP(OP_DIVIDE, NUMBER_VAL, /);
+				DISPATCH();
+			CASE(OP_MODULO):
+				//Only a positive divisor and a dividend that is not negative are
+				//sure to give an int inline.
+				if (IS_INTS(tos, sp[-1]) && AS_INT(tos) > 0 && AS_INT(sp[-1]) >= 0) {
+					int32_t b = AS_INT(tos);
+					tos = INT_VAL(AS_INT(*--sp) % b);
+					DISPATCH();
+				}
+				SLOW_BINARY_OP(OP_MODULO);
+				DISPATCH();
+			CASE(OP_BIT_AND):
+				INT_BINARY_OP(OP_BIT_AND, a & b);
+				DISPATCH();
+			CASE(OP_BIT_OR):
+				INT_BINARY_OP(OP_BIT_OR, a | b);
+				DISPATCH();
+			CASE(OP_BIT_XOR):
+				INT_BINARY_OP(OP_BIT_XOR, a ^ b);
+				DISPATCH();
+			CASE(OP_SHIFT_LEFT):
+				INT_BINARY_OP(OP_SHIFT_LEFT, (int32_t)((uint32_t)a << (b & 31)));
+				DISPATCH();
+			CASE(OP_SHIFT_RIGHT):
+				INT_BINARY_OP(OP_SHIFT_RIGHT, a >> (b & 31));
+				DISPATCH();
+			CASE(OP_NIL):
+				PUSH(NIL_VAL);
+				DISPATCH();
+			CASE(OP_TRUE):
+				PUSH(BOOL_VAL(true));
+				DISPATCH();
+			CASE(OP_FALSE):
+				PUSH(BOOL_VAL(false));
+				DISPATCH();
+			CASE(OP_NOT):
+				tos = BOOL_VAL(isFalsey(tos));
+				DISPATCH();
+			CASE(OP_EQUAL): {
+				Value a = *--sp;
+				tos = BOOL_VAL(valuesEqual(a, tos));
+				DISPATCH();
+			}
+			CASE(OP_GREATER):
+				if (IS_NUMBERS(tos, sp[-1]))
+					QUICKEN(OP_GREATER_NUM);
+				BINARY_OP(OP_GREATER, BOOL_VAL, >);
+				DISPATCH();
+			CASE(OP_LESS):
+				if (IS_NUMBERS(tos, sp[-1]))
+					QUICKEN(OP_LESS_NUM);
+				BINARY_OP(OP_LESS, BOOL_VAL, <);
+				DISPATCH();
+			CASE(OP_PRINT): {
+				fprintValue(vm -> out, tos);
+				fputc('\n', vm -> out);
+				DROP();
+				DISPATCH();
+			}
+			CASE(OP_POP):
+				DROP();
+				DISPATCH();
+			CASE(OP_DEFINE_GLOBAL):
+				vm -> globalValues.values[READ_SLOT()] = tos;
+				DROP();
+				DISPATCH();
+			CASE(OP_GET_GLOBAL): {
+				int slot = READ_SLOT();
+				Value value = vm -> globalValues.values[slot];
+				if (IS_UNDEFINED(value)) {
+					RUNTIME_ERROR("Undefined variable '%s'.", globalName(vm, slot) -> chars);
+				}
+				PUSH(value);
+				DISPATCH();
+			}
+			CASE(OP_SET_GLOBAL): {
+				int slot = READ_SLOT();
+				if (IS_UNDEFINED(vm -> globalValues.values[slot])) {
+					RUNTIME_ERROR("Undefined variable '%s'.", globalName(vm, slot) -> chars);
+				}
+				vm -> globalValues.values[slot] = tos;
+				DISPATCH();
+			}
+			CASE(OP_GET_LOCAL):
+				PUSH(LOCAL(READ_BYTE()));
+				DISPATCH();
+			//If the local is the cached top, its stale slot is overwritten
+			//with the value tos already holds, so no check is needed.
+			CASE(OP_SET_LOCAL):
+				slots[READ_BYTE()] = tos;
+				DISPATCH();
+			CASE(OP_JUMP_IF_FALSE):
+				if (isFalsey(tos))
+					ip = READ_TARGET();
+				DISPATCH();
+			CASE(OP_JUMP):
+				ip = READ_TARGET();
+				DISPATCH();
+			CASE(OP_LOOP): {
+#ifdef JIT
+				//The unused arg byte counts back edges up to TRACE_THRESHOLD,
+				//and arg2 how many recordings of the loop were abandoned.
+				Instr* loop = ip - 1;
+				if (loop -> arg < TRACE_THRESHOLD && ++loop -> arg == TRACE_THRESHOLD && vm -> jitEnabled && !vm -> registerMode) {
+					SPILL();
+					if (recordTrace(vm, frame -> closure -> function, slots, loop, &ip) != NULL) {
+						SET_OP(loop, OP_LOOP_TRACE);
 					}
-					push(value);
-					break;
-			}
-			case OP_SET_GLOBAL: {
-					ObjString* name = READ_STRING();
-					if (tableSet(&vm.globals, name, peek(0))) {
-						tableDelete(&vm.globals, name);
-						runtimeError("Undefined variable %s'.", name -> chars);
-						return INTERPRET_RUNTIME_ERROR;
+					else if (++loop -> arg2 < TRACE_MAX_ATTEMPTS) {
+						loop -> arg = 0;
 					}
-					break;
-			}
-			case OP_GET_LOCAL: {
-					uint8_t slot = READ_BYTE();
-					push(frame -> slots[slot]);
-					break;
-			}
-			case OP_SET_LOCAL: {
-					uint8_t slot = READ_BYTE();
-					frame -> slots[slot] = peek(0);
-					break;
-			}
-			case OP_JUMP_IF_FALSE: {
-					uint16_t offset = READ_SHORT();
-					if (isFalsey(peek(0)))
-						frame -> ip += offset;
-					break;
-			}
-			case OP_JUMP: {
-					uint16_t offset = READ_SHORT();
-					frame -> ip += offset;
-					break;
-			}
-			case OP_LOOP: {
-				uint16_t offset = READ_SHORT();
-				frame -> ip -= offset;
-				break;
+					RELOAD();
+					DISPATCH();
+				}
+#endif
+				ip = READ_TARGET();
+				DISPATCH();
 			}
-			case OP_RETURN: {
-				Value result = pop();
-				closeUpvalues(frame -> slots);
-				vm.frameCount--;
-				if (vm.frameCount == 0) {
-					pop();
+#ifdef JIT
+			CASE(OP_LOOP_TRACE):
+				SPILL();
+				ip = ((TraceFn)ip[-1].as.trace -> code)(vm, slots);
+				RELOAD();
+				DISPATCH();
+#endif
+			CASE(OP_RETURN):
+			returnValue: {
+				SPILL();
+				Value result = pop(vm);
+				closeUpvalues(vm, slots);
+				vm -> frameCount--;
+				if (vm -> frameCount == 0) {
+					pop(vm);
 					return INTERPRET_OK;
 				}
-				vm.stackTop = frame -> slots;
-				push(result);
-				frame = &vm.frames[vm.frameCount - 1];
-				break;
+				vm -> stackTop = slots;
+				push(vm, result);
+				if (vm -> frameCount == baseFrame)
+					return INTERPRET_OK;
+				LOAD_FRAME();
+				RELOAD();
+				DISPATCH();
 			}
-			case OP_CALL: {
+			CASE(OP_CALL):
+			callValue: {
 				int argCount = READ_BYTE();
-				if (!callValue(peek(argCount), argCount)) {
+				STORE_FRAME();
+				SPILL();
+				if (!callValue(vm, peek(vm, argCount), argCount)) {
 					return INTERPRET_RUNTIME_ERROR;
-					frame = &vm.frames[vm.frameCount - 1];
-				} break;
-			}
-			case OP_CLOSURE: {
-				ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-				ObjClosure* closure = newClosure(function);
-				push(OBJ_VAL(closure));
-			
-				for (int i = 0; i < closure -> upvalueCount; i++) {
-					uint8_t isLocal = READ_BYTE();
-					uint8_t index = READ_BYTE();
-					if (isLocal) {
-						closure -> upvalues[i] = captureUpvalue(frame -> slots + index);
-					}
-					else {
-						closure -> upvalues[i] = frame -> closure -> upvalues[index];
+				}
+				ENTER_FRAME();
+				DISPATCH();
+			}
+			CASE(OP_TAIL_CALL):
+			tailCall: {
+				int argCount = READ_BYTE();
+				SPILL();
+				Value callee = peek(vm, argCount);
+				if (IS_BOUND_METHOD(callee)) {
+					vm -> stackTop[-argCount - 1] = AS_BOUND_METHOD(callee) -> receiver;
+					callee = OBJ_VAL(AS_BOUND_METHOD(callee) -> method);
+				}
+				//Anything but a closure is called normally and the OP_RETURN
+				//after this instruction returns its result.
+				if (!IS_CLOSURE(callee)) {
+					STORE_FRAME();
+					if (!callValue(vm, callee, argCount)) {
+						return INTERPRET_RUNTIME_ERROR;
 					}
+					ENTER_FRAME();
+					DISPATCH();
 				}
-
-				break;
+				STORE_FRAME();
+				if (!tailCall(vm, AS_CLOSURE(callee), argCount)) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				ENTER_FRAME();
+				DISPATCH();
 			}
-			case OP_GET_UPVALUE: {
+			CASE(OP_CLOSURE):
+			closure:
+				SPILL();
+				makeClosure(vm, frame, ip[-1].as.upvalues);
+				RELOAD();
+				DISPATCH();
+			CASE(OP_GET_UPVALUE): {
 				uint8_t slot = READ_BYTE();
-				push(*frame -> closure -> upvalues[slot] -> location);
-				break;
+				PUSH(*frame -> closure -> upvalues[slot].boxed -> location);
+				DISPATCH();
 			}
-			case OP_SET_UPVALUE: {
+			CASE(OP_GET_FLAT_UPVALUE):
+				PUSH(frame -> closure -> upvalues[READ_BYTE()].flat);
+				DISPATCH();
+			CASE(OP_SET_UPVALUE): {
 				uint8_t slot = READ_BYTE();
-				*frame -> closure -> upvalues[slot] -> location = peek(0);
-				break;
+				*frame -> closure -> upvalues[slot].boxed -> location = tos;
+				DISPATCH();
 			}
-			case OP_CLOSE_UPVALUE:
-				closeUpvalues(vm.stackTop - 1);
-				pop();
-				break;
-			case OP_CLASS:
-				push(OBJ_VAL(newClass(READ_STRING())));
-				break;
-			case OP_GET_PROPERTY: {
-				if (!IS_INSTANCE(peek(0))) {
-					runtimeError("Only isntances have properties.");
+			CASE(OP_CLOSE_UPVALUE):
+			closeUpvalue:
+				*sp = tos;
+				closeUpvalues(vm, sp);
+				DROP();
+				DISPATCH();
+			CASE(OP_CLASS):
+			defineClass:
+				SPILL();
+				push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
+				RELOAD();
+				DISPATCH();
+			CASE(OP_GET_PROPERTY):
+			getProperty:
+				STORE_FRAME();
+				SPILL();
+				if (!getProperty(vm, READ_CACHE())) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				ObjInstance* instance = AS_INSTANCE(peek(0));
-				ObjString* name = READ_STRING();
-
-				Value value;
-				if (tableGet(&instance -> fields, name, &value)) {
-					pop();
-					push(value);
-					break;
+				RELOAD();
+				DISPATCH();
+			CASE(OP_SET_PROPERTY):
+			setProperty:
+				STORE_FRAME();
+				SPILL();
+				if (!storeProperty(vm, READ_CACHE())) {
+					return INTERPRET_RUNTIME_ERROR;
 				}
-
-				if (!bindMethod(instance -> klass, name)) {
+				RELOAD();
+				DISPATCH();
+			CASE(OP_METHOD):
+			method:
+				SPILL();
+				defineMethod(vm, READ_STRING());
+				RELOAD();
+				DISPATCH();
+			CASE(OP_INVOKE):
+			invoke: {
+				int argCount = READ_BYTE();
+				STORE_FRAME();
+				SPILL();
+				if (!invoke(vm, READ_CACHE(), argCount)) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				break;
+				ENTER_FRAME();
+				DISPATCH();
 			}
-			case OP_SET_PROPERTY: {
-				if (!IS_INSTANCE(peek(1))) {
-					runtimeError("Only instances have fields,");
+			CASE(OP_INHERIT):
+			inherit:
+				STORE_FRAME();
+				SPILL();
+				if (!inherit(vm)) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				ObjInstance* instance = AS_INSTANCE(peek(1));
-				tableSet(&instance -> fields, READ_STRING(), peek(0));
-				Value value = pop();
-				pop();
-				push(value);
-				break;
+				RELOAD();
+				DISPATCH();
+			CASE(OP_GET_SUPER):
+			getSuper: {
+				ObjString* name = READ_STRING();
+				SPILL();
+				ObjClass* superclass = AS_CLASS(pop(vm));
+
+				STORE_FRAME();
+				if (!bindMethod(vm, superclass, name)) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				RELOAD();
+				DISPATCH();
 			}
-			case OP_METHOD:
-				defineMethod(READ_STRING());
-				break;
-			case OP_INVOKE: {
-				ObjString* method = READ_STRING();
+			CASE(OP_SUPER_INVOKE):
+			superInvoke: {
 				int argCount = READ_BYTE();
-				if (!invoke(method, argCount)) {
+				SPILL();
+				ObjClass* superclass = AS_CLASS(pop(vm));
+				STORE_FRAME();
+				if (!invokeSuper(vm, READ_CACHE(), superclass, argCount)) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
+				ENTER_FRAME();
+				DISPATCH();
+			}
+			CASE(OP_ADD_LOCALS): {
+				Value a = LOCAL(READ_BYTE());
+				Value b = LOCAL(READ_SECOND_BYTE());
+				if (IS_NUMBERS(a, b)) {
+					PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+					DISPATCH();
 				}
-			case OP_INHERIT: {
-				Value superclass = peek(1);
-				if (!IS_CLASS(superclass)) {
-					runtimeError("Superclass must be a class.");
-					return INTERPRET_RUNTIME_ERROR;
+				PUSH(a);
+				PUSH(b);
+				goto add;
+			}
+			CASE(OP_ADD_LOCAL_CONSTANT): {
+				Value a = LOCAL(READ_BYTE());
+				Value b = READ_CONSTANT();
+				if (IS_NUMBERS(a, b)) {
+					PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+					DISPATCH();
 				}
-				ObjClass* subclass = AS_CLASS(peek(0));
-				tableAddAll(&AS_CLASS(superclass) -> methods, &subclass -> methods);
-				pop();
-				break;
+				PUSH(a);
+				PUSH(b);
+				goto add;
 			}
-			case OP_GET_SUPER: {
-				ObjString* name = READ_STRING();
-				ObjClass* superclass = AS_CLASS(pop());
-
-				if (!bindMethod(superclass, name)) {
+			CASE(OP_SUBTRACT_LOCAL_CONSTANT): {
+				Value a = LOCAL(READ_BYTE());
+				Value b = READ_CONSTANT();
+				if (!IS_NUMBERS(a, b)) {
+					PUSH(a);
+					PUSH(b);
+					SLOW_BINARY_OP(OP_SUBTRACT);
+					DISPATCH();
+				}
+				PUSH(NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b)));
+				DISPATCH();
+			}
+			CASE(OP_SET_LOCAL_POP):
+				slots[READ_BYTE()] = tos;
+				DROP();
+				DISPATCH();
+			CASE(OP_POPN):
+				sp -= READ_BYTE();
+				tos = *sp;
+				DISPATCH();
+			CASE(OP_LESS_JUMP):
+				COMPARE_JUMP(OP_LESS, <);
+				DISPATCH();
+			CASE(OP_GREATER_JUMP):
+				COMPARE_JUMP(OP_GREATER, >);
+				DISPATCH();
+			CASE(OP_EQUAL_JUMP): {
+				Value b = tos;
+				Value a = sp[-1];
+				sp -= 2;
+				tos = *sp;
+				if (!valuesEqual(a, b))
+					ip = READ_TARGET();
+				DISPATCH();
+			}
+			CASE(OP_GET_LOCAL_PROPERTY):
+				PUSH(LOCAL(READ_BYTE()));
+				goto getProperty;
+			CASE(OP_ADD_NUM):
+				QUICKENED_BINARY_OP(NUMBER_VAL, +);
+				DISPATCH();
+			CASE(OP_ADD_STR):
+				if (!IS_TEXT(tos) || !IS_TEXT(sp[-1]))
+					goto deoptimize;
+				SPILL();
+				concatenate(vm);
+				RELOAD();
+				DISPATCH();
+			CASE(OP_SUBTRACT_NUM):
+				QUICKENED_BINARY_OP(NUMBER_VAL, -);
+				DISPATCH();
+			CASE(OP_MULTIPLY_NUM):
+				QUICKENED_BINARY_OP(NUMBER_VAL, *);
+				DISPATCH();
+			CASE(OP_DIVIDE_NUM):
+				QUICKENED_BINARY_OP(NUMBER_VAL, /);
+				DISPATCH();
+			CASE(OP_LESS_NUM):
+				QUICKENED_BINARY_OP(BOOL_VAL, <);
+				DISPATCH();
+			CASE(OP_GREATER_NUM):
+				QUICKENED_BINARY_OP(BOOL_VAL, >);
+				DISPATCH();
+			CASE(OP_MOVE):
+				slots[READ_BYTE()] = slots[READ_SECOND_BYTE()];
+				DISPATCH();
+			CASE(OP_LOAD_CONSTANT):
+				slots[READ_BYTE()] = READ_CONSTANT();
+				DISPATCH();
+			CASE(OP_LOAD_NIL):
+				slots[READ_BYTE()] = NIL_VAL;
+				DISPATCH();
+			CASE(OP_LOAD_BOOL):
+				slots[READ_BYTE()] = BOOL_VAL(READ_SECOND_BYTE());
+				DISPATCH();
+			CASE(OP_GET_GLOBAL_R): {
+				int slot = READ_SLOT();
+				Value value = vm -> globalValues.values[slot];
+				if (IS_UNDEFINED(value)) {
+					RUNTIME_ERROR("Undefined variable '%s'.", globalName(vm, slot) -> chars);
+				}
+				slots[READ_BYTE()] = value;
+				DISPATCH();
+			}
+			CASE(OP_SET_GLOBAL_R): {
+				int slot = READ_SLOT();
+				if (IS_UNDEFINED(vm -> globalValues.values[slot])) {
+					RUNTIME_ERROR("Undefined variable '%s'.", globalName(vm, slot) -> chars);
+				}
+				vm -> globalValues.values[slot] = slots[READ_BYTE()];
+				DISPATCH();
+			}
+			CASE(OP_DEFINE_GLOBAL_R):
+				vm -> globalValues.values[READ_SLOT()] = slots[READ_BYTE()];
+				DISPATCH();
+			CASE(OP_GET_UPVALUE_R):
+				slots[READ_BYTE()] = *frame -> closure -> upvalues[READ_SECOND_BYTE()].boxed -> location;
+				DISPATCH();
+			CASE(OP_SET_UPVALUE_R):
+				*frame -> closure -> upvalues[READ_SECOND_BYTE()].boxed -> location = slots[READ_BYTE()];
+				DISPATCH();
+			CASE(OP_GET_FLAT_UPVALUE_R):
+				slots[READ_BYTE()] = frame -> closure -> upvalues[READ_SECOND_BYTE()].flat;
+				DISPATCH();
+			CASE(OP_ADD_R): {
+				Value a = slots[READ_SECOND_BYTE()];
+				Value b = slots[READ_THIRD_BYTE()];
+				if (IS_NUMBERS(a, b)) {
+					slots[READ_BYTE()] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+					DISPATCH();
+				}
+				STORE_FRAME();
+				if (!addValues(vm, slots + frame -> closure -> function -> maxSlots, a, b, &slots[READ_BYTE()])) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				break;
-			
+				DISPATCH();
 			}
-			case OP_SUPER_INVOKE: {
-				ObjString* method = READ_STRING();
-				int argCount = READ_BYTE();
-				ObjClass* superclass = AS_CLASS(pop());
-				if (!invokeFromClass(superclass, method, argCount)) {
+			CASE(OP_SUBTRACT_R):
+				REGISTER_BINARY_OP(OP_SUBTRACT, NUMBER_VAL, -);
+				DISPATCH();
+			CASE(OP_MULTIPLY_R):
+				REGISTER_BINARY_OP(OP_MULTIPLY, NUMBER_VAL, *);
+				DISPATCH();
+			CASE(OP_DIVIDE_R):
+				REGISTER_BINARY_OP(OP_DIVIDE, NUMBER_VAL, /);
+				DISPATCH();
+			CASE(OP_MODULO_R): {
+				Value a = slots[READ_SECOND_BYTE()];
+				Value b = slots[READ_THIRD_BYTE()];
+				if (IS_INTS(a, b) && AS_INT(b) > 0 && AS_INT(a) >= 0) {
+					slots[READ_BYTE()] = INT_VAL(AS_INT(a) % AS_INT(b));
+					DISPATCH();
+				}
+				STORE_FRAME();
+				if (!arithmetic(vm, OP_MODULO, a, b, &slots[READ_BYTE()]))
 					return INTERPRET_RUNTIME_ERROR;
+				DISPATCH();
+			}
+			CASE(OP_BIT_AND_R):
+				REGISTER_INT_BINARY_OP(OP_BIT_AND, a & b);
+				DISPATCH();
+			CASE(OP_BIT_OR_R):
+				REGISTER_INT_BINARY_OP(OP_BIT_OR, a | b);
+				DISPATCH();
+			CASE(OP_BIT_XOR_R):
+				REGISTER_INT_BINARY_OP(OP_BIT_XOR, a ^ b);
+				DISPATCH();
+			CASE(OP_SHIFT_LEFT_R):
+				REGISTER_INT_BINARY_OP(OP_SHIFT_LEFT, (int32_t)((uint32_t)a << (b & 31)));
+				DISPATCH();
+			CASE(OP_SHIFT_RIGHT_R):
+				REGISTER_INT_BINARY_OP(OP_SHIFT_RIGHT, a >> (b & 31));
+				DISPATCH();
+			CASE(OP_GREATER_R):
+				REGISTER_BINARY_OP(OP_GREATER, BOOL_VAL, >);
+				DISPATCH();
+			CASE(OP_LESS_R):
+				REGISTER_BINARY_OP(OP_LESS, BOOL_VAL, <);
+				DISPATCH();
+			CASE(OP_EQUAL_R):
+				slots[READ_BYTE()] = BOOL_VAL(valuesEqual(slots[READ_SECOND_BYTE()], slots[READ_THIRD_BYTE()]));
+				DISPATCH();
+			CASE(OP_ADD_RK): {
+				Value a = slots[READ_SECOND_BYTE()];
+				Value b = READ_CONSTANT();
+				if (IS_NUMBER(a)) {
+					slots[READ_BYTE()] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+					DISPATCH();
 				}
-				frame = &vm.frames[vm.frameCount - 1];
-				break;
+				STORE_FRAME();
+				if (!addValues(vm, slots + frame -> closure -> function -> maxSlots, a, b, &slots[READ_BYTE()])) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				DISPATCH();
+			}
+			CASE(OP_SUBTRACT_RK): {
+				Value a = slots[READ_SECOND_BYTE()];
+				if (!IS_NUMBER(a)) {
+					STORE_FRAME();
+					if (!arithmetic(vm, OP_SUBTRACT, a, READ_CONSTANT(), &slots[READ_BYTE()]))
+						return INTERPRET_RUNTIME_ERROR;
+					DISPATCH();
+				}
+				slots[READ_BYTE()] = NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(READ_CONSTANT()));
+				DISPATCH();
+			}
+			CASE(OP_NEGATE_R): {
+				Value value = slots[READ_SECOND_BYTE()];
+				if (!IS_NUMBER(value)) {
+					STORE_FRAME();
+					if (!arithmetic(vm, OP_NEGATE, value, NIL_VAL, &slots[READ_BYTE()]))
+						return INTERPRET_RUNTIME_ERROR;
+					DISPATCH();
+				}
+				slots[READ_BYTE()] = NUMBER_VAL(-AS_NUMBER(value));
+				DISPATCH();
 			}
+			CASE(OP_NOT_R):
+				slots[READ_BYTE()] = BOOL_VAL(isFalsey(slots[READ_SECOND_BYTE()]));
+				DISPATCH();
+			CASE(OP_PRINT_R):
+				fprintValue(vm -> out, slots[READ_BYTE()]);
+				fputc('\n', vm -> out);
+				DISPATCH();
+			CASE(OP_TEST_JUMP):
+				if (isFalsey(slots[READ_SECOND_BYTE()]))
+					ip = READ_TARGET();
+				DISPATCH();
+			CASE(OP_LESS_JUMP_R):
+				REGISTER_COMPARE_JUMP(OP_LESS, <);
+				DISPATCH();
+			CASE(OP_GREATER_JUMP_R):
+				REGISTER_COMPARE_JUMP(OP_GREATER, >);
+				DISPATCH();
+			CASE(OP_EQUAL_JUMP_R):
+				if (!valuesEqual(slots[READ_SECOND_BYTE()], slots[READ_THIRD_BYTE()]))
+					ip = READ_TARGET();
+				DISPATCH();
+			//The rest of the register instructions are stack ones. They put
+			//the stack top where the stack form expects it and run that.
+			CASE(OP_CALL_R):
+				BRIDGE();
+				goto callValue;
+			CASE(OP_TAIL_CALL_R):
+				BRIDGE();
+				goto tailCall;
+			CASE(OP_INVOKE_R):
+				BRIDGE();
+				goto invoke;
+			CASE(OP_SUPER_INVOKE_R):
+				BRIDGE();
+				goto superInvoke;
+			CASE(OP_CLOSURE_R):
+				BRIDGE();
+				goto closure;
+			CASE(OP_CLOSE_UPVALUE_R):
+				BRIDGE();
+				goto closeUpvalue;
+			CASE(OP_CLASS_R):
+				BRIDGE();
+				goto defineClass;
+			CASE(OP_INHERIT_R):
+				BRIDGE();
+				goto inherit;
+			CASE(OP_GET_PROPERTY_R):
+				BRIDGE();
+				goto getProperty;
+			CASE(OP_SET_PROPERTY_R):
+				BRIDGE();
+				goto setProperty;
+			CASE(OP_GET_SUPER_R):
+				BRIDGE();
+				goto getSuper;
+			CASE(OP_METHOD_R):
+				BRIDGE();
+				goto method;
+			CASE(OP_RETURN_R):
+				BRIDGE();
+				goto returnValue;
+			//A quickened instruction saw operands it does not handle. Turn it
+			//back into its generic form and run that instead, which may
+			//quicken it again for the new types.
+			deoptimize:
+				ip--;
+				SET_OP(ip, genericOpcode(ip -> op));
+				ip -> arg++;
+				vm -> stats.deoptimizations++;
+				DISPATCH();
+	#ifndef COMPUTED_GOTO
 		}
 	} 
+	#endif
 	#undef READ_BYTE
-	#undef READ_SHORT
 	#undef READ_CONSTANT
+	#undef READ_TARGET
 	#undef READ_STRING
+	#undef READ_CACHE
+	#undef READ_SLOT
+	#undef STORE_FRAME
+	#undef SPILL
+	#undef RELOAD
+	#undef PUSH
+	#undef DROP
+	#undef LOCAL
+	#undef BRIDGE
+	#undef LOAD_FRAME
+	#undef DECODE_FRAME
+	#undef ENTER_FRAME
+	#undef RUNTIME_ERROR
+	#undef READ_SECOND_BYTE
+	#undef READ_THIRD_BYTE
+	#undef SLOW_BINARY_OP
 	#undef BINARY_OP
+	#undef INT_BINARY_OP
+	#undef QUICKENED_BINARY_OP
+	#undef SET_OP
+	#undef QUICKEN
+	#undef COMPARE_JUMP
+	#undef REGISTER_BINARY_OP
+	#undef REGISTER_INT_BINARY_OP
+	#undef REGISTER_COMPARE_JUMP
+	#undef TRACE_INSTRUCTION
+	#undef PROFILE_INSTRUCTION
+	#undef CASE
+	#undef DISPATCH
 }
 
-InterpretResult interpret(const char* source) {
-	ObjFunction* function = compile(source);
+InterpretResult interpret(VM* vm, const char* source) {
+	ObjFunction* function = compile(vm, source);
 	if (function == NULL)
 		return INTERPRET_COMPILE_ERROR;
-	push(OBJ_VAL(function));
-	ObjClosure* closure = newClosure(function);
-	pop();
-	push(OBJ_VAL(closure));
-	call(closure, 0);
+	return interpretFunction(vm, function);
+}
+
+//Runs a top-level function that was compiled, or loaded, elsewhere.
+InterpretResult interpretFunction(VM* vm, ObjFunction* function) {
+	push(vm, OBJ_VAL(function));
+	ObjClosure* closure = newClosure(vm, function);
+	pop(vm);
+	push(vm, OBJ_VAL(closure));
+	call(vm, closure, 0);
 
-	return run();
+	return run(vm);
 }
@@ -4,32 +4,80 @@
 #include "value.h"
 #include "table.h"
 #include "object.h"
+#include "decode.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#ifdef DEBUG_PROFILE_OPCODES
+#include "debug.h"
+#endif
+
+//The value stack and the frame array start this small and double as
+//needed. Recursion is limited by vm -> maxFrames, which defaults to
+//FRAMES_DEFAULT_MAX.
+#define STACK_INITIAL 256
+#define FRAMES_INITIAL 16
+#define FRAMES_DEFAULT_MAX 100000
+
+//Room kept above a frame's computed depth for the values the VM itself
+//pushes to keep them safe from the collector.
+#define STACK_SLACK 8
 
 typedef struct {
 	ObjClosure* closure;
-	uint8_t* ip;
+	Instr* ip;
 	Value* slots;
 } CallFrame;
 
 typedef struct {
-	CallFrame frames[FRAMES_MAX];
+	uint64_t cacheHits;
+	uint64_t cacheMisses;
+	uint64_t megamorphicLookups;
+	uint64_t quickenings;
+	uint64_t deoptimizations;
+	uint64_t jitCompilations;
+	uint64_t traceCompilations;
+	uint64_t traceAborts;
+} VMStats;
+
+//One interpreter. Everything a script can reach, including its heap, string
+//table and globals, hangs off its VM, so separate VMs can run on separate
+//threads.
+struct VM {
+	CallFrame* frames;
 	int frameCount;
-	Value stack[STACK_MAX];
+	int frameCapacity;
+	int maxFrames;
+	Value* stack;
 	Value* stackTop;
+	int stackCapacity;
 	ObjString* initString;
 	ObjUpvalue* openUpvalues;
 	Obj* objects;
 	Table strings;
-	Table globals;
+	Table globalSlots;
+	ValueArray globalValues;
 	int grayCount;
 	int grayCapacity;
 	Obj** grayStack;
 	size_t bytesAllocated;
 	size_t nextGC;
-} VM;
+	VMStats stats;
+	struct Parser* parser;
+	//Where print statements and error reports go. initVM points these at
+	//stdout and stderr.
+	FILE* out;
+	FILE* err;
+	//Whether hot functions get compiled to native code, and how many
+	//native frames are on the C stack right now. The flag is ignored in
+	//builds without the JIT.
+	bool jitEnabled;
+	int jitDepth;
+	//Whether functions are decoded to register code instead of stack code.
+	//The JIT only compiles stack code, so it stays off in register mode.
+	bool registerMode;
+#ifdef DEBUG_PROFILE_OPCODES
+	OpcodeProfile profile;
+#endif
+};
 
 typedef enum {
 	INTERPRET_OK,
@@ -37,12 +85,14 @@ typedef enum {
 	INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
-
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop();
+void initVM(VM* vm);
+void freeVM(VM* vm);
+InterpretResult interpret(VM* vm, const char* source);
+InterpretResult interpretFunction(VM* vm, ObjFunction* function);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
+void printStats(VM* vm);
+int globalSlot(VM* vm, ObjString* name);
+ObjString* globalName(VM* vm, int slot);
 
 #endif
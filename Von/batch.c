@@ -0,0 +1,206 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "batch.h"
+#include "../VM/vm.h"
+
+//A worker's queue of script indices. The owner takes from the tail and
+//idle workers steal from the head, so neighbouring scripts tend to stay
+//on one worker while the stragglers get spread around at the end.
+typedef struct {
+	pthread_mutex_t lock;
+	int* items;
+	int head;
+	int tail;
+} Deque;
+
+typedef struct {
+	Script* scripts;
+	Deque* deques;
+	int workerCount;
+	BatchOptions* options;
+} Pool;
+
+typedef struct {
+	Pool* pool;
+	int id;
+	pthread_t thread;
+} Worker;
+
+char* readSource(const char* path, FILE* err) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		fprintf(err, "Could not open file \"%s\".\n", path);
+		return NULL;
+	}
+	fseek(file, 0L, SEEK_END);
+	size_t fileSize = ftell(file);
+	rewind(file);
+
+	char* buffer = (char*)malloc(fileSize + 1);
+	size_t bytesRead = buffer == NULL ? 0 : fread(buffer, sizeof(char), fileSize, file);
+	fclose(file);
+	if (buffer == NULL || bytesRead < fileSize) {
+		fprintf(err, "Could not read file \"%s\".\n", path);
+		free(buffer);
+		return NULL;
+	}
+	buffer[bytesRead] = '\0';
+	return buffer;
+}
+
+static bool takeOwn(Deque* deque, int* index) {
+	pthread_mutex_lock(&deque -> lock);
+	bool found = deque -> head < deque -> tail;
+	if (found)
+		*index = deque -> items[--deque -> tail];
+	pthread_mutex_unlock(&deque -> lock);
+	return found;
+}
+
+static bool steal(Pool* pool, int thief, int* index) {
+	for (int i = 1; i < pool -> workerCount; i++) {
+		Deque* victim = &pool -> deques[(thief + i) % pool -> workerCount];
+		pthread_mutex_lock(&victim -> lock);
+		bool found = victim -> head < victim -> tail;
+		if (found)
+			*index = victim -> items[victim -> head++];
+		pthread_mutex_unlock(&victim -> lock);
+		if (found)
+			return true;
+	}
+	return false;
+}
+
+//Reads back everything written to a capture file and closes it.
+static char* drain(FILE* file, size_t* length) {
+	*length = 0;
+	if (file == NULL)
+		return NULL;
+	fflush(file);
+	fseek(file, 0L, SEEK_END);
+	size_t size = ftell(file);
+	rewind(file);
+	char* buffer = (char*)malloc(size + 1);
+	if (buffer != NULL) {
+		*length = fread(buffer, sizeof(char), size, file);
+		buffer[*length] = '\0';
+	}
+	fclose(file);
+	return buffer;
+}
+
+//Runs one script on a VM of its own, with print output and error reports
+//going to temporary files instead of the shared stdout and stderr.
+static void runScript(Pool* pool, Script* script) {
+	FILE* out = tmpfile();
+	FILE* err = tmpfile();
+	if (out == NULL || err == NULL) {
+		script -> status = 74;
+	}
+	else {
+		char* source = readSource(script -> path, err);
+		if (source == NULL) {
+			script -> status = 74;
+		}
+		else {
+			VM vm;
+			initVM(&vm);
+			vm.out = out;
+			vm.err = err;
+			vm.maxFrames = pool -> options -> maxDepth;
+			vm.jitEnabled = pool -> options -> jit;
+			vm.registerMode = pool -> options -> registers;
+			InterpretResult result = interpret(&vm, source);
+			if (pool -> options -> showStats)
+				printStats(&vm);
+			freeVM(&vm);
+			free(source);
+
+			if (result == INTERPRET_COMPILE_ERROR)
+				script -> status = 65;
+			else if (result == INTERPRET_RUNTIME_ERROR)
+				script -> status = 70;
+			else
+				script -> status = 0;
+		}
+	}
+	script -> output = drain(out, &script -> outputLength);
+	script -> errors = drain(err, &script -> errorsLength);
+}
+
+static void* work(void* arg) {
+	Worker* worker = (Worker*)arg;
+	Pool* pool = worker -> pool;
+	int index;
+	while (takeOwn(&pool -> deques[worker -> id], &index) || steal(pool, worker -> id, &index)) {
+		runScript(pool, &pool -> scripts[index]);
+	}
+	return NULL;
+}
+
+//Runs every script to completion on up to options -> jobs threads. Scripts are dealt
+//out round-robin and rebalanced by stealing; no script shares any state
+//with another.
+void runBatch(Script* scripts, int count, BatchOptions* options) {
+	int jobs = options -> jobs;
+	if (jobs > count)
+		jobs = count;
+	if (jobs < 1)
+		return;
+
+	Pool pool;
+	pool.scripts = scripts;
+	pool.workerCount = jobs;
+	pool.options = options;
+	pool.deques = (Deque*)malloc(sizeof(Deque) * jobs);
+	int* items = (int*)malloc(sizeof(int) * count);
+	Worker* workers = (Worker*)malloc(sizeof(Worker) * jobs);
+	if (pool.deques == NULL || items == NULL || workers == NULL)
+		exit(1);
+
+	int next = 0;
+	for (int i = 0; i < jobs; i++) {
+		Deque* deque = &pool.deques[i];
+		pthread_mutex_init(&deque -> lock, NULL);
+		deque -> items = items + next;
+		deque -> head = 0;
+		deque -> tail = 0;
+		for (int script = i; script < count; script += jobs) {
+			deque -> items[deque -> tail++] = script;
+		}
+		next += deque -> tail;
+	}
+
+	int started = 0;
+	for (; started < jobs; started++) {
+		workers[started].pool = &pool;
+		workers[started].id = started;
+		if (pthread_create(&workers[started].thread, NULL, work, &workers[started]) != 0)
+			break;
+	}
+	//If the system refused some threads, this one steps in as a worker so
+	//the scripts dealt to the missing ones still run.
+	if (started < jobs) {
+		Worker self = {.pool = &pool, .id = started};
+		work(&self);
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	for (int i = 0; i < jobs; i++) {
+		pthread_mutex_destroy(&pool.deques[i].lock);
+	}
+	free(workers);
+	free(items);
+	free(pool.deques);
+}
+
+void freeScript(Script* script) {
+	free(script -> output);
+	free(script -> errors);
+	script -> output = NULL;
+	script -> errors = NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef Von_batch_h
+#define Von_batch_h
+
+#include <stdio.h>
+#include "../VM/common.h"
+
+//One script in a batch run and everything it produced. status is the exit
+//code von would have returned had the script been run on its own.
+typedef struct {
+	const char* path;
+	int status;
+	char* output;
+	size_t outputLength;
+	char* errors;
+	size_t errorsLength;
+} Script;
+
+//Settings every VM in the batch is created with.
+typedef struct {
+	int jobs;
+	int maxDepth;
+	bool showStats;
+	bool jit;
+	bool registers;
+} BatchOptions;
+
+char* readSource(const char* path, FILE* err);
+void runBatch(Script* scripts, int count, BatchOptions* options);
+void freeScript(Script* script);
+
+#endif
@@ -0,0 +1,315 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "emitc.h"
+#include "../VM/aot.h"
+#include "../VM/debug.h"
+#include "../VM/decode.h"
+#include "../compiler/compiler.h"
+
+//Every function in the script, numbered in the order they are found
+//through the constants. The script itself is number 0.
+typedef struct {
+	ObjFunction** functions;
+	int count;
+	int capacity;
+} FunctionList;
+
+static void collectFunctions(FunctionList* list, ObjFunction* function) {
+	if (list -> count == list -> capacity) {
+		list -> capacity = list -> capacity < 8 ? 8 : list -> capacity * 2;
+		list -> functions = (ObjFunction**)realloc(list -> functions, sizeof(ObjFunction*) * list -> capacity);
+		if (list -> functions == NULL)
+			exit(1);
+	}
+	list -> functions[list -> count++] = function;
+	ValueArray* constants = &function -> chunk.constants;
+	for (int i = 0; i < constants -> count; i++) {
+		if (IS_FUNCTION(constants -> values[i]))
+			collectFunctions(list, AS_FUNCTION(constants -> values[i]));
+	}
+}
+
+static int functionIndex(FunctionList* list, ObjFunction* function) {
+	for (int i = 0; i < list -> count; i++) {
+		if (list -> functions[i] == function)
+			return i;
+	}
+	return -1;
+}
+
+static void writeString(FILE* out, const char* chars, int length) {
+	fputc('"', out);
+	for (int i = 0; i < length; i++) {
+		unsigned char c = (unsigned char)chars[i];
+		//Octal escapes for everything else, and for ? so no trigraphs.
+		if (c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '?')
+			fputc(c, out);
+		else
+			fprintf(out, "\\%03o", c);
+	}
+	fputc('"', out);
+}
+
+//Hex floats keep every bit of the number.
+static void writeNumber(FILE* out, double number) {
+	if (isnan(number))
+		fprintf(out, "NAN");
+	else if (isinf(number))
+		fprintf(out, number > 0 ? "INFINITY" : "-INFINITY");
+	else
+		fprintf(out, "%a", number);
+}
+
+//A constant operand, written out as a literal when it is a number.
+static void writeConstant(FILE* out, Instr* instr, int index) {
+	Value value = *instr -> as.constant;
+	if (IS_NUMBER(value)) {
+		fprintf(out, "NUMBER_VAL(");
+		writeNumber(out, AS_NUMBER(value));
+		fprintf(out, ")");
+	}
+	else {
+		fprintf(out, "*code[%d].as.constant", index);
+	}
+}
+
+static void writeData(FILE* out, FunctionList* list, int index) {
+	ObjFunction* function = list -> functions[index];
+	Chunk* chunk = &function -> chunk;
+	fprintf(out, "static const uint8_t code%d[] = {", index);
+	for (int i = 0; i < chunk -> count; i++) {
+		fprintf(out, i % 16 == 0 ? "\n\t%d," : " %d,", chunk -> code[i]);
+	}
+	fprintf(out, "\n};\n\nstatic const int lines%d[] = {", index);
+	for (int i = 0; i < chunk -> count; i++) {
+		fprintf(out, i % 16 == 0 ? "\n\t%d," : " %d,", chunk -> lines[i]);
+	}
+	fprintf(out, "\n};\n\n");
+	if (function -> upvalueCount > 0) {
+		fprintf(out, "static const bool flat%d[] = {", index);
+		for (int i = 0; i < function -> upvalueCount; i++) {
+			fprintf(out, i == 0 ? "%s" : ", %s", function -> flatUpvalues[i] ? "true" : "false");
+		}
+		fprintf(out, "};\n\n");
+	}
+	if (chunk -> constants.count == 0)
+		return;
+	fprintf(out, "static const AotConstant constants%d[] = {\n", index);
+	for (int i = 0; i < chunk -> constants.count; i++) {
+		Value value = chunk -> constants.values[i];
+		if (IS_NUMBER(value)) {
+			fprintf(out, "\t{AOT_NUMBER, ");
+			writeNumber(out, AS_NUMBER(value));
+			fprintf(out, ", NULL, 0},\n");
+		}
+		else if (IS_SHORT_STRING(value)) {
+			char chars[SHORT_STRING_MAX];
+			int length = shortStringChars(value, chars);
+			fprintf(out, "\t{AOT_SHORT_STRING, 0, ");
+			writeString(out, chars, length);
+			fprintf(out, ", %d},\n", length);
+		}
+		else if (IS_STRING(value)) {
+			fprintf(out, "\t{AOT_STRING, 0, ");
+			writeString(out, AS_STRING(value) -> chars, AS_STRING(value) -> length);
+			fprintf(out, ", %d},\n", AS_STRING(value) -> length);
+		}
+		else {
+			fprintf(out, "\t{AOT_FUNCTION, 0, NULL, %d},\n", functionIndex(list, AS_FUNCTION(value)));
+		}
+	}
+	fprintf(out, "};\n\n");
+}
+
+//Writes the body of one instruction. Returns false for an opcode the
+//decoder should never have produced.
+static bool writeInstruction(FILE* out, Instr* code, int i) {
+	Instr* instr = &code[i];
+	int target = -1;
+	switch (instr -> op) {
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP:
+		case OP_LESS_JUMP:
+		case OP_GREATER_JUMP:
+		case OP_EQUAL_JUMP:
+			target = (int)(instr -> as.target - code);
+			break;
+		default:
+			break;
+	}
+	fprintf(out, "\t");
+	switch (instr -> op) {
+		case OP_CONSTANT:
+			fprintf(out, "AOT_PUSH(");
+			writeConstant(out, instr, i);
+			fprintf(out, ");");
+			break;
+		case OP_NIL: fprintf(out, "AOT_PUSH(NIL_VAL);"); break;
+		case OP_TRUE: fprintf(out, "AOT_PUSH(BOOL_VAL(true));"); break;
+		case OP_FALSE: fprintf(out, "AOT_PUSH(BOOL_VAL(false));"); break;
+		case OP_POP: fprintf(out, "AOT_POP(1);"); break;
+		case OP_POPN: fprintf(out, "AOT_POP(%d);", instr -> arg); break;
+		case OP_GET_LOCAL: fprintf(out, "AOT_PUSH(slots[%d]);", instr -> arg); break;
+		case OP_SET_LOCAL: fprintf(out, "AOT_SET_LOCAL(%d);", instr -> arg); break;
+		case OP_SET_LOCAL_POP: fprintf(out, "AOT_SET_LOCAL_POP(%d);", instr -> arg); break;
+		case OP_DEFINE_GLOBAL: fprintf(out, "AOT_DEFINE_GLOBAL(%d);", instr -> as.slot); break;
+		case OP_GET_GLOBAL: fprintf(out, "AOT_GET_GLOBAL(%d, %d);", i, instr -> as.slot); break;
+		case OP_SET_GLOBAL: fprintf(out, "AOT_SET_GLOBAL(%d, %d);", i, instr -> as.slot); break;
+		case OP_GET_UPVALUE: fprintf(out, "AOT_PUSH(AOT_UPVALUE(%d));", instr -> arg); break;
+		case OP_SET_UPVALUE: fprintf(out, "AOT_UPVALUE(%d) = sp[-1];", instr -> arg); break;
+		case OP_GET_FLAT_UPVALUE: fprintf(out, "AOT_PUSH(AOT_FLAT_UPVALUE(%d));", instr -> arg); break;
+		case OP_ADD: fprintf(out, "AOT_ADD(%d);", i); break;
+		case OP_SUBTRACT: fprintf(out, "AOT_BINARY(%d, OP_SUBTRACT, NUMBER_VAL, -);", i); break;
+		case OP_MULTIPLY: fprintf(out, "AOT_BINARY(%d, OP_MULTIPLY, NUMBER_VAL, *);", i); break;
+		case OP_DIVIDE: fprintf(out, "AOT_BINARY(%d, OP_DIVIDE, NUMBER_VAL, /);", i); break;
+		case OP_GREATER: fprintf(out, "AOT_BINARY(%d, OP_GREATER, BOOL_VAL, >);", i); break;
+		case OP_LESS: fprintf(out, "AOT_BINARY(%d, OP_LESS, BOOL_VAL, <);", i); break;
+		case OP_MODULO: fprintf(out, "AOT_ARITHMETIC(%d, OP_MODULO);", i); break;
+		case OP_BIT_AND: fprintf(out, "AOT_ARITHMETIC(%d, OP_BIT_AND);", i); break;
+		case OP_BIT_OR: fprintf(out, "AOT_ARITHMETIC(%d, OP_BIT_OR);", i); break;
+		case OP_BIT_XOR: fprintf(out, "AOT_ARITHMETIC(%d, OP_BIT_XOR);", i); break;
+		case OP_SHIFT_LEFT: fprintf(out, "AOT_ARITHMETIC(%d, OP_SHIFT_LEFT);", i); break;
+		case OP_SHIFT_RIGHT: fprintf(out, "AOT_ARITHMETIC(%d, OP_SHIFT_RIGHT);", i); break;
+		case OP_ADD_LOCALS:
+			fprintf(out, "AOT_PUSH(slots[%d]); AOT_PUSH(slots[%d]); AOT_ADD(%d);", instr -> arg, instr -> arg2, i);
+			break;
+		case OP_ADD_LOCAL_CONSTANT:
+		case OP_SUBTRACT_LOCAL_CONSTANT:
+			fprintf(out, "AOT_PUSH(slots[%d]); AOT_PUSH(", instr -> arg);
+			writeConstant(out, instr, i);
+			if (instr -> op == OP_ADD_LOCAL_CONSTANT)
+				fprintf(out, "); AOT_ADD(%d);", i);
+			else
+				fprintf(out, "); AOT_BINARY(%d, OP_SUBTRACT, NUMBER_VAL, -);", i);
+			break;
+		case OP_NEGATE: fprintf(out, "AOT_NEGATE(%d);", i); break;
+		case OP_NOT: fprintf(out, "AOT_NOT();"); break;
+		case OP_EQUAL: fprintf(out, "AOT_EQUAL();"); break;
+		case OP_LESS_JUMP: fprintf(out, "AOT_COMPARE_JUMP(%d, <, L%d);", i, target); break;
+		case OP_GREATER_JUMP: fprintf(out, "AOT_COMPARE_JUMP(%d, >, L%d);", i, target); break;
+		case OP_EQUAL_JUMP: fprintf(out, "AOT_EQUAL_JUMP(L%d);", target); break;
+		case OP_JUMP_IF_FALSE: fprintf(out, "AOT_JUMP_IF_FALSE(L%d);", target); break;
+		case OP_JUMP:
+		case OP_LOOP:
+			fprintf(out, "goto L%d;", target);
+			break;
+		case OP_PRINT: fprintf(out, "AOT_PRINT(%d);", i); break;
+		case OP_CALL: fprintf(out, "AOT_CALL(%d, %d);", i, instr -> arg); break;
+		case OP_TAIL_CALL: fprintf(out, "AOT_TAIL_CALL(%d, %d);", i, instr -> arg); break;
+		case OP_INVOKE: fprintf(out, "AOT_INVOKE(%d, %d);", i, instr -> arg); break;
+		case OP_SUPER_INVOKE: fprintf(out, "AOT_SUPER_INVOKE(%d, %d);", i, instr -> arg); break;
+		case OP_GET_PROPERTY: fprintf(out, "AOT_GET_PROPERTY(%d);", i); break;
+		case OP_GET_LOCAL_PROPERTY:
+			fprintf(out, "AOT_PUSH(slots[%d]); AOT_GET_PROPERTY(%d);", instr -> arg, i);
+			break;
+		case OP_SET_PROPERTY: fprintf(out, "AOT_SET_PROPERTY(%d);", i); break;
+		case OP_GET_SUPER: fprintf(out, "AOT_GET_SUPER(%d);", i); break;
+		case OP_CLASS: fprintf(out, "AOT_CLASS(%d);", i); break;
+		case OP_INHERIT: fprintf(out, "AOT_INHERIT(%d);", i); break;
+		case OP_METHOD: fprintf(out, "AOT_METHOD(%d);", i); break;
+		case OP_CLOSURE: fprintf(out, "AOT_CLOSURE(%d);", i); break;
+		case OP_CLOSE_UPVALUE: fprintf(out, "AOT_CLOSE_UPVALUE(%d);", i); break;
+		case OP_RETURN: fprintf(out, "AOT_RETURN(%d);", i); break;
+		default:
+			return false;
+	}
+	fprintf(out, " //%s\n", opcodeName(instr -> op));
+	return true;
+}
+
+static bool writeFunction(VM* vm, FILE* out, ObjFunction* function, int index) {
+	Instr* code = decodeFunction(vm, function, NULL);
+	int count = function -> codeCount;
+	bool* isTarget = (bool*)calloc(count, sizeof(bool));
+	if (isTarget == NULL)
+		exit(1);
+	for (int i = 0; i < count; i++) {
+		switch (code[i].op) {
+			case OP_JUMP:
+			case OP_JUMP_IF_FALSE:
+			case OP_LOOP:
+			case OP_LESS_JUMP:
+			case OP_GREATER_JUMP:
+			case OP_EQUAL_JUMP:
+				isTarget[code[i].as.target - code] = true;
+				break;
+			default:
+				break;
+		}
+	}
+
+	fprintf(out, "static JitStatus function%d(VM* vm, int frameIndex) {\n\tAOT_ENTER();\n", index);
+	bool ok = true;
+	for (int i = 0; i < count && ok; i++) {
+		if (isTarget[i])
+			fprintf(out, "L%d:\n", i);
+		ok = writeInstruction(out, code, i);
+	}
+	fprintf(out, "}\n\n");
+	free(isTarget);
+	return ok;
+}
+
+bool emitC(VM* vm, const char* source, const char* path, FILE* out) {
+	ObjFunction* script = compile(vm, source);
+	if (script == NULL)
+		return false;
+	push(vm, OBJ_VAL(script));
+	FunctionList list = {NULL, 0, 0};
+	collectFunctions(&list, script);
+
+	fprintf(out, "//Written by von --emit-c from %s. Build it with the VM runtime:\n", path);
+	fprintf(out, "//  cc -O2 -I<von>/VM this.c <von>/VM/*.c <von>/compiler/*.c -lm\n\n");
+	fprintf(out, "#include \"aot.h\"\n\n");
+	fprintf(out, "#if AOT_FUSED != %d\n", AOT_FUSED);
+	fprintf(out, "#error \"Built with different superinstructions than the compiler that wrote it.\"\n");
+	fprintf(out, "#endif\n\n");
+
+	bool ok = true;
+	for (int i = 0; i < list.count && ok; i++) {
+		writeData(out, &list, i);
+		ok = writeFunction(vm, out, list.functions[i], i);
+	}
+
+	fprintf(out, "static const AotFunction functions[] = {\n");
+	for (int i = 0; i < list.count; i++) {
+		ObjFunction* function = list.functions[i];
+		fprintf(out, "\t{");
+		if (function -> name != NULL)
+			writeString(out, function -> name -> chars, function -> name -> length);
+		else
+			fprintf(out, "NULL");
+		fprintf(out, ", %d, %d, %d, %s, ", function -> arity, function -> upvalueCount,
+				function -> maxSlots, function -> sharesClosure ? "true" : "false");
+		if (function -> upvalueCount > 0)
+			fprintf(out, "flat%d, ", i);
+		else
+			fprintf(out, "NULL, ");
+		fprintf(out, "code%d, lines%d, %d, ", i, i, function -> chunk.count);
+		if (function -> chunk.constants.count > 0)
+			fprintf(out, "constants%d, %d, ", i, function -> chunk.constants.count);
+		else
+			fprintf(out, "NULL, 0, ");
+		fprintf(out, "function%d},\n", i);
+	}
+	fprintf(out, "};\n\nstatic const char* const globals[] = {\n");
+	for (int i = 0; i < vm -> globalValues.count; i++) {
+		ObjString* name = globalName(vm, i);
+		fprintf(out, "\t");
+		writeString(out, name -> chars, name -> length);
+		fprintf(out, ",\n");
+	}
+	fprintf(out, "};\n\n");
+	fprintf(out, "static const AotProgram program = {functions, %d, globals, %d};\n\n",
+			list.count, vm -> globalValues.count);
+	fprintf(out, "int main(void) {\n\treturn runProgram(&program);\n}\n");
+
+	free(list.functions);
+	pop(vm);
+	if (!ok)
+		fprintf(stderr, "Unexpected instruction in %s.\n", path);
+	return ok;
+}
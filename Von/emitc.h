@@ -0,0 +1,11 @@
+#ifndef Von_emitc_h
+#define Von_emitc_h
+
+#include <stdio.h>
+#include "../VM/vm.h"
+
+//Compiles source and writes it to out as a C program for the runtime in
+//VM/aot.c. Returns false if the script does not compile.
+bool emitC(VM* vm, const char* source, const char* path, FILE* out);
+
+#endif
@@ -5,6 +5,8 @@
 #include "../VM/chunk.h"
 #include "../VM/debug.h"
 #include "../VM/vm.h"
+#include "batch.h"
+#include "emitc.h"
 
 void indent() {
 	printf(">> ");
@@ -16,7 +18,7 @@ void prompt() {
 	printf("Type '.help' for information\n");
 }
 
-static void REPL() {
+static void REPL(VM* vm) {
 	prompt();
 	printf("\n");
 	char line[1024];
@@ -26,53 +28,163 @@ static void REPL() {
 			printf("\n");
 			break;
 		}
-		interpret(line);
+		interpret(vm, line);
 	}
 }
 
 static char* readFile(const char* path) {
-	FILE* file = fopen(path, "rb");
-	if (file == NULL) {
-		fprintf(stderr, "Could not open file \"%s\".\n", path);
+	char* buffer = readSource(path, stderr);
+	if (buffer == NULL)
 		exit(74);
-	}
-	fseek(file, 0L, SEEK_END);
-	size_t fileSize = ftell(file);
-	rewind(file);
-
-	char* buffer = (char*)malloc(fileSize + 1);
-	size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-	if (bytesRead < fileSize) {
-		fprintf(stderr, "Could not read file \"%s\".\n", path);
-		exit(74);
-	}
-	buffer[bytesRead] = '\0';
-	fclose(file);
 	return buffer;
 }
 
-static void runFile(const char* path) {
+static void runFile(VM* vm, const char* path) {
 	char* source = readFile(path);
-	InterpretResult result = interpret(source);
+	InterpretResult result = interpret(vm, source);
 	free(source);
 
 	if (result == INTERPRET_COMPILE_ERROR) exit(65);
 	if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+//Writes the script at path as C next to it, with .von swapped for .c.
+static void emitFile(VM* vm, const char* path) {
+	char* source = readFile(path);
+	size_t length = strlen(path);
+	if (length > 4 && strcmp(path + length - 4, ".von") == 0)
+		length -= 4;
+	char* outPath = (char*)malloc(length + 3);
+	if (outPath == NULL)
+		exit(1);
+	memcpy(outPath, path, length);
+	strcpy(outPath + length, ".c");
+	FILE* out = fopen(outPath, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Could not open file \"%s\".\n", outPath);
+		exit(74);
+	}
+	bool ok = emitC(vm, source, path, out);
+	fclose(out);
+	free(source);
+	if (!ok) {
+		remove(outPath);
+		exit(65);
+	}
+	free(outPath);
+}
+
+static void usage() {
+	fprintf(stderr, "Usage: Von [--stats] [--max-depth N] [--no-jit] [--registers] [path]\n");
+	fprintf(stderr, "       Von [--stats] [--max-depth N] [--no-jit] [--registers] --jobs N path...\n");
+	fprintf(stderr, "       Von --emit-c path\n");
+	exit(64);
+}
+
+//Runs each script on its own VM across a pool of threads. Each script's
+//output is replayed in the order the paths were given, followed by a
+//summary of exit codes. Returns the worst exit code of the batch.
+static int runJobs(const char* paths[], int count, BatchOptions* options) {
+	Script* scripts = (Script*)malloc(sizeof(Script) * count);
+	if (scripts == NULL)
+		exit(1);
+	for (int i = 0; i < count; i++) {
+		scripts[i].path = paths[i];
+		scripts[i].status = 0;
+		scripts[i].output = NULL;
+		scripts[i].errors = NULL;
+	}
+	runBatch(scripts, count, options);
+
+	int worst = 0;
+	for (int i = 0; i < count; i++) {
+		Script* script = &scripts[i];
+		if (script -> output != NULL)
+			fwrite(script -> output, sizeof(char), script -> outputLength, stdout);
+		if (script -> errors != NULL)
+			fwrite(script -> errors, sizeof(char), script -> errorsLength, stderr);
+		if (script -> status > worst)
+			worst = script -> status;
+	}
+	fflush(stdout);
+	for (int i = 0; i < count; i++) {
+		fprintf(stderr, "%s: exit %d\n", scripts[i].path, scripts[i].status);
+		freeScript(&scripts[i]);
+	}
+	free(scripts);
+	return worst;
+}
+
 int main (int argc, const char* argv[]) {
+	bool showStats = false;
+	int maxDepth = FRAMES_DEFAULT_MAX;
+	int jobs = 0;
+	bool jit = true;
+	bool registers = false;
+	bool emit = false;
+	int arg = 1;
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+		if (strcmp(argv[arg], "--stats") == 0) {
+			showStats = true;
+		}
+		else if (strcmp(argv[arg], "--max-depth") == 0 && arg + 1 < argc) {
+			maxDepth = atoi(argv[++arg]);
+			if (maxDepth < 1)
+				usage();
+		}
+		else if (strcmp(argv[arg], "--no-jit") == 0) {
+			jit = false;
+		}
+		else if (strcmp(argv[arg], "--registers") == 0) {
+			registers = true;
+		}
+		else if (strcmp(argv[arg], "--emit-c") == 0) {
+			emit = true;
+		}
+		else if (strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc) {
+			jobs = atoi(argv[++arg]);
+			if (jobs < 1)
+				usage();
+		}
+		else {
+			usage();
+		}
+	}
+
+	if (jobs > 0) {
+		if (arg == argc)
+			usage();
+		BatchOptions options = {jobs, maxDepth, showStats, jit, registers};
+		return runJobs(&argv[arg], argc - arg, &options);
+	}
+
+	if (emit) {
+		if (arg != argc - 1 || jobs > 0)
+			usage();
+		VM vm;
+		initVM(&vm);
+		emitFile(&vm, argv[arg]);
+		freeVM(&vm);
+		return 0;
+	}
+
 	system("cls");
-	initVM();
-	if (argc == 1) {
-		REPL();
+	VM vm;
+	initVM(&vm);
+	vm.maxFrames = maxDepth;
+	vm.jitEnabled = jit;
+	vm.registerMode = registers;
+	if (arg == argc) {
+		REPL(&vm);
 	}
-	else if (argc == 2) { 
-		runFile(argv[1]);
+	else if (arg == argc - 1) { 
+		runFile(&vm, argv[arg]);
 	}
 	else {
-		fprintf(stderr, "Usage: Von [path]\n");
-		exit(64);
+		usage();
 	}
-	freeVM();
+	if (showStats)
+		printStats(&vm);
+	freeVM(&vm);
 	return 0;
 }
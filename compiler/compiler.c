@@ -6,17 +6,13 @@
 #include "compiler.h"
 #include "scanner.h"
 #include "../vm/memory.h"
+#include "../vm/vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 	#include "../vm/debug.h"
 #endif
 
-typedef struct {
-	Token current;
-	Token previous;
-	bool hadError;
-	bool panicMode;
-} Parser;
+typedef struct Parser Parser;
 
 typedef enum {
 	P_NONE,
@@ -25,6 +21,10 @@ typedef enum {
 	P_AND,
 	P_EQUALITY,
 	P_COMPARISON,
+	P_BIT_OR,
+	P_BIT_XOR,
+	P_BIT_AND,
+	P_SHIFT,
 	P_TERM,
 	P_FACTOR,
 	P_UNARY,
@@ -32,7 +32,7 @@ typedef enum {
 	P_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 typedef struct {
 	ParseFn prefix;
@@ -44,13 +44,29 @@ typedef struct {
 	Token name;
 	int depth;
 	bool isCaptured;
+	//Whether anything assigns the local after its declaration.
+	bool isAssigned;
+	//The function a fun declaration put in the local, until the local is
+	//used as anything but the callee of a call. See discardLocal().
+	ObjFunction* function;
 } Local;
 
 typedef struct {
 	uint8_t index;
 	bool isLocal;
+	//The local the upvalue captures, possibly through other upvalues.
+	Local* local;
 } Upvalue;
 
+//An upvalue of a function that has been compiled, waiting for the scope of
+//the local it captures to end, since an assignment further down would
+//still stop it being flat.
+typedef struct {
+	Local* local;
+	ObjFunction* function;
+	int index;
+} Capture;
+
 typedef enum {
 	TYPE_FUNCTION,
 	TYPE_INITIALIZER,
@@ -66,6 +82,7 @@ typedef struct Compiler {
 	int localCount;
 	Upvalue upvalues[UINT8_COUNT];
 	int scopeDepth;
+	int lastCall;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -73,184 +90,304 @@ typedef struct ClassCompiler {
 	bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler* current = NULL;
-Chunk* compilingChunk;
-ClassCompiler* currentClass = NULL;
+//All compiler state for one compile() call. The VM points at it while
+//compiling so the collector can find the functions under construction.
+struct Parser {
+	VM* vm;
+	Scanner scanner;
+	Token current;
+	Token previous;
+	bool hadError;
+	bool panicMode;
+	Compiler* compiler;
+	ClassCompiler* classCompiler;
+	Capture* captures;
+	int captureCount;
+	int captureCapacity;
+};
 
-static Chunk* currentChunk() {
-	return &current -> function -> chunk;
+static Chunk* currentChunk(Parser* parser) {
+	return &parser -> compiler -> function -> chunk;
 }
 
-static void errorAt(Token* token, const char* message) {
-	if (parser.panicMode) 
+static void errorAt(Parser* parser, Token* token, const char* message) {
+	if (parser -> panicMode) 
 		return;
-	parser.panicMode = true;
-	fprintf(stderr, "[line %d] Error", token->line);
+	parser -> panicMode = true;
+	fprintf(parser -> vm -> err, "[line %d] Error", token->line);
 	if (token -> type == T_EOF) {
-		fprintf(stderr, " at end");
+		fprintf(parser -> vm -> err, " at end");
 	}
-	else if (token -> type = T_ERROR) {}
+	else if (token -> type == T_ERROR) {}
 	else {
-		fprintf(stderr, " at '%.*s'", token -> length, token -> start);
+		fprintf(parser -> vm -> err, " at '%.*s'", token -> length, token -> start);
 	}
-	fprintf(stderr, ": %s\n", message);
-	parser.hadError = true;
+	fprintf(parser -> vm -> err, ": %s\n", message);
+	parser -> hadError = true;
 }
 
-static void error(const char* message) {
-	errorAt(&parser.previous, message);
+static void error(Parser* parser, const char* message) {
+	errorAt(parser, &parser -> previous, message);
 }
 
-static void errorAtCurrent(const char* message) {
-	errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+	errorAt(parser, &parser -> current, message);
 }
 
-static void advance() {
-	parser.previous = parser.current;
+static void advance(Parser* parser) {
+	parser -> previous = parser -> current;
 	for (;;) {
-		parser.current = scanToken();
-		if (parser.current.type != T_ERROR)
+		parser -> current = scanToken(&parser -> scanner);
+		if (parser -> current.type != T_ERROR)
 			break;
-		errorAtCurrent(parser.current.start);
+		errorAtCurrent(parser, parser -> current.start);
 	}
 }
 
-static void consume(TokenType type, const char* message) {
-	if (parser.current.type == type) {
-		advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+	if (parser -> current.type == type) {
+		advance(parser);
 		return;
 	}
-	errorAtCurrent(message);
+	errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type) {
-	return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+	return parser -> current.type == type;
 }
 
-static bool match(TokenType type) {
-	if (!check(type))
+static bool match(Parser* parser, TokenType type) {
+	if (!check(parser, type))
 		return false;
-	advance();
+	advance(parser);
 	return true;
 }
 
-static void emitByte(uint8_t byte) {
-	writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+	writeChunk(parser -> vm, currentChunk(parser), byte, parser -> previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-	emitByte(byte1);
-	emitByte(byte2);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+	emitByte(parser, byte1);
+	emitByte(parser, byte2);
 }
 
-static void emitLoop(int loopStart) {
-	emitByte(OP_LOOP);
+static void emitLoop(Parser* parser, int loopStart) {
+	emitByte(parser, OP_LOOP);
 	
-	int offset = currentChunk() -> count - loopStart + 2;
+	int offset = currentChunk(parser) -> count - loopStart + 2;
 	if (offset > UINT16_MAX) 
-		error("Loop body too large");
-	emitByte((offset >> 8) & 0xff);
-	emitByte(offset & 0xff);
+		error(parser, "Loop body too large");
+	emitByte(parser, (offset >> 8) & 0xff);
+	emitByte(parser, offset & 0xff);
 }
 
-static void emitReturn() {
-	if (current -> type == TYPE_INITIALIZER) {
-		emitBytes(OP_GET_LOCAL, 0);
+static void emitReturn(Parser* parser) {
+	if (parser -> compiler -> type == TYPE_INITIALIZER) {
+		emitBytes(parser, OP_GET_LOCAL, 0);
 	}
 	else {
-		emitByte(OP_NIL);
+		emitByte(parser, OP_NIL);
 	}
-	emitByte(OP_RETURN);
-	emitByte(OP_NIL);
+	emitByte(parser, OP_RETURN);
 }
 
-static int emitJump(uint8_t instruction) {
-	emitByte(instruction);
-	emitByte(0xff);
-	emitByte(0xff);
-	return currentChunk() -> count - 2;
+static int emitJump(Parser* parser, uint8_t instruction) {
+	emitByte(parser, instruction);
+	emitByte(parser, 0xff);
+	emitByte(parser, 0xff);
+	return currentChunk(parser) -> count - 2;
 }
 
-static uint8_t makeConstant(Value value) {
-	int constant = addConstant(currentChunk(), value);
+static uint8_t makeConstant(Parser* parser, Value value) {
+	int constant = addConstant(parser -> vm, currentChunk(parser), value);
 	if (constant > UINT8_MAX) {
-		error("Too many constants in one chunk.");
+		error(parser, "Too many constants in one chunk.");
 		return 0;
 	}
 	return (uint8_t)constant;
 }
 
-static void emitConstant(Value value) {
-	emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitConstant(Parser* parser, Value value) {
+	emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
 }
 
-static void patchJump(int offset) {
-	int jump = currentChunk() -> count - offset - 2;
+static void patchJump(Parser* parser, int offset) {
+	int jump = currentChunk(parser) -> count - offset - 2;
 	if (jump > UINT16_MAX) {
-		error("Too much code to jump over.");
+		error(parser, "Too much code to jump over.");
 	}
-	currentChunk() -> code[offset] = (jump >> 8) & 0xff;
-	currentChunk() -> code[offset + 1] = jump & 0xff;
+	currentChunk(parser) -> code[offset] = (jump >> 8) & 0xff;
+	currentChunk(parser) -> code[offset + 1] = jump & 0xff;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
-	compiler -> enclosing = current;
+static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type) {
+	compiler -> enclosing = parser -> compiler;
 	compiler -> function = NULL;
 	compiler -> type = type;
 	compiler -> localCount = 0;
 	compiler -> scopeDepth = 0;
-	compiler -> function = newFunction();
-	current = compiler;
+	compiler -> lastCall = -1;
+	compiler -> function = newFunction(parser -> vm);
+	parser -> compiler = compiler;
 
 	if (type != TYPE_SCRIPT) {
-		current -> function -> name = copyString(parser.previous.start, parser.previous.length);
+		parser -> compiler -> function -> name = copyString(parser -> vm, parser -> previous.start, parser -> previous.length);
 	}
 
-	Local* local = &current -> locals[current -> localCount++];
+	Local* local = &parser -> compiler -> locals[parser -> compiler -> localCount++];
 	local -> depth = 0;
 	local -> isCaptured = false;
+	local -> isAssigned = false;
+	local -> function = NULL;
 	if (type != TYPE_FUNCTION) {
 		local -> name.start = "this";
 		local -> name.length = 4;
 	}
 	else {
 		local -> name.start = "";
-		local -> name.start = 0;
+		local -> name.length = 0;
 	}
 }
 
-static ObjFunction* endCompiler() {
-	emitReturn();
-	ObjFunction* function = current -> function;
+//The argument count operand of a call instruction, or 0.
+static int callArgCount(Chunk* chunk, int offset) {
+	switch (chunk -> code[offset]) {
+		case OP_CALL:
+		case OP_TAIL_CALL:
+			return chunk -> code[offset + 1];
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+			return chunk -> code[offset + 2];
+		default:
+			return 0;
+	}
+}
+
+//The most stack slots a call can use, counting from the callee's own slot.
+//Heights are carried along forward jumps, which is enough because loops
+//always come back to the height they started at.
+static int maxStackDepth(Parser* parser, ObjFunction* function) {
+	Chunk* chunk = &function -> chunk;
+	int* heights = ALLOCATE(parser -> vm, int, chunk -> count + 1);
+	for (int i = 0; i <= chunk -> count; i++) {
+		heights[i] = -1;
+	}
+	int height = function -> arity + 1;
+	int max = height;
+	for (int offset = 0; offset < chunk -> count; offset += instructionLength(chunk, offset)) {
+		if (heights[offset] != -1)
+			height = heights[offset];
+		height += stackEffect(chunk -> code[offset], callArgCount(chunk, offset));
+		if (height > max)
+			max = height;
+		uint8_t instruction = chunk -> code[offset];
+		if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE) {
+			int jump = (chunk -> code[offset + 1] << 8) | chunk -> code[offset + 2];
+			heights[offset + 3 + jump] = height;
+		}
+	}
+	FREE_ARRAY(parser -> vm, int, heights, chunk -> count + 1);
+	return max;
+}
+
+//Settles what the compiler could not know while the local was in scope.
+//
+//Escape analysis for local functions. A closure that was only ever called
+//while its local was in scope cannot have been stored, captured or
+//compared, so nothing can tell one such closure from another. Without
+//upvalues they are all the same, and OP_CLOSURE can hand out one shared
+//closure instead of allocating each time.
+//
+//Flat closures. A captured local that nothing assigns holds the same
+//value for as long as any closure can see it, so closures can copy it
+//rather than share it through an ObjUpvalue.
+static void discardLocal(Parser* parser, Local* local) {
+	if (local -> function != NULL && local -> function -> upvalueCount == 0)
+		local -> function -> sharesClosure = true;
+	int kept = 0;
+	for (int i = 0; i < parser -> captureCount; i++) {
+		Capture* capture = &parser -> captures[i];
+		if (capture -> local != local)
+			parser -> captures[kept++] = *capture;
+		else if (!local -> isAssigned)
+			capture -> function -> flatUpvalues[capture -> index] = true;
+	}
+	parser -> captureCount = kept;
+}
+
+static void addCapture(Parser* parser, Local* local, ObjFunction* function, int index) {
+	if (parser -> captureCount == parser -> captureCapacity) {
+		int oldCapacity = parser -> captureCapacity;
+		parser -> captureCapacity = GROW_CAPACITY(oldCapacity);
+		parser -> captures = GROW_ARRAY(parser -> vm, Capture, parser -> captures, oldCapacity, parser -> captureCapacity);
+	}
+	Capture* capture = &parser -> captures[parser -> captureCount++];
+	capture -> local = local;
+	capture -> function = function;
+	capture -> index = index;
+}
+
+static ObjFunction* endCompiler(Parser* parser) {
+	emitReturn(parser);
+	Compiler* compiler = parser -> compiler;
+	for (int i = 0; i < compiler -> localCount; i++) {
+		discardLocal(parser, &compiler -> locals[i]);
+	}
+	compiler -> function -> flatUpvalues = ALLOCATE(parser -> vm, bool, compiler -> function -> upvalueCount);
+	for (int i = 0; i < compiler -> function -> upvalueCount; i++) {
+		compiler -> function -> flatUpvalues[i] = false;
+		addCapture(parser, compiler -> upvalues[i].local, compiler -> function, i);
+	}
+	ObjFunction* function = parser -> compiler -> function;
+	if (!parser -> hadError)
+		function -> maxSlots = maxStackDepth(parser, function);
 #ifdef DEBUG_PRINT_CODE
-	if (!parser.hadError) {
-		disassembleChunk(currentChunk(), function -> name != NULL ? function -> name -> chars : "<script>");
+	if (!parser -> hadError) {
+		disassembleChunk(parser -> vm, currentChunk(parser), function -> name != NULL ? function -> name -> chars : "<script>");
 	}
 #endif
-	current = current -> enclosing;
+	parser -> compiler = parser -> compiler -> enclosing;
 	return function;
 }
 
-static void beginScope() {
-	current -> scopeDepth++;
+static void beginScope(Parser* parser) {
+	parser -> compiler -> scopeDepth++;
 }
 
-static void endScope() {
-	current -> scopeDepth--;
-	while (current -> localCount > 0 && current -> locals[current -> localCount - 1].depth > current -> scopeDepth) {
-		if (current -> locals[current -> localCount - 1].isCaptured) {
-			emitByte(OP_CLOSE_UPVALUE);
+static void endScope(Parser* parser) {
+	parser -> compiler -> scopeDepth--;
+	while (parser -> compiler -> localCount > 0 && parser -> compiler -> locals[parser -> compiler -> localCount - 1].depth > parser -> compiler -> scopeDepth) {
+		Local* local = &parser -> compiler -> locals[parser -> compiler -> localCount - 1];
+		//Only assigned locals are captured through an ObjUpvalue.
+		if (local -> isCaptured && local -> isAssigned) {
+			emitByte(parser, OP_CLOSE_UPVALUE);
 		}
 		else {
-			emitByte(OP_POP);
+			emitByte(parser, OP_POP);
 		}
-		current -> localCount--;
+		discardLocal(parser, local);
+		parser -> compiler -> localCount--;
+	}
+}
+
+static uint8_t identifierConstant(Parser* parser, Token* name) {
+	return makeConstant(parser, OBJ_VAL(copyString(parser -> vm, name -> start, name -> length)));
+}
+
+static int globalVariable(Parser* parser, Token* name) {
+	int slot = globalSlot(parser -> vm, copyString(parser -> vm, name -> start, name -> length));
+	if (slot > UINT16_MAX) {
+		error(parser, "Too many global variables.");
+		return 0;
 	}
+	return slot;
 }
 
-static uint8_t identifierConstant(Token* name) {
-	return makeConstant(OBJ_VAL(copyString(name -> start, name -> length)));
+static void emitGlobal(Parser* parser, uint8_t instruction, int slot) {
+	emitByte(parser, instruction);
+	emitByte(parser, (slot >> 8) & 0xff);
+	emitByte(parser, slot & 0xff);
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -259,12 +396,12 @@ static bool identifiersEqual(Token* a, Token* b) {
 	return memcmp(a -> start, b -> start, a -> length) == 0;
 }
 
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
 	for (int i = compiler -> localCount - 1; i >= 0; i--) {
 		Local* local = &compiler -> locals[i];
 		if (identifiersEqual(name, &local -> name)) {
 			if (local -> depth == -1) {
-				error("Can't read local variable in its own initializer.");
+				error(parser, "Can't read local variable in its own initializer.");
 			}
 			return i;
 		}
@@ -272,7 +409,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
 	return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Parser* parser, Compiler* compiler, uint8_t index, bool isLocal, Local* local) {
 	int upvalueCount = compiler -> function -> upvalueCount;
 
 	for (int i = 0; i < upvalueCount; i++) {
@@ -283,240 +420,277 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
 	}
 
 	if (upvalueCount == UINT8_COUNT) {
-		error("Too many closure variables in function.");
+		error(parser, "Too many closure variables in function.");
 		return 0;
 	}
 
 	compiler -> upvalues[upvalueCount].isLocal = isLocal;
 	compiler -> upvalues[upvalueCount].index = index;
+	compiler -> upvalues[upvalueCount].local = local;
 	return compiler -> function -> upvalueCount++;
 }
 
-static int resolveUpvalue(Compiler* compiler, Token* name) {
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name) {
 	if (compiler -> enclosing == NULL)
 		return -1;
-	int local = resolveLocal(compiler -> enclosing, name);
+	int local = resolveLocal(parser, compiler -> enclosing, name);
 	if (local != -1) {
 		compiler -> enclosing -> locals[local].isCaptured = true;
-		return addUpvalue(compiler, (uint8_t)local, true);
+		compiler -> enclosing -> locals[local].function = NULL;
+		return addUpvalue(parser, compiler, (uint8_t)local, true, &compiler -> enclosing -> locals[local]);
 	}
 
-	int upvalue = resolveUpvalue(compiler -> enclosing, name);
+	int upvalue = resolveUpvalue(parser, compiler -> enclosing, name);
 	if (upvalue != -1) {
-		return addUpvalue(compiler, (uint8_t)upvalue, false);
+		return addUpvalue(parser, compiler, (uint8_t)upvalue, false, compiler -> enclosing -> upvalues[upvalue].local);
 	}
 	return -1;
 }
 
-static void addLocal(Token name) {
-	if (current -> localCount == UINT8_COUNT) {
-		error("Too many local variables in function.");
+static void addLocal(Parser* parser, Token name) {
+	if (parser -> compiler -> localCount == UINT8_COUNT) {
+		error(parser, "Too many local variables in function.");
 		return;
 	}
-	Local* local = &current -> locals[current -> localCount++];
+	Local* local = &parser -> compiler -> locals[parser -> compiler -> localCount++];
 	local -> name = name;
 	local -> depth = -1;
 	local -> isCaptured = false;
+	local -> isAssigned = false;
+	local -> function = NULL;
 }
 
-static void declareVariable() {
-	if (current -> scopeDepth == 0)
+static void declareVariable(Parser* parser) {
+	if (parser -> compiler -> scopeDepth == 0)
 		return;
-	Token* name = &parser.previous;
-	for (int i = current -> localCount - 1; i >= 0; i--) {
-		Local* local = &current -> locals[i];
-		if (local -> depth != -1 && local -> depth < current -> scopeDepth) {
+	Token* name = &parser -> previous;
+	for (int i = parser -> compiler -> localCount - 1; i >= 0; i--) {
+		Local* local = &parser -> compiler -> locals[i];
+		if (local -> depth != -1 && local -> depth < parser -> compiler -> scopeDepth) {
 			break;
 		}
 		if (identifiersEqual(name, &local -> name)) {
-			error("Already variable with this name in this scope.");
+			error(parser, "Already variable with this name in this scope.");
 		}
 	}
-	addLocal(*name);
+	addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
-	consume(T_IDENTIFIER, errorMessage);
-	declareVariable();
-	if (current -> scopeDepth > 0)
+static int parseVariable(Parser* parser, const char* errorMessage) {
+	consume(parser, T_IDENTIFIER, errorMessage);
+	declareVariable(parser);
+	if (parser -> compiler -> scopeDepth > 0)
 		return 0;
-	return identifierConstant(&parser.previous);
+	return globalVariable(parser, &parser -> previous);
 }
 
-static void markInitialized() {
-	if (current -> scopeDepth == 0)
+static void markInitialized(Parser* parser) {
+	if (parser -> compiler -> scopeDepth == 0)
 		return;
-	current -> locals[current -> localCount - 1].depth = current -> scopeDepth;
+	parser -> compiler -> locals[parser -> compiler -> localCount - 1].depth = parser -> compiler -> scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
-	if (current -> scopeDepth > 0) {
-		markInitialized();
+static void defineVariable(Parser* parser, int global) {
+	if (parser -> compiler -> scopeDepth > 0) {
+		markInitialized(parser);
 		return;	
 	}
-	emitBytes(OP_DEFINE_GLOBAL, global);
+	emitGlobal(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser* parser, Precedence precedence);
 
-static uint8_t argumentList() {
+static uint8_t argumentList(Parser* parser) {
 	uint8_t argCount = 0;
-	if (!check(T_RIGHT_PAREN)) {
+	if (!check(parser, T_RIGHT_PAREN)) {
 		do {
-			expression();
+			expression(parser);
 			if (argCount == 255) {
-				error("Can't have more than 255 arguments.");
+				error(parser, "Can't have more than 255 arguments.");
 			}
 			argCount++;
-		} while (match(T_COMMA));
+		} while (match(parser, T_COMMA));
 	}
-	consume(T_RIGHT_PAREN, "Expect ')' after arguments.");
+	consume(parser, T_RIGHT_PAREN, "Expect ')' after arguments.");
 	return argCount;
 }
 
-static void or_operator(bool canAssign) {
-	int elseJump = emitJump(OP_JUMP_IF_FALSE);
-	int endJump = emitJump(OP_JUMP);
+static void or_operator(Parser* parser, bool canAssign) {
+	int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+	int endJump = emitJump(parser, OP_JUMP);
 
-	patchJump(elseJump);
-	emitByte(OP_POP);
+	patchJump(parser, elseJump);
+	emitByte(parser, OP_POP);
 
-	parsePrecedence(P_OR);
-	patchJump(endJump);
+	parsePrecedence(parser, P_OR);
+	patchJump(parser, endJump);
 }
 
-static void and_operator(bool canAssign) {
-	int endJump = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
-	parsePrecedence(P_AND);
-	patchJump(endJump);
+static void and_operator(Parser* parser, bool canAssign) {
+	int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+	emitByte(parser, OP_POP);
+	parsePrecedence(parser, P_AND);
+	patchJump(parser, endJump);
 }
 
 
-static void binary(bool canAssign) {
-	TokenType operatorType = parser.previous.type;
+static void binary(Parser* parser, bool canAssign) {
+	TokenType operatorType = parser -> previous.type;
 	ParseRule* rule = getRule(operatorType);
-	parsePrecedence((Precedence)(rule -> precedence + 1));
+	parsePrecedence(parser, (Precedence)(rule -> precedence + 1));
 	switch (operatorType) {
 		case T_PLUS:
-			emitByte(OP_ADD);
+			emitByte(parser, OP_ADD);
 			break;
 		case T_MINUS:
-			emitByte(OP_SUBTRACT);
+			emitByte(parser, OP_SUBTRACT);
 			break;
 		case T_STAR:
-			emitByte(OP_MULTIPLY);
+			emitByte(parser, OP_MULTIPLY);
 			break;
 		case T_SLASH:
-			emitByte(OP_DIVIDE);
+			emitByte(parser, OP_DIVIDE);
+			break;
+		case T_PERCENT:
+			emitByte(parser, OP_MODULO);
+			break;
+		case T_AMPERSAND:
+			emitByte(parser, OP_BIT_AND);
+			break;
+		case T_PIPE:
+			emitByte(parser, OP_BIT_OR);
+			break;
+		case T_CARET:
+			emitByte(parser, OP_BIT_XOR);
+			break;
+		case T_LESS_LESS:
+			emitByte(parser, OP_SHIFT_LEFT);
+			break;
+		case T_GREATER_GREATER:
+			emitByte(parser, OP_SHIFT_RIGHT);
 			break;
 		case T_BANG_EQUAL:
-			emitBytes(OP_EQUAL, OP_NOT);
+			emitBytes(parser, OP_EQUAL, OP_NOT);
 			break;
 		case T_EQUAL_EQUAL:
-			emitByte(OP_EQUAL);
+			emitByte(parser, OP_EQUAL);
 			break;
 		case T_GREATER:
-			emitByte(OP_GREATER);
+			emitByte(parser, OP_GREATER);
 			break;
 		case T_GREATER_EQUAL:
-			emitBytes(OP_LESS, OP_NOT);
+			emitBytes(parser, OP_LESS, OP_NOT);
 			break;
 		case T_LESS:
-			emitByte(OP_LESS);
+			emitByte(parser, OP_LESS);
 			break;
 		case T_LESS_EQUAL:
-			emitBytes(OP_GREATER, OP_NOT);
+			emitBytes(parser, OP_GREATER, OP_NOT);
 			break;	
 		default:
 			return;
 	}
 }
 
-static void call(bool canAssign) {
-	uint8_t argCount = argumentList();
-	emitBytes(OP_CALL, argCount);
+static void call(Parser* parser, bool canAssign) {
+	uint8_t argCount = argumentList(parser);
+	parser -> compiler -> lastCall = currentChunk(parser) -> count;
+	emitBytes(parser, OP_CALL, argCount);
 }
 
-static void dot(bool canAssign) {
-	consume(T_IDENTIFIER, "Expect property name after '.'.");
-	uint8_t name = identifierConstant(&parser.previous);
+static void dot(Parser* parser, bool canAssign) {
+	consume(parser, T_IDENTIFIER, "Expect property name after '.'.");
+	uint8_t name = identifierConstant(parser, &parser -> previous);
 
-	if (canAssign && match(T_EQUAL)) {
-		expression();
-		emitBytes(OP_SET_PROPERTY, name);
+	if (canAssign && match(parser, T_EQUAL)) {
+		expression(parser);
+		emitBytes(parser, OP_SET_PROPERTY, name);
 	}
-	else if (match(T_LEFT_PAREN)) {
-		uint8_t argCount = argumentList();
-		emitBytes(OP_INVOKE, name);
-		emitByte(argCount);
+	else if (match(parser, T_LEFT_PAREN)) {
+		uint8_t argCount = argumentList(parser);
+		emitBytes(parser, OP_INVOKE, name);
+		emitByte(parser, argCount);
 	}
 	else {
-		emitBytes(OP_GET_PROPERTY, name);
+		emitBytes(parser, OP_GET_PROPERTY, name);
 	}
 }
 
-static void literal(bool canAssign) {
-	switch(parser.previous.type) {
+static void literal(Parser* parser, bool canAssign) {
+	switch(parser -> previous.type) {
 		case T_FALSE:
-			emitByte(OP_FALSE);
+			emitByte(parser, OP_FALSE);
 			break;
 		case T_NIL:
-			emitByte(OP_NIL);
+			emitByte(parser, OP_NIL);
 			break;
 		case T_TRUE:
-			emitByte(OP_TRUE);
+			emitByte(parser, OP_TRUE);
 			break;
 		default:
 			return;
 	}
 }
 
-static void grouping(bool canAssign) {
-	expression();
-	consume(T_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool canAssign) {
+	expression(parser);
+	consume(parser, T_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(bool canAssign) {
-	double value = strtod(parser.previous.start, NULL);
-	emitConstant(NUMBER_VAL(value));
+static void number(Parser* parser, bool canAssign) {
+	double value = strtod(parser -> previous.start, NULL);
+	emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void string(bool canAssign) {
-	emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+static void string(Parser* parser, bool canAssign) {
+	emitConstant(parser, copyStringValue(parser -> vm, parser -> previous.start + 1, parser -> previous.length - 2));
 }
 
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
 	uint8_t getOp, setOp;
-	int arg = resolveLocal(current, &name);
+	int arg = resolveLocal(parser, parser -> compiler, &name);
 	if (arg != -1) {
 		getOp = OP_GET_LOCAL;
 		setOp = OP_SET_LOCAL;
+		//Calls bind tighter than anything else, so a '(' here always
+		//calls the local.
+		if (!check(parser, T_LEFT_PAREN))
+			parser -> compiler -> locals[arg].function = NULL;
 	}
-	else if ((arg = resolveUpvalue(current, &name)) != 1) {
+	else if ((arg = resolveUpvalue(parser, parser -> compiler, &name)) != -1) {
 		getOp = OP_GET_UPVALUE;
 		setOp = OP_SET_UPVALUE;
 	}
 	else {
-		arg = identifierConstant(&name);
-		getOp = OP_GET_LOCAL;
-		setOp = OP_SET_LOCAL;
-	}
-	if (canAssign && match(T_EQUAL)) {
-		expression();
-		emitBytes(setOp, (uint8_t)arg);
+		arg = globalVariable(parser, &name);
+		getOp = OP_GET_GLOBAL;
+		setOp = OP_SET_GLOBAL;
+	}
+	if (canAssign && match(parser, T_EQUAL)) {
+		if (setOp == OP_SET_LOCAL)
+			parser -> compiler -> locals[arg].isAssigned = true;
+		else if (setOp == OP_SET_UPVALUE)
+			parser -> compiler -> upvalues[arg].local -> isAssigned = true;
+		expression(parser);
+		if (setOp == OP_SET_GLOBAL)
+			emitGlobal(parser, setOp, arg);
+		else
+			emitBytes(parser, setOp, (uint8_t)arg);
 	}
 	else {
-		emitBytes(getOp, (uint8_t)arg);
+		if (getOp == OP_GET_GLOBAL)
+			emitGlobal(parser, getOp, arg);
+		else
+			emitBytes(parser, getOp, (uint8_t)arg);
 	}
 }
 
-static void variable(bool canAssign) {
-	namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+	namedVariable(parser, parser -> previous, canAssign);
 }
 
 static Token syntheticToken(const char* text) {
@@ -526,47 +700,47 @@ static Token syntheticToken(const char* text) {
 	return token;
 }	
 
-static void super_keyword(bool canAssign) {
-	if (currentClass == NULL) {
-		error("Can't use 'super' outside of a class.");
+static void super_keyword(Parser* parser, bool canAssign) {
+	if (parser -> classCompiler == NULL) {
+		error(parser, "Can't use 'super' outside of a class.");
 	}
-	else if (!currentClass -> hasSuperclass) {
-		error("Can't use 'super' in a class with no superclass.");
+	else if (!parser -> classCompiler -> hasSuperclass) {
+		error(parser, "Can't use 'super' in a class with no superclass.");
 	}
-	consume(T_DOT, "Expect '.' after 'super'.");
-	consume(T_IDENTIFIER, "Expect superclass method name.");
-	uint8_t name = identifierConstant(&parser.previous);
+	consume(parser, T_DOT, "Expect '.' after 'super'.");
+	consume(parser, T_IDENTIFIER, "Expect superclass method name.");
+	uint8_t name = identifierConstant(parser, &parser -> previous);
 
-	namedVariable(syntheticToken("this"), false);
-	if (match(T_LEFT_PAREN)) {
-		uint8_t argCount = argumentList();
-		namedVariable(syntheticToken("super"), false);
-		emitBytes(OP_SUPER_INVOKE, name);
-		emitByte(argCount);
+	namedVariable(parser, syntheticToken("this"), false);
+	if (match(parser, T_LEFT_PAREN)) {
+		uint8_t argCount = argumentList(parser);
+		namedVariable(parser, syntheticToken("super"), false);
+		emitBytes(parser, OP_SUPER_INVOKE, name);
+		emitByte(parser, argCount);
 	}
 	else {
-		namedVariable(syntheticToken("super"), false);
-		emitBytes(OP_GET_SUPER, name);
+		namedVariable(parser, syntheticToken("super"), false);
+		emitBytes(parser, OP_GET_SUPER, name);
 	}
 }
 
-static void this_variable(bool canAssign) {
-	if (currentClass == NULL) {
-		error("Can't use 'this' outside of a class.");
+static void this_variable(Parser* parser, bool canAssign) {
+	if (parser -> classCompiler == NULL) {
+		error(parser, "Can't use 'this' outside of a class.");
 		return;
 	}
-	variable(false);
+	variable(parser, false);
 }
 
-static void unary(bool canAssign) {
-	TokenType operatorType = parser.previous.type;
-	parsePrecedence(P_UNARY);
+static void unary(Parser* parser, bool canAssign) {
+	TokenType operatorType = parser -> previous.type;
+	parsePrecedence(parser, P_UNARY);
 	switch(operatorType) {
 		case T_MINUS: 
-			emitByte(OP_NEGATE);
+			emitByte(parser, OP_NEGATE);
 			break;
 		case T_BANG:
-			emitByte(OP_NOT);
+			emitByte(parser, OP_NOT);
 			break;
 		default:
 			return;
@@ -574,7 +748,7 @@ static void unary(bool canAssign) {
 }
 
 ParseRule rules[] = {
-	[T_LEFT_PAREN] = {grouping, call, P_NONE},
+	[T_LEFT_PAREN] = {grouping, call, P_CALL},
 	[T_RIGHT_PAREN] = {NULL, NULL, P_NONE},
 	[T_LEFT_BRACE] = {NULL, NULL, P_NONE},
 	[T_RIGHT_BRACE] = {NULL, NULL, P_NONE},	
@@ -585,6 +759,12 @@ ParseRule rules[] = {
 	[T_SEMI_COLON] = {NULL, NULL, P_NONE},	
 	[T_SLASH] = {NULL, binary, P_FACTOR},	
 	[T_STAR] = {NULL, binary, P_FACTOR},	
+	[T_PERCENT] = {NULL, binary, P_FACTOR},
+	[T_AMPERSAND] = {NULL, binary, P_BIT_AND},
+	[T_PIPE] = {NULL, binary, P_BIT_OR},
+	[T_CARET] = {NULL, binary, P_BIT_XOR},
+	[T_LESS_LESS] = {NULL, binary, P_SHIFT},
+	[T_GREATER_GREATER] = {NULL, binary, P_SHIFT},
 	[T_EQUAL] = {NULL, NULL, P_NONE},
 	[T_EQUAL_EQUAL] = {NULL, binary, P_EQUALITY},
 	[T_BANG] = {unary, NULL, P_NONE},	
@@ -596,7 +776,7 @@ ParseRule rules[] = {
 	[T_IDENTIFIER] = {variable, NULL, P_NONE},	
 	[T_STRING] = {string, NULL, P_NONE},	
 	[T_NUMBER] = {number, NULL, P_NONE},	
-	[T_AND] = {NULL, and_operator, P_NONE},	
+	[T_AND] = {NULL, and_operator, P_AND},	
 	[T_CLASS] = {NULL, NULL, P_NONE},	
 	[T_ELSE] = {NULL, NULL, P_NONE},	
 	[T_FALSE] = {literal, NULL, P_NONE},	
@@ -604,12 +784,12 @@ ParseRule rules[] = {
 	[T_FUN] = {NULL, NULL, P_NONE},	
 	[T_IF] = {NULL, NULL, P_NONE},	
 	[T_NIL] = {literal, NULL, P_NONE},	
-	[T_OR] = {NULL, or_operator, P_NONE},	
+	[T_OR] = {NULL, or_operator, P_OR},	
 	[T_PRINT] = {NULL, NULL, P_NONE},	
 	[T_RETURN] = {NULL, NULL, P_NONE},	
 	[T_SUPER] = {super_keyword, NULL, P_NONE},	
 	[T_THIS] = {this_variable, NULL, P_NONE},	
-	[T_TRUE] = {NULL, NULL, P_NONE},	
+	[T_TRUE] = {literal, NULL, P_NONE},	
 	[T_VAR] = {NULL, NULL, P_NONE},	
 	[T_WHILE] = {NULL, NULL, P_NONE},	
 	[T_ERROR] = {NULL, NULL, P_NONE},	
@@ -623,267 +803,276 @@ static ParseRule* getRule(TokenType type) {
 	return &rules[type];
 }
 
-static void parsePrecedence(Precedence precedence) {
-	advance();
-	ParseFn prefixRule = getRule(parser.previous.type) -> prefix;
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+	advance(parser);
+	ParseFn prefixRule = getRule(parser -> previous.type) -> prefix;
 	if (prefixRule == NULL) {
-		error("Expect expression.");
+		error(parser, "Expect expression.");
 		return;
 	}
 	bool canAssign = precedence <= P_ASSIGNMENT;
-	prefixRule(canAssign);
-	while (precedence <= getRule(parser.current.type) -> precedence) {
-		advance();
-		ParseFn infixRule = getRule(parser.previous.type) -> infix;
-		infixRule(canAssign);
+	prefixRule(parser, canAssign);
+	while (precedence <= getRule(parser -> current.type) -> precedence) {
+		advance(parser);
+		ParseFn infixRule = getRule(parser -> previous.type) -> infix;
+		infixRule(parser, canAssign);
 	}
-	if (canAssign && match(T_EQUAL)) {
-		error("Invalid assignment target.");
+	if (canAssign && match(parser, T_EQUAL)) {
+		error(parser, "Invalid assignment target.");
 	}
 }
 
-static void expression() {
-	parsePrecedence(P_ASSIGNMENT);
+static void expression(Parser* parser) {
+	parsePrecedence(parser, P_ASSIGNMENT);
 }
 
-static void block() {
-	while (!check(T_RIGHT_BRACE) && !check(T_EOF)) {
-		declaration();
+static void block(Parser* parser) {
+	while (!check(parser, T_RIGHT_BRACE) && !check(parser, T_EOF)) {
+		declaration(parser);
 	}
-	consume(T_RIGHT_BRACE, "Expect '}' after block.");
+	consume(parser, T_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
+static ObjFunction* function(Parser* parser, FunctionType type) {
 	Compiler compiler;
-	initCompiler(&compiler, type);
-	beginScope();
+	initCompiler(parser, &compiler, type);
+	beginScope(parser);
 
-	consume(T_LEFT_PAREN, "Expect '(' after function name.");
-	if (!check(T_RIGHT_PAREN)) {
+	consume(parser, T_LEFT_PAREN, "Expect '(' after function name.");
+	if (!check(parser, T_RIGHT_PAREN)) {
 		do {
-			current -> function -> arity++;
-			if (current -> function -> arity > 255) {
-				errorAtCurrent("Can't have more than 255 parameters.");
+			parser -> compiler -> function -> arity++;
+			if (parser -> compiler -> function -> arity > 255) {
+				errorAtCurrent(parser, "Can't have more than 255 parameters.");
 			}
-			uint8_t constant = parseVariable("Expect parameter name.");
-			defineVariable(constant);
-		} while (match(T_COMMA));
+			int constant = parseVariable(parser, "Expect parameter name.");
+			defineVariable(parser, constant);
+		} while (match(parser, T_COMMA));
 	}		
-	consume(T_RIGHT_PAREN, "Expect ')' after paramerters.");
-	consume(T_LEFT_BRACE, "Expect '{' before function body.");
-	block();
+	consume(parser, T_RIGHT_PAREN, "Expect ')' after paramerters.");
+	consume(parser, T_LEFT_BRACE, "Expect '{' before function body.");
+	block(parser);
 
-	ObjFunction* function = endCompiler();
-	emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+	ObjFunction* function = endCompiler(parser);
+	emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
 
 	for (int i = 0; i < function -> upvalueCount; i++) {
-		emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-		emitByte(compiler.upvalues[i].index);
+		emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+		emitByte(parser, compiler.upvalues[i].index);
 	}
+	return function;
 }
 
-static void method() {
-	consume(T_IDENTIFIER, "Expect method name.");
-	uint8_t constant = identifierConstant(&parser.previous);
+static void method(Parser* parser) {
+	consume(parser, T_IDENTIFIER, "Expect method name.");
+	uint8_t constant = identifierConstant(parser, &parser -> previous);
 	FunctionType type = TYPE_METHOD;
-	if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+	if (parser -> previous.length == 4 && memcmp(parser -> previous.start, "init", 4) == 0) {
 		type = TYPE_INITIALIZER;
 	}
-	function(type);
-	emitBytes(OP_METHOD, constant);
+	function(parser, type);
+	emitBytes(parser, OP_METHOD, constant);
 }
 
-static void classDeclaration() {
-	consume(T_IDENTIFIER, "Expect class name.");
-	Token className = parser.previous;
-	uint8_t nameConstant = identifierConstant(&parser.previous);
-	declareVariable();
+static void classDeclaration(Parser* parser) {
+	consume(parser, T_IDENTIFIER, "Expect class name.");
+	Token className = parser -> previous;
+	uint8_t nameConstant = identifierConstant(parser, &parser -> previous);
+	declareVariable(parser);
 
-	emitBytes(OP_CLASS, nameConstant);
-	defineVariable(nameConstant);
+	emitBytes(parser, OP_CLASS, nameConstant);
+	defineVariable(parser, parser -> compiler -> scopeDepth > 0 ? 0 : globalVariable(parser, &className));
 
 	ClassCompiler classCompiler;
 	classCompiler.hasSuperclass = false;
-	classCompiler.enclosing = currentClass;
-	currentClass = &classCompiler;
-
-	if (match(T_LESS)) {
-		consume(T_IDENTIFIER, "Expect superclass name.");
-		variable(false);
-		if (identifiersEqual(&className, &parser.previous)) {
-			error("A class can't inherit from itself.");
+	classCompiler.enclosing = parser -> classCompiler;
+	parser -> classCompiler = &classCompiler;
+
+	if (match(parser, T_LESS)) {
+		consume(parser, T_IDENTIFIER, "Expect superclass name.");
+		variable(parser, false);
+		if (identifiersEqual(&className, &parser -> previous)) {
+			error(parser, "A class can't inherit from itself.");
 		}
-		namedVariable(className, false);
-		emitByte(OP_INHERIT);
+		beginScope(parser);
+		addLocal(parser, syntheticToken("super"));
+		defineVariable(parser, 0);
+
+		namedVariable(parser, className, false);
+		emitByte(parser, OP_INHERIT);
 		classCompiler.hasSuperclass = true;
 	}
 
-	beginScope();
-	addLocal(syntheticToken("super"));
-	defineVariable(0);
-
-	namedVariable(className, false);
-	consume(T_LEFT_BRACE, "Expect '{' before class body.");
-	while (!check(T_RIGHT_BRACE) && !check(T_EOF)) {
-		method();
+	namedVariable(parser, className, false);
+	consume(parser, T_LEFT_BRACE, "Expect '{' before class body.");
+	while (!check(parser, T_RIGHT_BRACE) && !check(parser, T_EOF)) {
+		method(parser);
 	}
-	consume(T_RIGHT_BRACE, "Expect '}' after class body.");
-	emitByte(OP_POP);
+	consume(parser, T_RIGHT_BRACE, "Expect '}' after class body.");
+	emitByte(parser, OP_POP);
 	if (classCompiler.hasSuperclass) {
-		endScope();
+		endScope(parser);
 	}
-	currentClass = currentClass -> enclosing;
+	parser -> classCompiler = parser -> classCompiler -> enclosing;
 }
 
-static void funDeclaration() {
-	uint8_t global = parseVariable("Expect function name");
-	markInitialized();
-	function(T_FUN);
-	defineVariable(global);
+static void funDeclaration(Parser* parser) {
+	int global = parseVariable(parser, "Expect function name");
+	markInitialized(parser);
+	ObjFunction* declared = function(parser, TYPE_FUNCTION);
+	if (parser -> compiler -> scopeDepth > 0)
+		parser -> compiler -> locals[parser -> compiler -> localCount - 1].function = declared;
+	defineVariable(parser, global);
 }
 
-static void varDeclaration() {
-	uint32_t global = parseVariable("Expect variable name");
-	if (match(T_EQUAL)) {
-		expression();
+static void varDeclaration(Parser* parser) {
+	int global = parseVariable(parser, "Expect variable name");
+	if (match(parser, T_EQUAL)) {
+		expression(parser);
 	}
 	else {
-		emitByte(OP_NIL);
+		emitByte(parser, OP_NIL);
 	}
-	consume(T_SEMI_COLON, "Expect ';' after variable declaration");
-	defineVariable(global);
+	consume(parser, T_SEMI_COLON, "Expect ';' after variable declaration");
+	defineVariable(parser, global);
 }
 
-static void expressionStatement() {
-	expression();
-	consume(T_SEMI_COLON, "Expect ';' after expression.");
-	emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+	expression(parser);
+	consume(parser, T_SEMI_COLON, "Expect ';' after expression.");
+	emitByte(parser, OP_POP);
 }
 
-static void forStatement() {
-	beginScope();
-	consume(T_LEFT_PAREN, "Expect '(' after 'for'.");
-	if (match(T_SEMI_COLON)) {
+static void forStatement(Parser* parser) {
+	beginScope(parser);
+	consume(parser, T_LEFT_PAREN, "Expect '(' after 'for'.");
+	if (match(parser, T_SEMI_COLON)) {
 		
 	}
-	else if (match(T_VAR)) {
-		varDeclaration();
+	else if (match(parser, T_VAR)) {
+		varDeclaration(parser);
 	}	
 	else {
-		expressionStatement();
+		expressionStatement(parser);
 	}
-	int loopStart = currentChunk() -> count;
+	int loopStart = currentChunk(parser) -> count;
 	int exitJump = -1;
 
-	if (!match(T_SEMI_COLON)) {
-		expression();
-		consume(T_SEMI_COLON, "Expect ';' after loop condition.");
-		exitJump = emitJump(OP_JUMP_IF_FALSE);
-		emitByte(OP_POP);
+	if (!match(parser, T_SEMI_COLON)) {
+		expression(parser);
+		consume(parser, T_SEMI_COLON, "Expect ';' after loop condition.");
+		exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+		emitByte(parser, OP_POP);
 	}
 
-	if (!match(T_RIGHT_PAREN)) {
-		int bodyJump = emitJump(OP_JUMP);
-		int incrementStart = currentChunk() -> count;
-		expression();
-		emitByte(OP_POP);
-		consume(T_RIGHT_PAREN, "Expect ')' after for clauses.");
+	if (!match(parser, T_RIGHT_PAREN)) {
+		int bodyJump = emitJump(parser, OP_JUMP);
+		int incrementStart = currentChunk(parser) -> count;
+		expression(parser);
+		emitByte(parser, OP_POP);
+		consume(parser, T_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-		emitLoop(loopStart);
+		emitLoop(parser, loopStart);
 		loopStart = incrementStart;
-		patchJump(bodyJump);
+		patchJump(parser, bodyJump);
 	}
 	
-	statement();
+	statement(parser);
 	
-	emitLoop(loopStart);
+	emitLoop(parser, loopStart);
 	
 	if (exitJump != -1) {
-		patchJump(exitJump);
-		emitByte(OP_POP);
+		patchJump(parser, exitJump);
+		emitByte(parser, OP_POP);
 	}
 	
-	endScope();	
+	endScope(parser);	
 }
 
-static void switchStatement() {
-	consume(T_LEFT_PAREN, "Expect '(' after 'switch'.");
-	expression();
-	consume(T_RIGHT_PAREN, "Expect ')' after condition.");
+static void switchStatement(Parser* parser) {
+	consume(parser, T_LEFT_PAREN, "Expect '(' after 'switch'.");
+	expression(parser);
+	consume(parser, T_RIGHT_PAREN, "Expect ')' after condition.");
 
-	consume(T_LEFT_BRACE, "Expect '{'.");
-	if (!match(T_RIGHT_BRACE)) {
-		if (match(T_CASE)) {
-			expression();
-			consume(T_COLON, "Expect ':' after expression.");
-			statement();
+	consume(parser, T_LEFT_BRACE, "Expect '{'.");
+	if (!match(parser, T_RIGHT_BRACE)) {
+		if (match(parser, T_CASE)) {
+			expression(parser);
+			consume(parser, T_COLON, "Expect ':' after expression.");
+			statement(parser);
 		}
-		else if (match(T_DEFAULT)) {
-			statement();
+		else if (match(parser, T_DEFAULT)) {
+			statement(parser);
 		}
 		else 
-			consume(T_RIGHT_BRACE, "Expect '}.");
+			consume(parser, T_RIGHT_BRACE, "Expect '}.");
 	}
 }
 
-static void ifStatement() {
-	consume(T_LEFT_PAREN, "Expect '(' after 'if'.");
-	expression();
-	consume(T_RIGHT_PAREN, "Expect ')' after condition.");
+static void ifStatement(Parser* parser) {
+	consume(parser, T_LEFT_PAREN, "Expect '(' after 'if'.");
+	expression(parser);
+	consume(parser, T_RIGHT_PAREN, "Expect ')' after condition.");
 
-	int thenJump = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
-	statement();
+	int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+	emitByte(parser, OP_POP);
+	statement(parser);
 
-	int elseJump = emitJump(OP_JUMP);
+	int elseJump = emitJump(parser, OP_JUMP);
 
-	patchJump(thenJump);
-	emitByte(OP_POP);
-	if (match(T_ELSE))
-		patchJump(elseJump);
+	patchJump(parser, thenJump);
+	emitByte(parser, OP_POP);
+	if (match(parser, T_ELSE))
+		statement(parser);
+	patchJump(parser, elseJump);
 }
 
-static void printStatement() {
-	expression();
-	consume(T_SEMI_COLON, "Expect ';' after value.");
-	emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+	expression(parser);
+	consume(parser, T_SEMI_COLON, "Expect ';' after value.");
+	emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement() {
-	if (match(T_SEMI_COLON)) {
-		emitReturn();
+static void returnStatement(Parser* parser) {
+	if (match(parser, T_SEMI_COLON)) {
+		emitReturn(parser);
 	}
 	else {
-		if (current -> type == TYPE_INITIALIZER) {
-			error("Can't return a value from an initializer.");
+		if (parser -> compiler -> type == TYPE_INITIALIZER) {
+			error(parser, "Can't return a value from an initializer.");
 		}
-		expression();
-		consume(T_SEMI_COLON, "Expect ';' after return value.");
-		emitByte(OP_RETURN);
+		expression(parser);
+		consume(parser, T_SEMI_COLON, "Expect ';' after return value.");
+		//A call that ends the return value is in tail position. The
+		//OP_RETURN stays behind it for jumps that skip the call, as in
+		//"return a and f();".
+		if (parser -> compiler -> lastCall == currentChunk(parser) -> count - 2)
+			currentChunk(parser) -> code[parser -> compiler -> lastCall] = OP_TAIL_CALL;
+		emitByte(parser, OP_RETURN);
 	}
 }
 	
-static void whileStatement() {
-	int loopStart = currentChunk() -> count;
-	consume(T_LEFT_PAREN, "Expect '(' after 'while'.");
-	expression();
-	consume(T_RIGHT_PAREN, "Expect ')' after condition.");
+static void whileStatement(Parser* parser) {
+	int loopStart = currentChunk(parser) -> count;
+	consume(parser, T_LEFT_PAREN, "Expect '(' after 'while'.");
+	expression(parser);
+	consume(parser, T_RIGHT_PAREN, "Expect ')' after condition.");
 
-	int exitJump = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
-	statement();
-	emitLoop(loopStart);
+	int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+	emitByte(parser, OP_POP);
+	statement(parser);
+	emitLoop(parser, loopStart);
 
-	patchJump(exitJump);
-	emitByte(OP_POP);
+	patchJump(parser, exitJump);
+	emitByte(parser, OP_POP);
 }
 
-static void synchronize() {
-	parser.panicMode = false;
-	while (parser.current.type != T_EOF) {
-		if (parser.previous.type == T_SEMI_COLON)
+static void synchronize(Parser* parser) {
+	parser -> panicMode = false;
+	while (parser -> current.type != T_EOF) {
+		if (parser -> previous.type == T_SEMI_COLON)
 			return;
-		switch (parser.current.type) {
+		switch (parser -> current.type) {
 			case T_CLASS:
 			case T_FUN:
 			case T_VAR:
@@ -896,75 +1085,87 @@ static void synchronize() {
 			default:
 				;
 		}
-		advance();
+		advance(parser);
 	}
 }
 
-static void declaration() {
-	if (match(T_CLASS)) {
-		classDeclaration();
+static void declaration(Parser* parser) {
+	if (match(parser, T_CLASS)) {
+		classDeclaration(parser);
 	}
-	else if (match(T_FUN)) {
-		funDeclaration();
+	else if (match(parser, T_FUN)) {
+		funDeclaration(parser);
 	}
-	else if (match(T_VAR)) {
-		varDeclaration();
+	else if (match(parser, T_VAR)) {
+		varDeclaration(parser);
 	}
 	else {
-		statement();
+		statement(parser);
 	}
-	if (parser.panicMode)
-		synchronize();
+	if (parser -> panicMode)
+		synchronize(parser);
 }
 
-static void statement() {
-	if (match(T_PRINT)) {
-		printStatement();
+static void statement(Parser* parser) {
+	if (match(parser, T_PRINT)) {
+		printStatement(parser);
 	}
-	else if (match(T_FOR)) {
-		forStatement();
+	else if (match(parser, T_FOR)) {
+		forStatement(parser);
 	}
-	else if (match(T_IF)) {
-		ifStatement();
+	else if (match(parser, T_IF)) {
+		ifStatement(parser);
 	}
-	else if (match(T_RETURN)) {
-		returnStatement();
+	else if (match(parser, T_RETURN)) {
+		returnStatement(parser);
 	}
-	else if (match(T_WHILE)) {
-		whileStatement();
+	else if (match(parser, T_WHILE)) {
+		whileStatement(parser);
 	}
-	else if (match(T_SWITCH)) {
-		switchStatement(); //To be completed
+	else if (match(parser, T_SWITCH)) {
+		switchStatement(parser); //To be completed
 	}
-	else if (match(T_LEFT_BRACE)) {
-		beginScope();
-		block();
-		endScope();
+	else if (match(parser, T_LEFT_BRACE)) {
+		beginScope(parser);
+		block(parser);
+		endScope(parser);
 	}
 	else {
-		expressionStatement();
+		expressionStatement(parser);
 	}
 };
 
-ObjFunction* compile(const char* source) {
-	initScanner(source);
-	Compiler compiler;
-	initCompiler(&compiler, TYPE_SCRIPT);
+ObjFunction* compile(VM* vm, const char* source) {
+	Parser parser;
+	parser.vm = vm;
 	parser.hadError = false;
 	parser.panicMode = false;
-	advance();
-	while (!match(T_EOF)) {
-		declaration();
-	}
-	ObjFunction* function = endCompiler();
+	parser.compiler = NULL;
+	parser.classCompiler = NULL;
+	parser.captures = NULL;
+	parser.captureCount = 0;
+	parser.captureCapacity = 0;
+	initScanner(&parser.scanner, source);
+	vm -> parser = &parser;
+
+	Compiler compiler;
+	initCompiler(&parser, &compiler, TYPE_SCRIPT);
+	advance(&parser);
+	while (!match(&parser, T_EOF)) {
+		declaration(&parser);
+	}
+	ObjFunction* function = endCompiler(&parser);
+	FREE_ARRAY(vm, Capture, parser.captures, parser.captureCapacity);
+	vm -> parser = NULL;
 	return parser.hadError ? NULL : function;
 }
 
-void markCompilerRoots() {
-	Compiler* compiler = current;
+void markCompilerRoots(VM* vm) {
+	if (vm -> parser == NULL)
+		return;
+	Compiler* compiler = vm -> parser -> compiler;
 	while (compiler != NULL) {
-		markObject((Obj*)compiler -> function);
+		markObject(vm, (Obj*)compiler -> function);
 		compiler = compiler -> enclosing;
 	}
 }
-
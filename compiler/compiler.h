@@ -4,7 +4,7 @@
 #include "../vm/object.h"
 #include "../vm/vm.h"
 
-ObjFunction* compile(const char* source);
-void markCompilerRoots();
+ObjFunction* compile(VM* vm, const char* source);
+void markCompilerRoots(VM* vm);
 
 #endif
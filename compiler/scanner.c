@@ -3,82 +3,74 @@
 #include "../vm/common.h"
 #include "scanner.h"
 
-typedef struct {
-	const char* start;
-	const char* current;
-	int line;
-} Scanner;
-
-Scanner scanner;
-
-void initScanner(const char* source) {
-	scanner.start = source;
-	scanner.current = source;
-	scanner.line = 1;
+void initScanner(Scanner* scanner, const char* source) {
+	scanner -> start = source;
+	scanner -> current = source;
+	scanner -> line = 1;
 }
 
-static bool isAtEnd() {
-	return *scanner.current == '\0';
+static bool isAtEnd(Scanner* scanner) {
+	return *scanner -> current == '\0';
 }
 
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
 	Token token;
 	token.type = type;
-	token.start = scanner.start;
-	token.length = (int)(scanner.current - scanner.start);
-	token.line = scanner.line;
+	token.start = scanner -> start;
+	token.length = (int)(scanner -> current - scanner -> start);
+	token.line = scanner -> line;
 	return token;
 }
 
-static Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
 	Token token;
 	token.type = T_ERROR;
 	token.start = message;
 	token.length = (int)strlen(message);
-	token.line = scanner.line;
+	token.line = scanner -> line;
 	return token;
 }
 
-static char advance() {
-	scanner.current++;
-	return scanner.current[-1];
+static char advance(Scanner* scanner) {
+	scanner -> current++;
+	return scanner -> current[-1];
 }
 
-static bool match(char expected) {
-	if (isAtEnd())
+static bool match(Scanner* scanner, char expected) {
+	if (isAtEnd(scanner))
 		return false;
-	if (*scanner.current != expected)
+	if (*scanner -> current != expected)
 		return false;
-	scanner.current++;
+	scanner -> current++;
 	return true;
 }
 	
-static char peek() {
-	return *scanner.current;
+static char peek(Scanner* scanner) {
+	return *scanner -> current;
 }
 
-static char peekNext() {
-	if (isAtEnd())
+static char peekNext(Scanner* scanner) {
+	if (isAtEnd(scanner))
 		return '\0';
-	return scanner.current[1];
+	return scanner -> current[1];
 }
 
-static void skipWhiteSpace() {
+static void skipWhiteSpace(Scanner* scanner) {
 	for(;;) {
-		char c = peek();
+		char c = peek(scanner);
 		switch (c) {
 			case ' ':
 			case '\r':
 			case '\t':
-				advance();
+				advance(scanner);
 				break;
 			case '\n':
-				scanner.line++;
-				advance();
+				scanner -> line++;
+				advance(scanner);
 				break;
 			case '#':
-				while (peek() != '\n' && !isAtEnd())
-					advance();
+				while (peek(scanner) != '\n' && !isAtEnd(scanner))
+					advance(scanner);
 					break;
 			default:
 				return;
@@ -86,31 +78,31 @@ static void skipWhiteSpace() {
 	}
 }
 
-static Token String() {
-	while (peek() != '"' && !isAtEnd()) {
-		if (peek() == '\n')
-			scanner.line++;
-		advance();
+static Token String(Scanner* scanner) {
+	while (peek(scanner) != '"' && !isAtEnd(scanner)) {
+		if (peek(scanner) == '\n')
+			scanner -> line++;
+		advance(scanner);
 	}
-	if (isAtEnd())
-		return errorToken("Unterminated String.");
-	advance();
-	return makeToken(T_STRING);
+	if (isAtEnd(scanner))
+		return errorToken(scanner, "Unterminated String.");
+	advance(scanner);
+	return makeToken(scanner, T_STRING);
 }
 
 static bool isDigit(char c) {
 	return c >= '0' && c <= '9';
 }
 
-static Token Number() {
-	while (isDigit(peek()))
-		advance();
-	if (peek() == '.' && isDigit(peekNext())) {
-		advance();
-		while (isDigit(peek()))
-			advance();
+static Token Number(Scanner* scanner) {
+	while (isDigit(peek(scanner)))
+		advance(scanner);
+	if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
+		advance(scanner);
+		while (isDigit(peek(scanner)))
+			advance(scanner);
 	}
-	return makeToken(T_NUMBER);
+	return makeToken(scanner, T_NUMBER);
 }
 
 static bool isAlpha(char c) {
@@ -119,89 +111,92 @@ static bool isAlpha(char c) {
 		c == '_');
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-	if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0) {
+static TokenType checkKeyword(Scanner* scanner, int start, int length, const char* rest, TokenType type) {
+	if (scanner -> current - scanner -> start == start + length && memcmp(scanner -> start + start, rest, length) == 0) {
 		return type;
 	}
 	return T_IDENTIFIER;
 }
 
-static TokenType identifierType() {
-	switch (scanner.start[0]) {
+static TokenType identifierType(Scanner* scanner) {
+	switch (scanner -> start[0]) {
 		case 'a':
-			return checkKeyword(1, 2, "nd", T_AND);
+			return checkKeyword(scanner, 1, 2, "nd", T_AND);
 		case 'e':
-			return checkKeyword(1, 3, "lse", T_ELSE);
+			return checkKeyword(scanner, 1, 3, "lse", T_ELSE);
 		case 'n':
-			return checkKeyword(1, 2, "il", T_NIL);
+			return checkKeyword(scanner, 1, 2, "il", T_NIL);
 		case 'o':
-			return checkKeyword(1, 1, "r", T_OR);
+			return checkKeyword(scanner, 1, 1, "r", T_OR);
 		case 'p':
-			return checkKeyword(1, 4, "rint", T_PRINT);
+			return checkKeyword(scanner, 1, 4, "rint", T_PRINT);
 		case 'r':
-			return checkKeyword(1, 5, "eturn", T_RETURN);
+			return checkKeyword(scanner, 1, 5, "eturn", T_RETURN);
 		case 'v':
-			return checkKeyword(1, 2, "ar", T_VAR);
+			return checkKeyword(scanner, 1, 2, "ar", T_VAR);
 		case 'w':
-			return checkKeyword(1, 4, "hile", T_WHILE);
+			return checkKeyword(scanner, 1, 4, "hile", T_WHILE);
 		case 'd':
-			return checkKeyword(1, 6, "efault", T_DEFAULT);
+			return checkKeyword(scanner, 1, 6, "efault", T_DEFAULT);
 		case 'c':
-			if (scanner.current - scanner.start > 1) {
-				switch(scanner.start[1]) {
+			if (scanner -> current - scanner -> start > 1) {
+				switch(scanner -> start[1]) {
 					case 'l':
-						return checkKeyword(2, 3, "ass", T_CLASS);
+						return checkKeyword(scanner, 2, 3, "ass", T_CLASS);
 					case 'a':
-						return checkKeyword(2, 2, "se", T_CASE);
+						return checkKeyword(scanner, 2, 2, "se", T_CASE);
 				}
 			}
+			break;
 		case 's':
-			if (scanner.current - scanner.start > 1) {
-				switch(scanner.start[1]) {
+			if (scanner -> current - scanner -> start > 1) {
+				switch(scanner -> start[1]) {
 					case 'u':
-						return checkKeyword(2, 3, "uper", T_SUPER);
+						return checkKeyword(scanner, 2, 3, "per", T_SUPER);
 					case 'w':
-						return checkKeyword(2, 4, "itch", T_SWITCH);
+						return checkKeyword(scanner, 2, 4, "itch", T_SWITCH);
 				}
 			}
+			break;
 		case 'i':
-			if (scanner.current - scanner.start > 1) {
-				switch(scanner.start[1]) {
+			if (scanner -> current - scanner -> start > 1) {
+				switch(scanner -> start[1]) {
 					case 'm':
-						return checkKeyword(2, 4, "port", T_IMPORT);
+						return checkKeyword(scanner, 2, 4, "port", T_IMPORT);
 					case 'f':
-						return checkKeyword(1, 0, "", T_IF);
+						return checkKeyword(scanner, 2, 0, "", T_IF);
 				}
 			}
+			break;
 		case '.':
-			if (scanner.current - scanner.start > 1) {
-				switch(scanner.start[1]) {
+			if (scanner -> current - scanner -> start > 1) {
+				switch(scanner -> start[1]) {
 					case 'h':
-						return checkKeyword(2, 3, "elp", T_HELP);
+						return checkKeyword(scanner, 2, 3, "elp", T_HELP);
 					case 'e':
-						return checkKeyword(2, 3, "xit", T_EXIT);
+						return checkKeyword(scanner, 2, 3, "xit", T_EXIT);
 				}
 			}
 			break;
 		case 'f':
-			if (scanner.current - scanner.start > 1) {
-				switch (scanner.start[1]) {
+			if (scanner -> current - scanner -> start > 1) {
+				switch (scanner -> start[1]) {
 					case 'a':
-						return checkKeyword(2, 3, "lse", T_FALSE);
+						return checkKeyword(scanner, 2, 3, "lse", T_FALSE);
 					case 'o':
-						return checkKeyword(2, 1, "r", T_OR);
+						return checkKeyword(scanner, 2, 1, "r", T_FOR);
 					case 'u':
-						return checkKeyword(2, 1, "n", T_FUN);
+						return checkKeyword(scanner, 2, 1, "n", T_FUN);
 				}
 			}
 			break;
 		case 't':
-			if (scanner.current - scanner.start > 1) {
-				switch (scanner.start[1]) {
+			if (scanner -> current - scanner -> start > 1) {
+				switch (scanner -> start[1]) {
 					case 'h':
-						return checkKeyword(2, 3, "his", T_THIS);
+						return checkKeyword(scanner, 2, 3, "his", T_THIS);
 					case 'r':
-						return checkKeyword(2, 2, "ue", T_TRUE);
+						return checkKeyword(scanner, 2, 2, "ue", T_TRUE);
 				}
 			}
 			break;
@@ -209,61 +204,73 @@ static TokenType identifierType() {
 	return T_IDENTIFIER;
 }
 
-static Token identifier() {
-	while (isAlpha(peek()) || isDigit(peek()))
-		advance();
-	return makeToken(identifierType());
+static Token identifier(Scanner* scanner) {
+	while (isAlpha(peek(scanner)) || isDigit(peek(scanner)))
+		advance(scanner);
+	return makeToken(scanner, identifierType(scanner));
 }
 
-Token scanToken() {
-	skipWhiteSpace();
-	scanner.start = scanner.current;
-	if (isAtEnd()) 
-		return makeToken(T_EOF);
-	char c = advance();
+Token scanToken(Scanner* scanner) {
+	skipWhiteSpace(scanner);
+	scanner -> start = scanner -> current;
+	if (isAtEnd(scanner)) 
+		return makeToken(scanner, T_EOF);
+	char c = advance(scanner);
 	if (isAlpha(c))
-		return identifier();
+		return identifier(scanner);
 	if (isDigit(c))
-		return Number();
+		return Number(scanner);
 	switch(c) {
 		case '(':
-			return makeToken(T_LEFT_PAREN);
+			return makeToken(scanner, T_LEFT_PAREN);
 		case ')':
-			return makeToken(T_RIGHT_PAREN);
+			return makeToken(scanner, T_RIGHT_PAREN);
 		case '{':
-			return makeToken(T_LEFT_BRACE);
+			return makeToken(scanner, T_LEFT_BRACE);
 		case '}':
-			return makeToken(T_RIGHT_BRACE);
+			return makeToken(scanner, T_RIGHT_BRACE);
 		case ';':
-			return makeToken(T_SEMI_COLON);
+			return makeToken(scanner, T_SEMI_COLON);
 		case ',':
-			return makeToken(T_COMMA);
+			return makeToken(scanner, T_COMMA);
 		case '.':
-			return makeToken(T_DOT);
+			return makeToken(scanner, T_DOT);
 		case '-':
-			return makeToken(T_MINUS);
+			return makeToken(scanner, T_MINUS);
 		case '+':
-			return makeToken(T_PLUS);
+			return makeToken(scanner, T_PLUS);
 		case '/':
-			return makeToken(T_SLASH);
+			return makeToken(scanner, T_SLASH);
 		case '*':
-			return makeToken(T_STAR);
+			return makeToken(scanner, T_STAR);
+		case '%':
+			return makeToken(scanner, T_PERCENT);
+		case '&':
+			return makeToken(scanner, T_AMPERSAND);
+		case '|':
+			return makeToken(scanner, T_PIPE);
+		case '^':
+			return makeToken(scanner, T_CARET);
 		case '!':
-			return makeToken(
-				match('=') ? T_BANG_EQUAL : T_BANG);
+			return makeToken(scanner, 
+				match(scanner, '=') ? T_BANG_EQUAL : T_BANG);
 		case '=':
-			return makeToken(
-				match('=') ? T_EQUAL_EQUAL : T_EQUAL);
+			return makeToken(scanner, 
+				match(scanner, '=') ? T_EQUAL_EQUAL : T_EQUAL);
 		case '<':
-			return makeToken(
-				match('=') ? T_LESS_EQUAL : T_LESS);
+			if (match(scanner, '<'))
+				return makeToken(scanner, T_LESS_LESS);
+			return makeToken(scanner, 
+				match(scanner, '=') ? T_LESS_EQUAL : T_LESS);
 		case '>':
-			return makeToken(
-				match('=') ? T_GREATER_EQUAL : T_GREATER);
+			if (match(scanner, '>'))
+				return makeToken(scanner, T_GREATER_GREATER);
+			return makeToken(scanner, 
+				match(scanner, '=') ? T_GREATER_EQUAL : T_GREATER);
 		case ':': 
-			return makeToken(T_COLON);
+			return makeToken(scanner, T_COLON);
 		case '"':
-			return String();
+			return String(scanner);
 	}
-	return errorToken("Unexpected character.");
+	return errorToken(scanner, "Unexpected character.");
 }
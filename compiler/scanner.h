@@ -5,9 +5,11 @@ typedef enum {
 	T_LEFT_PAREN, T_RIGHT_PAREN, T_LEFT_BRACE,
        	T_RIGHT_BRACE, T_COMMA, T_DOT, T_MINUS, T_PLUS, 
 	T_SEMI_COLON, T_SLASH, T_STAR, T_COLON,
+	T_PERCENT, T_AMPERSAND, T_PIPE, T_CARET,
 	
 	T_BANG, T_BANG_EQUAL, T_EQUAL, T_EQUAL_EQUAL, T_GREATER,
 	T_GREATER_EQUAL, T_LESS, T_LESS_EQUAL,
+	T_LESS_LESS, T_GREATER_GREATER,
 
 	T_IDENTIFIER, T_STRING, T_NUMBER,
 
@@ -27,7 +29,13 @@ typedef struct {
 	int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+typedef struct {
+	const char* start;
+	const char* current;
+	int line;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
 
 #endif